@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../standalone/checksum.h"
+
+/*
+ * Benchmark of the checksum paths: the original 16-bit loop, the scalar, SSE2 and AVX2 sums
+ * and the dispatched checksum(), over buffer lengths from an IP header to a full 64 KiB GSO
+ * segment. Every case doubles its iteration count until one round takes BENCH_MIN_SEC and
+ * reports that round in ns/op and MB/s. Paths the CPU lacks are left out.
+ */
+
+#define BENCH_MIN_SEC 0.2
+#define MAX_LEN 65536
+
+static const size_t lengths[] = {20, 40, 64, 576, 1000, 1500, 9000, MAX_LEN};
+
+static volatile uint64_t sink;
+
+/**
+ * checksum_reference - the checksum as standalone.c computed it before checksum.h
+ * @param buf
+ * @param size
+ * @return
+ */
+unsigned short checksum_reference(const char *buf, unsigned size) {
+    unsigned sum = 0, i;
+    for (i = 0; i + 1 < size; i += 2) {
+        unsigned short word16;
+        memcpy(&word16, &buf[i], sizeof(word16));
+        sum += word16;
+    }
+    if (size & 1) {
+        unsigned short word16 = (unsigned char) buf[i];
+        sum += word16;
+    }
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return (unsigned short) ~sum;
+}
+
+uint64_t add_reference(const unsigned char *p, size_t len, uint64_t sum) {
+    return sum + checksum_reference((const char *) p, (unsigned) len);
+}
+
+uint64_t add_dispatched(const unsigned char *p, size_t len, uint64_t sum) {
+    return sum + checksum((const char *) p, (unsigned) len);
+}
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * bench_run - time one checksum path over one length and print ns/op and MB/s
+ * @param name
+ * @param fn
+ * @param buf
+ * @param len
+ */
+void bench_run(const char *name, checksum_add_fn fn, const unsigned char *buf, size_t len) {
+    long iters = 1;
+    double elapsed;
+    while (1) {
+        uint64_t sum = 0;
+        double start = now_sec();
+        for (long i = 0; i < iters; i++) {
+            sum = fn(buf, len, sum);
+        }
+        elapsed = now_sec() - start;
+        sink += sum;
+        if (elapsed >= BENCH_MIN_SEC || iters >= (1L << 40)) {
+            break;
+        }
+        iters *= 2;
+    }
+    double ns = elapsed * 1e9 / (double) iters;
+    printf("%-10s %8zu %12.1f %12.1f\n", name, len, ns, (double) len * 1e3 / ns);
+}
+
+/**
+ * main
+ * @return
+ */
+int main(void) {
+    static unsigned char buffer[MAX_LEN];
+    srand(1);
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = (unsigned char) rand();
+    }
+    int sse2 = 0, avx2 = 0;
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    printf("%-10s %8s %12s %12s\n", "path", "bytes", "ns/op", "MB/s");
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        size_t len = lengths[i];
+        bench_run("reference", add_reference, buffer, len);
+        bench_run("scalar", checksum_add_scalar, buffer, len);
+#ifdef CHECKSUM_X86
+        if (sse2) {
+            bench_run("sse2", checksum_add_sse2, buffer, len);
+        }
+        if (avx2) {
+            bench_run("avx2", checksum_add_avx2, buffer, len);
+        }
+#endif
+        bench_run("checksum", add_dispatched, buffer, len);
+    }
+    return 0;
+}
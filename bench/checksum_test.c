@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../standalone/checksum.h"
+
+/*
+ * Randomized equivalence test of the checksum paths: the scalar, SSE2 and AVX2 sums, the
+ * dispatched checksum() and a sum taken in pieces must all agree with the original 16-bit
+ * loop over every length up to MAX_LEN, odd ones included, at every offset up to MAX_OFFSET
+ * so the vector loads run unaligned. Exits non-zero on the first mismatch.
+ */
+
+#define MAX_LEN 2048
+#define MAX_OFFSET 32
+#define ROUNDS 4
+
+/**
+ * checksum_reference - the checksum as standalone.c computed it before checksum.h
+ * @param buf
+ * @param size
+ * @return
+ */
+unsigned short checksum_reference(const char *buf, unsigned size) {
+    unsigned sum = 0, i;
+    for (i = 0; i + 1 < size; i += 2) {
+        unsigned short word16;
+        memcpy(&word16, &buf[i], sizeof(word16));
+        sum += word16;
+    }
+    if (size & 1) {
+        unsigned short word16 = (unsigned char) buf[i];
+        sum += word16;
+    }
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return (unsigned short) ~sum;
+}
+
+/**
+ * check - compare one result against the reference
+ * @param name
+ * @param got
+ * @param want
+ * @param len
+ * @param offset
+ * @return 0 if they agree, -1 otherwise
+ */
+int check(const char *name, uint16_t got, uint16_t want, size_t len, size_t offset) {
+    if (got == want) {
+        return 0;
+    }
+    fprintf(stderr, "%s: length %zu offset %zu: 0x%04x, expected 0x%04x\n", name, len, offset, got, want);
+    return -1;
+}
+
+/**
+ * main
+ * @param argc
+ * @param argv optional seed
+ * @return
+ */
+int main(int argc, char **argv) {
+    unsigned seed = argc > 1 ? (unsigned) strtoul(argv[1], NULL, 10) : (unsigned) time(NULL);
+    srand(seed);
+    static unsigned char buffer[MAX_LEN + MAX_OFFSET];
+    int sse2 = 0, avx2 = 0;
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    long cases = 0;
+    int failed = 0;
+    for (int round = 0; round < ROUNDS && !failed; round++) {
+        /* all ones words from the last round push the lane sums hardest */
+        for (size_t i = 0; i < sizeof(buffer); i++) {
+            buffer[i] = round == ROUNDS - 1 ? 0xFF : (unsigned char) rand();
+        }
+        for (size_t offset = 0; offset < MAX_OFFSET && !failed; offset++) {
+            for (size_t len = 0; len <= MAX_LEN && !failed; len++) {
+                const unsigned char *p = buffer + offset;
+                uint16_t want = checksum_reference((const char *) p, (unsigned) len);
+                failed |= check("scalar", checksum_fold(checksum_add_scalar(p, len, 0)), want, len, offset);
+#ifdef CHECKSUM_X86
+                if (sse2) {
+                    failed |= check("sse2", checksum_fold(checksum_add_sse2(p, len, 0)), want, len, offset);
+                }
+                if (avx2) {
+                    failed |= check("avx2", checksum_fold(checksum_add_avx2(p, len, 0)), want, len, offset);
+                }
+#endif
+                failed |= check("checksum", checksum((const char *) p, (unsigned) len), want, len, offset);
+                size_t split = len > 0 ? ((size_t) rand() % len) & ~(size_t) 1 : 0;
+                failed |= check("pieces", checksum_fold(checksum_add(p + split, len - split,
+                                                                     checksum_add(p, split, 0))),
+                                want, len, offset);
+                cases++;
+            }
+        }
+    }
+    printf("%s: %ld cases, seed %u, sse2 %s, avx2 %s\n", failed ? "FAILED" : "ok", cases, seed,
+           sse2 ? "tested" : "not supported", avx2 ? "tested" : "not supported");
+    return failed ? EXIT_FAILURE : 0;
+}
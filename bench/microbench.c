@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "../standalone/config.h"
+#include "../standalone/cJSON.h"
+#include "../standalone/checksum.h"
+#include "../standalone/marker.h"
+#include "../standalone/mono_clock.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/*
+ * Microbenchmarks of the per-packet work on the probing paths. Every benchmark doubles its
+ * iteration count until one round takes BENCH_MIN_SEC and reports that round. Allocations
+ * are counted by wrapping the glibc allocator.
+ */
+
+#define BENCH_MIN_SEC 0.2
+#define BATCH 32
+#define PAYLOAD_SIZE 1000
+#define RCVBUF (8 * 1024 * 1024)
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long alloc_count = 0;
+
+void* malloc(size_t size) {
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    alloc_count++;
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+
+/**
+ * A benchmark body runs iters operations and returns the seconds spent in the part being
+ * measured, so setup and draining can happen inside it untimed
+ */
+typedef double (*bench_fn)(void* ctx, long iters);
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Run a benchmark and print ns/op, ops/s, MB/s and allocations per op
+ * @param name
+ * @param fn
+ * @param ctx
+ * @param bytes_per_op 0 to leave out the throughput
+ */
+void bench_run(const char* name, bench_fn fn, void* ctx, double bytes_per_op) {
+    long iters = 1;
+    double elapsed;
+    unsigned long allocs;
+    while (1) {
+        unsigned long before = alloc_count;
+        elapsed = fn(ctx, iters);
+        allocs = alloc_count - before;
+        if (elapsed >= BENCH_MIN_SEC || iters >= (1L << 40)) {
+            break;
+        }
+        iters *= 2;
+    }
+    double ns = elapsed * 1e9 / (double) iters;
+    printf("%-32s %12.1f %14.0f", name, ns, 1e9 / ns);
+    if (bytes_per_op > 0) {
+        printf(" %10.1f", bytes_per_op * 1e3 / ns);
+    } else {
+        printf(" %10s", "-");
+    }
+    printf(" %10.3f\n", (double) allocs / (double) iters);
+}
+
+/* payload preparation */
+
+struct payload_ctx {
+    char buffer[PAYLOAD_SIZE];
+};
+
+double bench_seq_stamp(void* arg, long iters) {
+    struct payload_ctx* ctx = (struct payload_ctx*) arg;
+    volatile char* buffer = ctx->buffer;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        buffer[0] = (char) ((i >> 8) & 0xFF);
+        buffer[1] = (char) (i & 0xFF);
+    }
+    return now_sec() - start;
+}
+
+double bench_random_bytes(void* arg, long iters) {
+    struct payload_ctx* ctx = (struct payload_ctx*) arg;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        get_random_byte(PAYLOAD_SIZE, ctx->buffer);
+    }
+    return now_sec() - start;
+}
+
+/* arrival timestamps */
+
+double bench_gettimeofday(void* arg, long iters) {
+    (void) arg;
+    struct timeval tv;
+    volatile long sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        gettimeofday(&tv, NULL);
+        sink += tv.tv_usec;
+    }
+    return now_sec() - start;
+}
+
+double bench_mono_raw(void* arg, long iters) {
+    (void) arg;
+    volatile int64_t sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        sink += mono_now_ns();
+    }
+    return now_sec() - start;
+}
+
+double bench_mono_fast(void* arg, long iters) {
+    (void) arg;
+    volatile int64_t sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        sink += mono_fast_ns();
+    }
+    return now_sec() - start;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+double bench_rdtscp(void* arg, long iters) {
+    (void) arg;
+    unsigned int aux;
+    volatile uint64_t sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        sink += __rdtscp(&aux);
+    }
+    return now_sec() - start;
+}
+#endif
+
+/**
+ * tsc_verified - switch mono_fast_ns to the TSC the way the server does, then check that
+ * the calibrated stamps stay within 100 us of CLOCK_MONOTONIC_RAW over 50 ms
+ * @return 1 if mono_fast_ns reads a sane TSC, 0 if it falls back to the raw clock
+ */
+int tsc_verified(void) {
+    if (strcmp(mono_clock_setup("tsc"), "tsc") != 0 || mono_tsc.ns_per_tick <= 0) {
+        return 0;
+    }
+    int64_t raw0 = mono_now_ns(), fast0 = mono_fast_ns();
+    struct timespec pause = {0, 50000000L};
+    nanosleep(&pause, NULL);
+    int64_t raw1 = mono_now_ns(), fast1 = mono_fast_ns();
+    if (llabs(fast0 - raw0) > 100000 || llabs(fast1 - raw1) > 100000) {
+        fprintf(stderr, "Warning: TSC calibration is off by %lld ns, benchmarking the raw clock\n",
+                (long long) (fast1 - raw1));
+        mono_clock_setup("raw");
+        return 0;
+    }
+    printf("%-32s %.4f ns/tick, %lld ns off the raw clock after 50 ms\n", "TSC calibration",
+           mono_tsc.ns_per_tick, (long long) (fast1 - raw1));
+    return 1;
+}
+
+double bench_mono_from_realtime(void* arg, long iters) {
+    (void) arg;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    volatile int64_t sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        sink += mono_from_realtime(&ts);
+    }
+    return now_sec() - start;
+}
+
+/* checksums */
+
+double bench_checksum_header(void* arg, long iters) {
+    const char* data = (const char*) arg;
+    volatile unsigned short sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        sink += checksum(data, sizeof(struct iphdr));
+    }
+    return now_sec() - start;
+}
+
+double bench_checksum_payload(void* arg, long iters) {
+    const char* data = (const char*) arg;
+    volatile unsigned short sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        sink += checksum(data, PAYLOAD_SIZE);
+    }
+    return now_sec() - start;
+}
+
+/* markers */
+
+double bench_syn_build(void* arg, long iters) {
+    struct marker_template* tpl = (struct marker_template*) arg;
+    in_addr_t saddr = inet_addr("192.168.128.2"), daddr = inet_addr("192.168.128.3");
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        syn_template_init(tpl, saddr, daddr, MARKER_SRC_PORT, 9999);
+    }
+    return now_sec() - start;
+}
+
+double bench_syn_stamp(void* arg, long iters) {
+    struct marker_template* tpl = (struct marker_template*) arg;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        marker_template_set_id(tpl, (uint16_t) i);
+        marker_template_set_key(tpl, (uint32_t) i);
+    }
+    return now_sec() - start;
+}
+
+/* configuration */
+
+double bench_config_parse(void* arg, long iters) {
+    const char* json = (const char*) arg;
+    struct config cf;
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        FILE* file = fmemopen((void*) json, strlen(json), "r");
+        cJSON* root = read_file_config(file);
+        get_configuration(&cf, root);
+        cJSON_Delete(root);
+    }
+    return now_sec() - start;
+}
+
+/* loopback UDP */
+
+struct udp_ctx {
+    int tx;
+    int rx;
+    struct sockaddr_in dst;
+    char payload[BATCH * PAYLOAD_SIZE];
+    struct mmsghdr msgs[BATCH];     /* addressed to the receiver */
+    struct iovec iovs[BATCH];
+    char rx_payload[BATCH * PAYLOAD_SIZE];
+    struct mmsghdr rx_msgs[BATCH];  /* no address, so receiving leaves dst alone */
+    struct iovec rx_iovs[BATCH];
+};
+
+/**
+ * Receive everything queued on the receiver, untimed
+ * @param ctx
+ */
+void udp_drain(struct udp_ctx* ctx) {
+    while (recvmmsg(ctx->rx, ctx->rx_msgs, BATCH, MSG_DONTWAIT, NULL) > 0) {
+    }
+}
+
+/**
+ * Point the message vectors at the payloads, the send side addressed to the receiver;
+ * the calls only write back the lengths, so this is done once
+ * @param ctx
+ */
+void udp_msgs_init(struct udp_ctx* ctx) {
+    memset(ctx->msgs, 0, sizeof(ctx->msgs));
+    memset(ctx->rx_msgs, 0, sizeof(ctx->rx_msgs));
+    for (int i = 0; i < BATCH; i++) {
+        ctx->iovs[i].iov_base = ctx->payload + i * PAYLOAD_SIZE;
+        ctx->iovs[i].iov_len = PAYLOAD_SIZE;
+        ctx->msgs[i].msg_hdr.msg_iov = &ctx->iovs[i];
+        ctx->msgs[i].msg_hdr.msg_iovlen = 1;
+        ctx->msgs[i].msg_hdr.msg_name = &ctx->dst;
+        ctx->msgs[i].msg_hdr.msg_namelen = sizeof(ctx->dst);
+        ctx->rx_iovs[i].iov_base = ctx->rx_payload + i * PAYLOAD_SIZE;
+        ctx->rx_iovs[i].iov_len = PAYLOAD_SIZE;
+        ctx->rx_msgs[i].msg_hdr.msg_iov = &ctx->rx_iovs[i];
+        ctx->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+void udp_setup(struct udp_ctx* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->rx = socket(AF_INET, SOCK_DGRAM, 0);
+    ctx->tx = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ctx->rx < 0 || ctx->tx < 0) {
+        perror("Error creating socket");
+        exit(EXIT_FAILURE);
+    }
+    int rcvbuf = RCVBUF;
+    if (setsockopt(ctx->rx, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        setsockopt(ctx->rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    ctx->dst.sin_family = AF_INET;
+    ctx->dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(ctx->dst);
+    if (bind(ctx->rx, (struct sockaddr*) &ctx->dst, sizeof(ctx->dst)) < 0 ||
+        getsockname(ctx->rx, (struct sockaddr*) &ctx->dst, &len) < 0) {
+        perror("Error binding receiver");
+        exit(EXIT_FAILURE);
+    }
+    udp_msgs_init(ctx);
+}
+
+double bench_sendto(void* arg, long iters) {
+    struct udp_ctx* ctx = (struct udp_ctx*) arg;
+    double elapsed = 0;
+    for (long done = 0; done < iters; done += BATCH) {
+        double start = now_sec();
+        for (int i = 0; i < BATCH; i++) {
+            if (sendto(ctx->tx, ctx->payload, PAYLOAD_SIZE, 0, (struct sockaddr*) &ctx->dst, sizeof(ctx->dst)) < 0) {
+                perror("Error sending");
+                exit(EXIT_FAILURE);
+            }
+        }
+        elapsed += now_sec() - start;
+        udp_drain(ctx);
+    }
+    return elapsed * (double) iters / (double) (((iters + BATCH - 1) / BATCH) * BATCH);
+}
+
+double bench_sendmmsg(void* arg, long iters) {
+    struct udp_ctx* ctx = (struct udp_ctx*) arg;
+    double elapsed = 0;
+    for (long done = 0; done < iters; done += BATCH) {
+        double start = now_sec();
+        if (sendmmsg(ctx->tx, ctx->msgs, BATCH, 0) != BATCH) {
+            perror("Error sending");
+            exit(EXIT_FAILURE);
+        }
+        elapsed += now_sec() - start;
+        udp_drain(ctx);
+    }
+    return elapsed * (double) iters / (double) (((iters + BATCH - 1) / BATCH) * BATCH);
+}
+
+double bench_gso(void* arg, long iters) {
+    struct udp_ctx* ctx = (struct udp_ctx*) arg;
+    int segments = 65000 / PAYLOAD_SIZE < BATCH ? 65000 / PAYLOAD_SIZE : BATCH;
+    double elapsed = 0;
+    long sent = 0;
+    while (sent < iters) {
+        double start = now_sec();
+        if (sendto(ctx->tx, ctx->payload, segments * PAYLOAD_SIZE, 0, (struct sockaddr*) &ctx->dst,
+                   sizeof(ctx->dst)) < 0) {
+            perror("Error sending with UDP_SEGMENT");
+            exit(EXIT_FAILURE);
+        }
+        elapsed += now_sec() - start;
+        sent += segments;
+        udp_drain(ctx);
+    }
+    return elapsed * (double) iters / (double) sent;
+}
+
+/**
+ * Queue a batch on the receiver, untimed
+ * @param ctx
+ */
+void udp_fill(struct udp_ctx* ctx) {
+    if (sendmmsg(ctx->tx, ctx->msgs, BATCH, 0) != BATCH) {
+        perror("Error sending");
+        exit(EXIT_FAILURE);
+    }
+}
+
+double bench_recvfrom(void* arg, long iters) {
+    struct udp_ctx* ctx = (struct udp_ctx*) arg;
+    char buffer[PAYLOAD_SIZE];
+    struct sockaddr_in from;
+    socklen_t len;
+    double elapsed = 0;
+    for (long done = 0; done < iters; done += BATCH) {
+        udp_fill(ctx);
+        double start = now_sec();
+        for (int i = 0; i < BATCH; i++) {
+            len = sizeof(from);
+            if (recvfrom(ctx->rx, buffer, PAYLOAD_SIZE, 0, (struct sockaddr*) &from, &len) < 0) {
+                perror("Error receiving");
+                exit(EXIT_FAILURE);
+            }
+        }
+        elapsed += now_sec() - start;
+    }
+    return elapsed * (double) iters / (double) (((iters + BATCH - 1) / BATCH) * BATCH);
+}
+
+double bench_recvmmsg(void* arg, long iters) {
+    struct udp_ctx* ctx = (struct udp_ctx*) arg;
+    double elapsed = 0;
+    for (long done = 0; done < iters; done += BATCH) {
+        udp_fill(ctx);
+        double start = now_sec();
+        for (int got = 0; got < BATCH;) {
+            int n = recvmmsg(ctx->rx, ctx->rx_msgs + got, BATCH - got, 0, NULL);
+            if (n < 0) {
+                perror("Error receiving");
+                exit(EXIT_FAILURE);
+            }
+            got += n;
+        }
+        elapsed += now_sec() - start;
+    }
+    return elapsed * (double) iters / (double) (((iters + BATCH - 1) / BATCH) * BATCH);
+}
+
+/**
+ * main
+ * @param argc
+ * @param argv
+ * @return
+ */
+int main(int argc, char *argv[]) {
+    (void) argc;
+    (void) argv;
+    static const char config_json[] =
+        "{\"server_ip\": \"192.168.128.3\", \"pre_probe_port\": \"7777\", \"post_probe_port\": \"6666\", "
+        "\"src_port_udp\": \"9876\", \"dst_port_udp\": \"8765\", \"dst_port_tcp_head\": \"9999\", "
+        "\"dst_port_tcp_tail\": \"8888\", \"udp_payload_size\": \"1000\", \"inter_measure_time\": \"15\", "
+        "\"num_udp_packets\": \"6000\", \"udp_ttl\": \"255\", \"target_train_ms\": \"200\"}";
+
+    printf("%-32s %12s %14s %10s %10s\n", "benchmark", "ns/op", "ops/s", "MB/s", "allocs/op");
+
+    struct payload_ctx payload;
+    memset(&payload, 0, sizeof(payload));
+    bench_run("payload seq stamp", bench_seq_stamp, &payload, 0);
+    if (access("random_file", R_OK) == 0) {
+        bench_run("payload get_random_byte", bench_random_bytes, &payload, PAYLOAD_SIZE);
+    } else {
+        printf("%-32s skipped, no random_file in the working directory\n", "payload get_random_byte");
+    }
+
+    bench_run("gettimeofday", bench_gettimeofday, NULL, 0);
+    bench_run("mono_now_ns, CLOCK_MONOTONIC_RAW", bench_mono_raw, NULL, 0);
+    if (tsc_verified()) {
+        bench_run("mono_fast_ns, TSC", bench_mono_fast, NULL, 0);
+#if defined(__x86_64__) || defined(__i386__)
+        /* under some hypervisors rdtscp alone costs as much as the vDSO clock */
+        bench_run("rdtscp instruction", bench_rdtscp, NULL, 0);
+#endif
+    } else {
+        bench_run("mono_fast_ns, raw fallback", bench_mono_fast, NULL, 0);
+    }
+    bench_run("mono_from_realtime", bench_mono_from_realtime, NULL, 0);
+
+    char data[PAYLOAD_SIZE];
+    for (int i = 0; i < PAYLOAD_SIZE; i++) {
+        data[i] = (char) rand();
+    }
+    bench_run("checksum ip header", bench_checksum_header, data, sizeof(struct iphdr));
+    bench_run("checksum 1000 byte payload", bench_checksum_payload, data, PAYLOAD_SIZE);
+
+    struct marker_template tpl;
+    bench_run("syn build, full checksums", bench_syn_build, &tpl, 0);
+    bench_run("syn stamp id and key, rfc 1624", bench_syn_stamp, &tpl, 0);
+
+    bench_run("config read and parse", bench_config_parse, (void*) config_json, sizeof(config_json) - 1);
+
+    struct udp_ctx* udp = (struct udp_ctx*) __libc_malloc(sizeof(struct udp_ctx));
+    udp_setup(udp);
+    bench_run("loopback sendto", bench_sendto, udp, PAYLOAD_SIZE);
+    bench_run("loopback sendmmsg", bench_sendmmsg, udp, PAYLOAD_SIZE);
+    int segment = PAYLOAD_SIZE;
+    if (setsockopt(udp->tx, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0) {
+        bench_run("loopback sendto UDP_SEGMENT", bench_gso, udp, PAYLOAD_SIZE);
+        segment = 0;
+        setsockopt(udp->tx, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+    } else {
+        printf("%-32s skipped, %s\n", "loopback sendto UDP_SEGMENT", strerror(errno));
+    }
+    bench_run("loopback recvfrom", bench_recvfrom, udp, PAYLOAD_SIZE);
+    bench_run("loopback recvmmsg", bench_recvmmsg, udp, PAYLOAD_SIZE);
+    close(udp->tx);
+    close(udp->rx);
+    free(udp);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#!/usr/bin/env bash
+#
+# End-to-end benchmark: runs the client/server pair and the standalone tool across
+# network namespaces joined by veth pairs, over a plain tbf bottleneck (no compression)
+# or the compressing middlebox emulator, and records verdicts and timing as CSV.
+#
+# Every run gets fresh namespaces, so no socket or neighbour state leaks between runs.
+# Needs root, iproute2 and gcc. Sweeps are set through the environment, for example
+#   sudo BENCH_TOOLS=standalone BENCH_RATES="10 50" ./bench/run_bench.sh
+#
+
+set -euo pipefail
+
+REPO="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+TOOLS="${BENCH_TOOLS:-client_server standalone}"
+MODES="${BENCH_MODES:-tbf zlib}"            # tbf: kernel shaping, zlib: compressing middlebox
+RATES="${BENCH_RATES:-10 50}"               # Mbps
+PAYLOADS="${BENCH_PAYLOADS:-500 1000 1400}" # UDP payload bytes
+TRAINS="${BENCH_TRAINS:-1000 3000}"         # packets per train
+REPEAT="${BENCH_REPEAT:-1}"
+OUT="${BENCH_OUT:-$REPO/bench/results/$(date +%Y%m%d-%H%M%S)}"
+
+NS_C="cdbench-c-$$"
+NS_M="cdbench-m-$$"
+NS_S="cdbench-s-$$"
+CLIENT_IP=10.203.0.2
+SERVER_IP=10.203.0.3
+FRAME_OVERHEAD=42   # Ethernet, IPv4 and UDP headers, counted by tbf and the emulator alike
+
+BIN="$OUT/bin"
+MB_PID=""
+
+build() {
+    mkdir -p "$BIN"
+    gcc -O2 "$REPO/client_server/compdetect_client.c" "$REPO/client_server/cJSON.c" -o "$BIN/compdetect_client" -lm
+    gcc -O2 "$REPO/client_server/compdetect_server.c" "$REPO/client_server/cJSON.c" -o "$BIN/compdetect_server" -lm
+    gcc -O2 "$REPO/standalone/standalone.c" "$REPO/standalone/cJSON.c" -o "$BIN/standalone" -lpthread
+    gcc -O2 "$REPO/middlebox/middlebox.c" -o "$BIN/middlebox" -lz
+    gcc -O2 "$REPO/bench/checksum_test.c" -o "$BIN/checksum_test"
+    gcc -O2 "$REPO/bench/checksum_bench.c" -o "$BIN/checksum_bench"
+    "$BIN/checksum_test"
+    "$BIN/checksum_bench" > "$OUT/checksum_bench.txt"
+}
+
+teardown() {
+    if [ -n "$MB_PID" ]; then
+        kill "$MB_PID" 2>/dev/null || true
+        wait "$MB_PID" 2>/dev/null || true
+        MB_PID=""
+    fi
+    for ns in "$NS_C" "$NS_M" "$NS_S"; do
+        ip netns pids "$ns" 2>/dev/null | xargs -r kill 2>/dev/null || true
+        ip netns del "$ns" 2>/dev/null || true
+    done
+}
+trap teardown EXIT
+
+# setup <mode> <rate_mbps> <log>
+setup() {
+    local mode="$1" rate="$2" log="$3"
+    ip netns add "$NS_C"
+    ip netns add "$NS_M"
+    ip netns add "$NS_S"
+    ip link add c0 netns "$NS_C" type veth peer name c1 netns "$NS_M"
+    ip link add s0 netns "$NS_S" type veth peer name s1 netns "$NS_M"
+    ip -n "$NS_C" addr add "$CLIENT_IP/24" dev c0
+    ip -n "$NS_S" addr add "$SERVER_IP/24" dev s0
+    for l in "$NS_C c0" "$NS_C lo" "$NS_M c1" "$NS_M s1" "$NS_S s0" "$NS_S lo"; do
+        set -- $l
+        ip -n "$1" link set "$2" up
+    done
+    # resolved up front, a train sent while ARP is pending loses its head
+    ip -n "$NS_C" neigh add "$SERVER_IP" lladdr "$(ip -n "$NS_S" -br link show s0 | awk '{print $3}')" dev c0 nud permanent
+    ip -n "$NS_S" neigh add "$CLIENT_IP" lladdr "$(ip -n "$NS_C" -br link show c0 | awk '{print $3}')" dev s0 nud permanent
+
+    if [ "$mode" = tbf ]; then
+        ip -n "$NS_M" link add br0 type bridge
+        ip -n "$NS_M" link set c1 master br0
+        ip -n "$NS_M" link set s1 master br0
+        ip -n "$NS_M" link set br0 up
+        tc -n "$NS_M" qdisc add dev s1 root tbf rate "${rate}mbit" burst 32kb latency 2s
+    else
+        ip netns exec "$NS_M" "$BIN/middlebox" -a c1 -b s1 -r "$rate" -z 1 > "$log" 2>&1 &
+        MB_PID=$!
+        sleep 0.3
+    fi
+}
+
+# write_config <dir> <payload> <packets> <inter_measure_time>
+write_config() {
+    cat > "$1/myconfig.json" <<EOF
+{
+  "server_ip": "$SERVER_IP",
+  "pre_probe_port": "7777",
+  "post_probe_port": "6666",
+  "src_port_udp": "9876",
+  "dst_port_udp": "8765",
+  "dst_port_tcp_head": "9999",
+  "dst_port_tcp_tail": "8888",
+  "udp_payload_size": "$2",
+  "inter_measure_time": "$4",
+  "num_udp_packets": "$3",
+  "udp_ttl": "255",
+  "target_train_ms": "0",
+  "slowdown_threshold": "0.1",
+  "num_marker_ports": "3",
+  "train_retries": "1"
+}
+EOF
+    cp "$REPO/client_server/random_file" "$1/"
+}
+
+# timed <time_file> <output_file> <command...>: elapsed, user and system seconds
+timed() {
+    local time_file="$1" out_file="$2"
+    shift 2
+    local TIMEFORMAT='%R %U %S'
+    { time "$@" > "$out_file" 2>&1 ; } 2> "$time_file" || true
+}
+
+# verdict <output_file>: compression, none or failed
+verdict() {
+    if grep -q "No compression detected" "$1"; then
+        echo none
+    elif grep -q "Compression detected" "$1"; then
+        echo compression
+    else
+        echo failed
+    fi
+}
+
+# field <file> <pattern>: the number after the pattern, -1 if missing
+field() {
+    local v
+    v="$(sed -n "s/^$2 *\([0-9.]*\).*/\1/p" "$1" | tail -1)"
+    echo "${v:--1}"
+}
+
+# run_one <tool> <mode> <rate> <payload> <packets> <repeat>
+run_one() {
+    local tool="$1" mode="$2" rate="$3" payload="$4" packets="$5" rep="$6"
+    local dir="$OUT/runs/$tool-$mode-${rate}M-${payload}B-${packets}p-$rep"
+    mkdir -p "$dir"
+    setup "$mode" "$rate" "$dir/middlebox.log"
+
+    local low high cpu
+    if [ "$tool" = client_server ]; then
+        # the server sleeps 10 s between trains, the client has to wait longer
+        write_config "$dir" "$payload" "$packets" 15
+        (cd "$dir" && timed "$dir/server.time" "$dir/server.out" \
+            ip netns exec "$NS_S" "$BIN/compdetect_server" 7777) &
+        local server_pid=$!
+        sleep 0.5
+        (cd "$dir" && timed "$dir/client.time" "$dir/client.out" \
+            ip netns exec "$NS_C" "$BIN/compdetect_client" myconfig.json)
+        wait "$server_pid" || true
+        cat "$dir/server.out" >> "$dir/client.out"
+        low="$(field "$dir/server.out" "Time interval low:")"
+        high="$(field "$dir/server.out" "Time interval high:")"
+        cpu="$(awk '{c += $2 + $3} END {print c}' "$dir/client.time" "$dir/server.time")"
+    else
+        write_config "$dir" "$payload" "$packets" 2
+        (cd "$dir" && timed "$dir/client.time" "$dir/client.out" \
+            ip netns exec "$NS_C" "$BIN/standalone")
+        low="$(field "$dir/client.out" "Time interval low entropy:")"
+        high="$(field "$dir/client.out" "Time interval high entropy:")"
+        cpu="$(awk '{print $2 + $3}' "$dir/client.time")"
+    fi
+    teardown
+
+    local expected=none
+    [ "$mode" = zlib ] && expected=compression
+    local got wall
+    got="$(verdict "$dir/client.out")"
+    wall="$(awk '{print $1}' "$dir/client.time")"
+    # the high entropy train does not compress, so it takes its line time on both bottlenecks
+    awk -v tool="$tool" -v mode="$mode" -v rate="$rate" -v payload="$payload" -v packets="$packets" \
+        -v rep="$rep" -v got="$got" -v expected="$expected" -v wall="$wall" -v low="$low" \
+        -v high="$high" -v cpu="$cpu" -v overhead="$FRAME_OVERHEAD" 'BEGIN {
+        line = packets * (payload + overhead) * 8 / (rate * 1e6)
+        err = high > 0 ? (high - line) / line : -1
+        pps = high > 0 ? packets / high : -1
+        printf "%s,%s,%s,%s,%s,%s,%s,%s,%d,%s,%s,%s,%.6f,%.4f,%.0f,%.3f\n",
+               tool, mode, rate, payload, packets, rep, got, expected, got == expected, wall, low,
+               high, line, err, pps, cpu * 1e6 / (2 * packets)
+    }' >> "$OUT/results.csv"
+    tail -1 "$OUT/results.csv"
+}
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "run_bench.sh needs root to create network namespaces" >&2
+    exit 1
+fi
+mkdir -p "$OUT"
+build
+cat > "$OUT/meta.json" <<EOF
+{
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "commit": "$(git -C "$REPO" rev-parse HEAD 2>/dev/null || echo unknown)",
+  "kernel": "$(uname -r)",
+  "cpus": $(nproc),
+  "tools": "$TOOLS",
+  "modes": "$MODES",
+  "rates_mbps": "$RATES",
+  "payloads": "$PAYLOADS",
+  "trains": "$TRAINS",
+  "repeat": $REPEAT
+}
+EOF
+echo "tool,mode,rate_mbps,payload,packets,repeat,verdict,expected,correct,wall_s,low_s,high_s,line_time_s,timing_error,pps,cpu_us_per_packet" \
+    > "$OUT/results.csv"
+
+for tool in $TOOLS; do
+    for mode in $MODES; do
+        for rate in $RATES; do
+            for payload in $PAYLOADS; do
+                for packets in $TRAINS; do
+                    for rep in $(seq 1 "$REPEAT"); do
+                        run_one "$tool" "$mode" "$rate" "$payload" "$packets" "$rep"
+                    done
+                done
+            done
+        done
+    done
+done
+
+awk -F, 'NR > 1 {n[$1]++; ok[$1] += $9} END {
+    for (t in n) printf "%s: %d/%d verdicts correct\n", t, ok[t], n[t]
+}' "$OUT/results.csv"
+echo "Results in $OUT"
@@ -9,6 +9,9 @@
 
 #include "config.h"
 #include "cJSON.h"
+#include "timing_export.h"
+#include "route.h"
+#include "run_stats.h"
 
 #define BUF_SIZE 1024
 
@@ -39,24 +42,105 @@ void pre_probe_sender(struct config* cf, cJSON* root, FILE* file, int sockfd) {
     }
 
     char* buffer = cJSON_PrintUnformatted(root);
-    if (send(sockfd, buffer, strlen(buffer), 0) < 0) {
+    if (stats_count_send(send(sockfd, buffer, strlen(buffer), 0)) < 0) {
         perror("failed to send config");
         exit(EXIT_FAILURE);
     }
+    free(buffer);
     cJSON_Delete(root);
-    close(sockfd);
 }
 
 /**
- * Sends the UDP packets to the server
+ * Reads one newline terminated line from the control connection
+ * @param sockfd socket file descriptor
+ * @param line output buffer, NUL terminated without the newline
+ * @param len size of the output buffer
+ * @return length of the line, -1 on error or if the server closed the connection
+ */
+int read_control_line(int sockfd, char* line, int len) {
+    int n = 0;
+    while (n < len - 1) {
+        char c;
+        ssize_t rc = stats_count_recv(read(sockfd, &c, 1));
+        if (rc <= 0) {
+            return -1;
+        }
+        if (c == '\n') {
+            break;
+        }
+        line[n++] = c;
+    }
+    line[n] = '\0';
+    return n;
+}
+
+/**
+ * Sends a short back-to-back burst so the server can measure the path,
+ * then adopts the train length the server sized from it
+ * @param cf configuration struct
+ * @param sockfd control connection
+ * @param udp_sockfd bound UDP socket
+ */
+void calibration_sender(struct config* cf, int sockfd, int udp_sockfd) {
+    char line[BUF_SIZE];
+    if (read_control_line(sockfd, line, sizeof(line)) < 0 || strcmp(line, "READY") != 0) {
+        perror("server did not get ready for calibration");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(cf->server_ip);
+    server_addr.sin_port = htons((int) strtol(cf->dst_port_udp, NULL, 10));
+    int payload_size = (int) strtol(cf->udp_payload_size, NULL, 10);
+    char buffer[payload_size];
+    memset(&buffer, 0, payload_size);
+
+    printf("Sending calibration burst...\n");
+    for (int i = 0; i < CALIBRATION_PACKETS; i++) {
+        buffer[0] = (char) ((i >> 8) & 0xFF);
+        buffer[1] = (char) (i & 0xFF);
+        if (stats_count_send(sendto(udp_sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&server_addr,
+                                    sizeof(server_addr))) < 0) {
+            perror("failed to send udp packet, calibration");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    long packets = 0, rtt_us = 0;
+    double capacity = 0;
+    if (read_control_line(sockfd, line, sizeof(line)) < 0 ||
+        sscanf(line, "num_udp_packets %ld capacity_bps %lf rtt_us %ld", &packets, &capacity, &rtt_us) != 3) {
+        perror("failed to read calibration result");
+        exit(EXIT_FAILURE);
+    }
+    printf("Path capacity %.1f Mbps, rtt %.3f ms, using %ld packets per train\n",
+           capacity / 1e6, rtt_us / 1000.0, packets);
+    snprintf(cf->num_udp_packets, sizeof(cf->num_udp_packets), "%ld", packets);
+}
+
+/**
+ * Sets the don't fragment flag and binds the UDP probing socket to the source address
+ * the kernel routes towards the server from
  * @param cf configuration struct
  * @param sockfd socket file descriptor
  */
-void probing_udp_sender(struct config* cf, int sockfd) {
+void probing_udp_setup(struct config* cf, int sockfd) {
+    struct route_info route;
+    if (route_get(inet_addr(cf->server_ip), &route) < 0) {
+        perror("failed to find a route to the server");
+        exit(1);
+    }
+    char src[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &route.src, src, sizeof(src));
+    printf("Probing from %s on %s\n", src, route.ifname);
+
     int src_port = (int) strtol(cf->src_port_udp, NULL, 10);
     struct sockaddr_in udp_cli_addr;
+    memset(&udp_cli_addr, 0, sizeof(udp_cli_addr));
     udp_cli_addr.sin_family = AF_INET;
-    udp_cli_addr.sin_addr.s_addr = inet_addr("192.168.128.2");
+    udp_cli_addr.sin_addr.s_addr = route.src;
     udp_cli_addr.sin_port = htons(src_port);
 
     int df_flag = 1;
@@ -68,6 +152,14 @@ void probing_udp_sender(struct config* cf, int sockfd) {
         perror("failed to bind, probing udp sender");
         exit(1);
     }
+}
+
+/**
+ * Sends the UDP packets to the server
+ * @param cf configuration struct
+ * @param sockfd socket file descriptor
+ */
+void probing_udp_sender(struct config* cf, int sockfd) {
     struct sockaddr_in server_addr;
     int dst_port = (int) strtol(cf->dst_port_udp, NULL, 10);
     memset(&server_addr, 0, sizeof(server_addr));
@@ -82,36 +174,84 @@ void probing_udp_sender(struct config* cf, int sockfd) {
     memset(&buffer, 0, payload_size);
 
     printf("Sending low entropy packets...\n");
+    int phase = stats_phase_begin("low train");
     for (int i = 0; i < num_packets; i++) {
         buffer[0] = (char) ((i >> 8) & 0xFF);
         buffer[1] = (char) (i & 0xFF);
-        if (sendto(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        if (stats_count_send(sendto(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&server_addr,
+                                    sizeof(server_addr))) < 0) {
             perror("failed to send udp packet, low entropy");
             free(cf);
             close(sockfd);
             exit(1);
         }
     }
+    stats_phase_end(phase);
+    phase = stats_idle_begin("inter-train wait");
     sleep(interval_time);
+    stats_phase_end(phase);
     char random[payload_size];
     get_random_byte(payload_size, random);
 
     printf("Sending high entropy packets...\n");
+    phase = stats_phase_begin("high train");
     for (int i = 0; i < num_packets; i++) {
         random[0] = (char) ((i >> 8) & 0xFF);
         random[1] = (char) (i & 0xFF);
 
-        if (sendto(sockfd, random, sizeof(random), 0, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        if (stats_count_send(sendto(sockfd, random, sizeof(random), 0, (struct sockaddr *)&server_addr,
+                                    sizeof(server_addr))) < 0) {
             perror("failed to send udp packet, high entropy");
             free(cf);
             close(sockfd);
             exit(1);
         }
     }
+    stats_phase_end(phase);
+    /* gives the server time to finish the train and listen for the result connection */
+    phase = stats_idle_begin("result wait");
     sleep(interval_time);
+    stats_phase_end(phase);
     close(sockfd);
 }
 
+/**
+ * Decodes the per-packet timings that follow the verdict and writes them as CSV
+ * @param cf configuration struct
+ * @param data encoded export stream
+ * @param len length of the stream
+ */
+void timing_export_writer(struct config* cf, const unsigned char* data, size_t len) {
+    if (len < 6 || memcmp(data, EXPORT_MAGIC, 4) != 0 || data[4] != EXPORT_VERSION) {
+        fprintf(stderr, "no valid packet timings received\n");
+        return;
+    }
+    FILE* out = fopen(cf->export_file, "w");
+    if (out == NULL) {
+        perror("failed to open export file");
+        return;
+    }
+    fprintf(out, "train,seq,arrival_ns\n");
+    size_t offset = 6;
+    for (int t = 0; t < data[5]; t++) {
+        struct train_record rec;
+        size_t used = train_record_decode(data + offset, len - offset, &rec);
+        if (used == 0) {
+            fprintf(stderr, "malformed packet timings for train %d\n", t);
+            break;
+        }
+        offset += used;
+        for (int i = 0; i < rec.count; i++) {
+            fprintf(out, "%s,%u,%lld\n", t == 0 ? "low" : "high", rec.seq[i],
+                    (long long) rec.arrival_ns[i]);
+        }
+        printf("Archived %d packet timings of the %s entropy train\n", rec.count,
+               t == 0 ? "low" : "high");
+        train_record_free(&rec);
+    }
+    fclose(out);
+}
+
 /**
  * Receives the message from the server
  * @param cf configuration struct
@@ -150,16 +290,48 @@ void post_probe_receiver(struct config* cf) {
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-    char message[BUF_SIZE];
 
-    int n = read(sockfd, message, BUF_SIZE);
-    if (n < 0) {
-        perror("failed to read message");
+    /* the verdict is NUL terminated, optional packet timings follow until the server closes */
+    size_t cap = BUF_SIZE, len = 0;
+    char* message = (char*) malloc(cap);
+    if (message == NULL) {
+        perror("failed to allocate message buffer");
         free(cf);
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-    printf("message: %s\n", message);
+    while (1) {
+        if (len == cap) {
+            char* grown = (char*) realloc(message, cap * 2);
+            if (grown == NULL) {
+                perror("failed to grow message buffer");
+                free(message);
+                free(cf);
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
+            message = grown;
+            cap *= 2;
+        }
+        int n = (int) stats_count_recv(read(sockfd, message + len, cap - len));
+        if (n < 0) {
+            perror("failed to read message");
+            free(message);
+            free(cf);
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    size_t msg_len = strnlen(message, len);
+    printf("message: %.*s\n", (int) msg_len, message);
+    if (cf->export_file[0] != '\0' && msg_len < len) {
+        timing_export_writer(cf, (unsigned char*) message + msg_len + 1, len - msg_len - 1);
+    }
+    free(message);
     close(sockfd);
 
 }
@@ -176,24 +348,40 @@ int main(int argc, char** argv) {
     struct config* cf = (struct config*) malloc(sizeof(struct config));
     cJSON* root = read_file_config(file);
     get_configuration(cf, root); // retrieve the configuration data from the JSON object
+    stats_init("compdetect_client", cf->stats_socket);
 
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if(sockfd == -1) {
         perror("failed to create socket");
         exit(EXIT_FAILURE);
     }
+    int new_sockfd_udp = socket(AF_INET, SOCK_DGRAM, 0);
+    if (new_sockfd_udp < 0) {
+        perror("socket creation failed");
+        exit(1);
+    }
+    probing_udp_setup(cf, new_sockfd_udp);
+
+    int adaptive = (int) strtol(cf->target_train_ms, NULL, 10) > 0;
+    int phase = stats_phase_begin("config exchange");
     pre_probe_sender(cf, root, file, sockfd);
+    stats_phase_end(phase);
+    if (adaptive) {
+        phase = stats_phase_begin("calibration");
+        calibration_sender(cf, sockfd, new_sockfd_udp);
+        stats_phase_end(phase);
+    }
+    close(sockfd);
 
+    phase = stats_idle_begin("startup wait");
     sleep(1);
+    stats_phase_end(phase);
 
     // send the udp packet
-    int new_sockfd_udp = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("socket creation failed");
-        exit(1);
-    }
     probing_udp_sender(cf, new_sockfd_udp);
+    phase = stats_phase_begin("result exchange");
     post_probe_receiver(cf);
+    stats_phase_end(phase);
 
     free(cf);
     return 0;
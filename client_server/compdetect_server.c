@@ -8,226 +8,678 @@
 #include <string.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 
 #include "config.h"
 #include "cJSON.h"
+#include "timing_export.h"
+#include "train_stats.h"
+#include "run_stats.h"
+#include "metrics.h"
+#include "mono_clock.h"
+#include "results_log.h"
+#include "capture.h"
+#include "timer_wheel.h"
 
 #define BUF_SIZE 1024
 #define TIMEOUT_SEC 10
+#define SESSION_IDLE_SEC 60        /* default for -i */
+#define CALIBRATION_GAP_NS 1000000000L
 
-volatile int exit_loop_low = 0;
-volatile int exit_loop_high = 0;
+/**
+ * Everything one measurement session owns. A failing session only takes down its own
+ * sockets, records and timers, session_free releases whatever it got to.
+ */
+struct session {
+    unsigned long id;
+    struct config cf;
+    struct sockaddr_in client;
+    struct sockaddr_in probe_local;    /* address the probes arrive on, for the capture */
+    int cli_sock;                      /* control connection, -1 when closed */
+    int probe_sock;
+    int post_sock;                     /* result listener */
+    int result_sock;
+    struct train_record low, high;
+    struct train_stats low_stats, high_stats;
+    char* probe_buf;                   /* one probe payload, udp_payload_size bytes */
+    double time_diff;
+    struct result_summary result;
+    struct timer idle;                 /* reaps the session when the client goes quiet */
+    struct timer deadline;             /* ends a train TIMEOUT_SEC after its first packet */
+    int idle_sec;
+    int expired;
+    int reaped;
+};
+
+static struct timer_wheel timers;
+
+void session_expire(struct timer* t, void* arg) {
+    (void) t;
+    ((struct session*) arg)->expired = 1;
+}
 
-void set_exit_flag_low(int signal) {
-    exit_loop_low = 1;
+void session_reap(struct timer* t, void* arg) {
+    (void) t;
+    struct session* s = arg;
+    s->reaped = 1;
+    printf("Session %lu idle for %d s, reaping it\n", s->id, s->idle_sec);
+}
+
+/**
+ * session_touch - the client is alive, push the idle reaping back
+ * @param s
+ */
+void session_touch(struct session* s) {
+    timer_arm(&timers, &s->idle, mono_now_ns() + (int64_t) s->idle_sec * 1000000000, session_reap, s);
+}
+
+/**
+ * session_new
+ * @param id
+ * @param idle_sec
+ * @return the session with no resources yet, NULL if out of memory
+ */
+struct session* session_new(unsigned long id, int idle_sec) {
+    struct session* s = (struct session*) calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->id = id;
+    s->idle_sec = idle_sec;
+    s->cli_sock = -1;
+    s->probe_sock = -1;
+    s->post_sock = -1;
+    s->result_sock = -1;
+    return s;
 }
 
-void set_exit_flag_high(int signal) {
-    exit_loop_high = 1;
+void session_close(int* fd) {
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
 }
 
+/**
+ * session_free - release everything the session holds, however far it got
+ * @param s
+ */
+void session_free(struct session* s) {
+    timer_cancel(&s->idle);
+    timer_cancel(&s->deadline);
+    if (s->probe_sock >= 0) {
+        stats_rx_drops_disable(s->probe_sock);
+    }
+    session_close(&s->cli_sock);
+    session_close(&s->probe_sock);
+    session_close(&s->post_sock);
+    session_close(&s->result_sock);
+    train_record_free(&s->low);
+    train_record_free(&s->high);
+    free(s->probe_buf);
+    free(s);
+}
 
 /**
- * Accepts a connection from the client and receives the configuration
- * @param port pre-probe port
- * @param cf configuration struct
- * @param root JSON object
+ * session_wait - wait for a socket of the session, running the timers meanwhile
+ * @param s
+ * @param fd
+ * @param until_ns give up at this time, INT64_MAX to wait on the session timers only
+ * @return 1 when fd is ready, 0 when the train deadline or until_ns passed, -1 when the
+ * session was reaped or poll failed. errno is ETIMEDOUT unless poll failed
+ */
+int session_wait(struct session* s, int fd, int64_t until_ns) {
+    while (1) {
+        int64_t now = mono_now_ns();
+        timer_wheel_advance(&timers, now);
+        if (s->reaped) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (s->expired || now >= until_ns) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        int64_t wake = timer_wheel_next_ns(&timers);
+        if (until_ns < wake) {
+            wake = until_ns;
+        }
+        int timeout_ms = wake == INT64_MAX ? -1 : (int) ((wake - now + 999999) / 1000000);
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int n = poll(&pfd, 1, timeout_ms);
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (n > 0) {
+            return 1;
+        }
+    }
+}
+
+/**
+ * listen_socket
+ * @param port
+ * @return a TCP socket listening on port, -1 on failure
  */
-void pre_probe_conn_accept(int port, struct config* cf, cJSON* root) {
+int listen_socket(int port) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("Error creating socket");
-        free(cf);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
     struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
 
-
     if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Error binding, in pre_probe");
-        free(cf);
+        perror("Error binding");
         close(sockfd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
     if (listen(sockfd, 5) < 0) {
         perror("Error listening");
-        free(cf);
         close(sockfd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    return sockfd;
+}
 
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    int client_sock;
-    while (1) {
-        client_sock = accept(sockfd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_sock < 0) {
-            perror("Error accepting connection");
-            free(cf);
-            close(sockfd);
-            exit(EXIT_FAILURE);
-        }
-        char buffer[BUF_SIZE];
-        int n = (int) recv(client_sock, &buffer, BUF_SIZE, 0);
-        if (n < 0) {
-            perror("Error receiving data");
-            free(cf);
-            close(sockfd);
-            exit(EXIT_FAILURE);
-        }
-        buffer[n] = '\0';
-        root = cJSON_Parse(buffer);
-        get_configuration(cf, root);
-        break;
+/**
+ * Receives the configuration on the control connection
+ * @param s session, cli_sock is connected
+ * @return 0 on success, -1 on failure
+ */
+int pre_probe_config_receive(struct session* s) {
+    char buffer[BUF_SIZE];
+    if (session_wait(s, s->cli_sock, INT64_MAX) <= 0) {
+        perror("Error waiting for the configuration");
+        return -1;
     }
-    close(client_sock);
-    close(sockfd);
+    int n = (int) stats_count_recv(recv(s->cli_sock, &buffer, BUF_SIZE - 1, 0));
+    if (n < 0) {
+        perror("Error receiving data");
+        return -1;
+    }
+    buffer[n] = '\0';
+    cJSON* root = cJSON_Parse(buffer);
+    const char* missing = check_configuration(root);
+    if (missing != NULL) {
+        fprintf(stderr, "Error in the configuration: no %s\n", missing);
+        cJSON_Delete(root);
+        return -1;
+    }
+    get_configuration(&s->cf, root);
+    cJSON_Delete(root);
+    /* the sizes come from the peer, a bad one fails this session only */
+    long value;
+    if (config_long(s->cf.udp_payload_size, MIN_UDP_PAYLOAD, MAX_UDP_PAYLOAD, &value) < 0) {
+        fprintf(stderr, "Error in the configuration: udp_payload_size must be %d to %d\n",
+                MIN_UDP_PAYLOAD, MAX_UDP_PAYLOAD);
+        return -1;
+    }
+    if (config_long(s->cf.num_udp_packets, 1, MAX_TRAIN_PACKETS, &value) < 0) {
+        fprintf(stderr, "Error in the configuration: num_udp_packets must be 1 to %d\n", MAX_TRAIN_PACKETS);
+        return -1;
+    }
+    if (config_long(s->cf.dst_port_udp, 1, 65535, &value) < 0 ||
+        config_long(s->cf.post_probe_port, 1, 65535, &value) < 0) {
+        fprintf(stderr, "Error in the configuration: bad dst_port_udp or post_probe_port\n");
+        return -1;
+    }
+    session_touch(s);
+    return 0;
 }
 
 /**
- * Get the time difference between the high and low entropy packets
- * It is the place where server receives all the packets
+ * Creates and binds the UDP socket the probe trains arrive on
  * @param cf configuration struct
- * @param time_diff time difference between high and low entropy packets
+ * @return socket file descriptor, -1 on failure
  */
-void probing_phase(struct config* cf, double* time_diff) {
+int probe_socket_setup(struct config* cf) {
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         perror("Error creating socket");
-        free(cf);
-        exit(EXIT_FAILURE);
+        return -1;
     }
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons((int) strtol(cf->dst_port_udp, NULL, 10));
-    socklen_t addr_len = sizeof(server_addr);
-
 
     if(bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Error binding, in probing");
-        free(cf);
         close(sockfd);
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+    if (stats_rx_drops_enable(sockfd) < 0) {
+        perror("Warning: no receive queue drop counts");
+    }
+    int on = 1;
+    if (capture.enabled && setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        perror("Warning: capturing without kernel timestamps");
+    }
+    return sockfd;
+}
+
+/**
+ * probe_recv - receive a probe without blocking the other timers, waiting in session_wait
+ * whenever the queue is empty
+ * @param s
+ * @param buffer
+ * @param len
+ * @param from
+ * @param until_ns as in session_wait
+ * @return datagram length, 0 when the wait ended, -1 on failure
+ */
+int probe_recv(struct session* s, char* buffer, int len, struct sockaddr_in* from, int64_t until_ns) {
+    struct timespec kernel_ts;
+    while (1) {
+        socklen_t from_len = sizeof(*from);
+        int n = (int) stats_recvfrom_ts(s->probe_sock, buffer, len, MSG_DONTWAIT, (struct sockaddr *)from,
+                                        &from_len, capture.enabled ? &kernel_ts : NULL);
+        if (n >= 0) {
+            capture_udp(&kernel_ts, from, &s->probe_local, buffer, n);
+            return n > 0 ? n : 1;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        int ready = session_wait(s, s->probe_sock, until_ns);
+        if (ready <= 0) {
+            return ready;
+        }
     }
+}
 
+/**
+ * Measures the path with a short burst from the client and sizes the trains so each
+ * one lasts about target_train_ms (and many RTTs) at the measured capacity
+ * @param s session, cf.num_udp_packets is updated
+ * @return 0 on success, -1 on failure
+ */
+int calibration_phase(struct session* s) {
+    struct config* cf = &s->cf;
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    long rtt_us = 0;
+    if (getsockopt(s->cli_sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+        rtt_us = info.tcpi_rtt;
+    }
+
+    if (stats_count_send(write(s->cli_sock, "READY\n", 6)) < 0) {
+        perror("Error writing to socket");
+        return -1;
+    }
 
     int payload_size = (int) strtol(cf->udp_payload_size, NULL, 10);
-    int packet_num = (int) strtol(cf->num_udp_packets, NULL, 10);
-    struct timeval high_start_time, high_end_time, low_start_time, low_end_time;
-    char buffer[payload_size];
+    char* buffer = s->probe_buf;
+    struct train_stats st;
+    train_stats_init(&st);
+    struct sockaddr_in from;
+    for (int i = 0; i < CALIBRATION_PACKETS; i++) {
+        int n = probe_recv(s, buffer, payload_size, &from, mono_now_ns() + CALIBRATION_GAP_NS);
+        if (n < 0) {
+            perror("Error receiving calibration packets");
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (n >= 2) {
+            train_stats_add(&st, (uint16_t) (((unsigned char) buffer[0] << 8) | (unsigned char) buffer[1]),
+                            n, mono_fast_ns());
+        }
+    }
 
-    int timeout = 10;
-    struct timeval tv;
-    tv.tv_sec = timeout;
-    tv.tv_usec = 0;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv)) < 0) {
-        perror("Setting socket timeout failed");
-        exit(EXIT_FAILURE);
+    double capacity = train_stats_capacity_bps(&st);
+    if (capacity <= 0) {
+        capacity = train_stats_goodput_bps(&st);
+    }
+    long packets = strtol(cf->num_udp_packets, NULL, 10);
+    if (capacity > 0) {
+        double target_sec = strtol(cf->target_train_ms, NULL, 10) / 1000.0;
+        if (target_sec < RTT_TRAIN_FACTOR * rtt_us / 1e6) {
+            target_sec = RTT_TRAIN_FACTOR * rtt_us / 1e6;
+        }
+        packets = (long) (capacity * target_sec / ((payload_size + IPV4_UDP_OVERHEAD) * 8.0)) + 1;
+        if (packets < MIN_TRAIN_PACKETS) {
+            packets = MIN_TRAIN_PACKETS;
+        }
+        if (packets > MAX_TRAIN_PACKETS) {
+            packets = MAX_TRAIN_PACKETS;
+        }
     }
+    printf("Calibration: %d/%d packets, capacity %.1f Mbps, rtt %.3f ms, %ld packets per train\n",
+           st.received, CALIBRATION_PACKETS, capacity / 1e6, rtt_us / 1000.0, packets);
 
-    printf("Receiving low entropy packets...\n");
-    for (int i = 0; i < packet_num && exit_loop_low == 0; i++) {
+    char reply[BUF_SIZE];
+    int len = snprintf(reply, sizeof(reply), "num_udp_packets %ld capacity_bps %.0f rtt_us %ld\n",
+                       packets, capacity, rtt_us);
+    if (stats_count_send(write(s->cli_sock, reply, len)) < 0) {
+        perror("Error writing to socket");
+        return -1;
+    }
+    snprintf(cf->num_udp_packets, sizeof(cf->num_udp_packets), "%ld", packets);
+    session_touch(s);
+    return 0;
+}
+
+/**
+ * Receives one probe train, until all of it arrived or TIMEOUT_SEC after its first packet
+ * @param s
+ * @param train 0 for the low entropy train, 1 for the high entropy one
+ * @param rec arrival record
+ * @param st arrival statistics
+ * @return seconds from the first packet to the end of the train, -1 on failure
+ */
+double train_receive(struct session* s, int train, struct train_record* rec, struct train_stats* st) {
+    int payload_size = (int) strtol(s->cf.udp_payload_size, NULL, 10);
+    int packet_num = (int) strtol(s->cf.num_udp_packets, NULL, 10);
+    int64_t start_ns = 0;
+    char* buffer = s->probe_buf;
+    struct sockaddr_in from;
+
+    stats_rx_drops_refresh(s->probe_sock);
+    uint32_t drops = stats_rx_drops_get(s->probe_sock);
+    session_touch(s);
+    s->expired = 0;
+    for (int i = 0; i < packet_num; i++) {
         bzero(buffer, payload_size);
-        int n = (int) recvfrom(sockfd, buffer, payload_size, 0,
-                               (struct sockaddr *)&server_addr, &addr_len);
-        if (i == 0 && n > 0) {
-            gettimeofday(&low_start_time, NULL);
-            alarm(TIMEOUT_SEC);
-            signal(SIGALRM, set_exit_flag_low);
+        int n = probe_recv(s, buffer, payload_size, &from, INT64_MAX);
+        if (n < 0) {
+            perror("Error receiving probe packets");
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (i == 0) {
+            start_ns = mono_fast_ns();
+            timer_arm(&timers, &s->deadline, mono_now_ns() + (int64_t) TIMEOUT_SEC * 1000000000,
+                      session_expire, s);
+            session_touch(s);
+        }
+        if (n >= 2) {
+            int64_t arrival_ns = mono_fast_ns();
+            uint16_t seq = (uint16_t) (((unsigned char) buffer[0] << 8) | (unsigned char) buffer[1]);
+            train_record_add(rec, seq, arrival_ns);
+            train_stats_add(st, seq, n, arrival_ns);
         }
     }
+    timer_cancel(&s->deadline);
+    s->expired = 0;
+    double interval = (double) (mono_fast_ns() - start_ns) / 1e9;
+
+    metrics_train(train, (st->last_ns - st->first_ns) / 1e9, packet_num, st->received);
+    stats_rx_drops_refresh(s->probe_sock);
+    metrics_rx_overflows(stats_rx_drops_get(s->probe_sock) - drops);
+    return interval;
+}
+
+/**
+ * Get the time difference between the high and low entropy packets
+ * It is the place where server receives all the packets
+ * @param s session, time_diff and the train records and statistics are filled in
+ * @return 0 on success, -1 on failure
+ */
+int probing_phase(struct session* s) {
+    int packet_num = (int) strtol(s->cf.num_udp_packets, NULL, 10);
+    if (train_record_init(&s->low, packet_num) < 0 || train_record_init(&s->high, packet_num) < 0) {
+        perror("Error allocating train records");
+        return -1;
+    }
+    train_stats_init(&s->low_stats);
+    train_stats_init(&s->high_stats);
 
-    gettimeofday(&low_end_time, NULL);
-    double time_interval_low = (double) (low_end_time.tv_usec - low_start_time.tv_usec) / 1000000 +
-                               (double) (low_end_time.tv_sec - low_start_time.tv_sec);
+    printf("Receiving low entropy packets...\n");
+    int phase = stats_phase_begin("low train");
+    double time_interval_low = train_receive(s, 0, &s->low, &s->low_stats);
+    stats_phase_end(phase);
+    if (time_interval_low < 0) {
+        return -1;
+    }
     printf("Time interval low: %f\n", time_interval_low);
 
-    sleep(10);
+    phase = stats_idle_begin("inter-train wait");
+    metrics_sleep(10);
+    stats_phase_end(phase);
 
     printf("Receiving high entropy packets...\n");
-    for (int i = 0; i < packet_num && exit_loop_high == 0; i++) {
-        bzero(buffer, payload_size);
-        int n = (int) recvfrom(sockfd, buffer, payload_size, 0,
-                               (struct sockaddr *)&server_addr, &addr_len);
-        if (i == 0 && n > 0) {
-            gettimeofday(&high_start_time, NULL);
-            alarm(TIMEOUT_SEC);
-            signal(SIGALRM, set_exit_flag_high);
-        }
+    phase = stats_phase_begin("high train");
+    double time_interval_high = train_receive(s, 1, &s->high, &s->high_stats);
+    stats_phase_end(phase);
+    if (time_interval_high < 0) {
+        return -1;
     }
-    gettimeofday(&high_end_time, NULL);
-    double time_interval_high = (double) (high_end_time.tv_usec - high_start_time.tv_usec) / 1000000 +
-                                (double) (high_end_time.tv_sec - high_start_time.tv_sec);
     printf("Time interval high: %f\n", time_interval_high);
-    *time_diff = (time_interval_high - time_interval_low) * 1000;
-    printf("Time difference: %f ms\n", *time_diff);
+    s->time_diff = (time_interval_high - time_interval_low) * 1000;
+    printf("Time difference: %f ms\n", s->time_diff);
+    return 0;
 }
 
 /**
- * Send the result of the probing phase to the client
- * @param cf configuration struct
- * @param time_diff time difference between high and low entropy packets
+ * Stream the per-packet arrival data of both trains to the client,
+ * delta-of-delta/varint encoded, following the verdict message
+ * @param cli_sock connected client socket
+ * @param low arrival record of the low entropy train
+ * @param high arrival record of the high entropy train
+ * @return 0 on success, -1 on failure
  */
-void post_probe_sender(struct config* cf, double time_diff) {
-    int port = (int) strtol(cf->post_probe_port, NULL, 10);
-
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("Error creating socket");
-        free(cf);
-        exit(EXIT_FAILURE);
+int timing_export_sender(int cli_sock, const struct train_record* low, const struct train_record* high) {
+    size_t len;
+    unsigned char* out = timing_export_encode(low, high, &len);
+    if (out == NULL) {
+        return -1;
     }
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
 
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = stats_count_send(write(cli_sock, out + sent, len - sent));
+        if (n < 0) {
+            free(out);
+            return -1;
+        }
+        sent += n;
+    }
+    printf("Exported %d + %d packet timings in %zu bytes\n", low->count, high->count, len);
+    free(out);
+    return 0;
+}
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Error binding");
-        free(cf);
-        close(sockfd);
-        exit(EXIT_FAILURE);
+/**
+ * message_advance - move past what an snprintf appended to a message, stopping at the end of
+ * the buffer so a truncated message stays terminated and later appends write nothing
+ * @param len characters already in the buffer
+ * @param written what the snprintf returned
+ * @param size size of the buffer
+ * @return the new length, at most size - 1
+ */
+size_t message_advance(size_t len, int written, size_t size) {
+    if (written > 0) {
+        len += (size_t) written;
     }
-    if (listen(sockfd, 5) < 0) {
-        perror("Error listening");
-        free(cf);
-        close(sockfd);
-        exit(EXIT_FAILURE);
+    return len < size ? len : size - 1;
+}
+
+/**
+ * Send the result of the probing phase to the client
+ * @param s session, after probing_phase. The client address, verdict, slowdown and z of
+ * its result are filled in
+ * @return 0 on success, -1 on failure
+ */
+int post_probe_sender(struct session* s) {
+    struct config* cf = &s->cf;
+    struct result_summary* result = &s->result;
+    session_touch(s);
+    if (session_wait(s, s->post_sock, INT64_MAX) <= 0) {
+        perror("Error waiting for the client");
+        return -1;
     }
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
 
-    int cli_sock = accept(sockfd, (struct sockaddr *)&client_addr, &client_len);
-    if (cli_sock < 0) {
+    s->result_sock = accept(s->post_sock, (struct sockaddr *)&client_addr, &client_len);
+    if (s->result_sock < 0) {
         perror("Error accepting connection");
-        free(cf);
-        close(sockfd);
-        close(cli_sock);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    struct timeval tv;
+    tv.tv_sec = s->idle_sec;
+    tv.tv_usec = 0;
+    setsockopt(s->result_sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
+
     char buffer[BUF_SIZE];
-    if (time_diff > 100) {
-        strncpy(buffer, "Compression detected", sizeof(buffer) - 1);
-    } else {
-        strncpy(buffer, "No compression detected", sizeof(buffer) - 1);
+    double slowdown, z;
+    int compressed = compression_verdict(&s->low_stats, &s->high_stats, strtod(cf->slowdown_threshold, NULL),
+                                         &slowdown, &z);
+    metrics_verdict(compressed);
+    result->target = client_addr.sin_addr.s_addr;
+    result->verdict = compressed ? RESULT_COMPRESSION : RESULT_NONE;
+    result->slowdown = slowdown;
+    result->z = z;
+    size_t len = message_advance(0, snprintf(buffer, sizeof(buffer), "%s\n",
+                                             compressed ? "Compression detected" : "No compression detected"),
+                                 sizeof(buffer));
+    len = message_advance(len, train_stats_format(&s->low_stats, "low", buffer + len, sizeof(buffer) - len),
+                          sizeof(buffer));
+    len = message_advance(len, snprintf(buffer + len, sizeof(buffer) - len, "\n"), sizeof(buffer));
+    len = message_advance(len, train_stats_format(&s->high_stats, "high", buffer + len, sizeof(buffer) - len),
+                          sizeof(buffer));
+    double line_time = train_stats_line_time_ms(&s->low_stats);
+    if (line_time > 0) {
+        len = message_advance(len, snprintf(buffer + len, sizeof(buffer) - len,
+                                            "\ndifference %.3f ms = %.3f low train line times",
+                                            s->time_diff, s->time_diff / line_time),
+                              sizeof(buffer));
     }
-    buffer[sizeof buffer - 1] = '\0';
-    if (write(cli_sock, buffer, strlen(buffer) + 1) < 0) {
+    snprintf(buffer + len, sizeof(buffer) - len, "\nslowdown %.2f%% (%.1f standard errors, threshold %s)",
+             slowdown * 100, z, cf->slowdown_threshold);
+    if (stats_count_send(write(s->result_sock, buffer, strlen(buffer) + 1)) < 0) {
         perror("Error writing to socket");
-        free(cf);
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
     printf("Result {%s} sent to client\n", buffer);
-    close(cli_sock);
-    close(sockfd);
+    if (cf->export_file[0] != '\0' && timing_export_sender(s->result_sock, &s->low, &s->high) < 0) {
+        perror("Error exporting packet timings");
+    }
+    session_close(&s->result_sock);
+    session_close(&s->post_sock);
+    return 0;
 }
 
+void usage(const char* name) {
+    fprintf(stderr, "usage: %s <port> [-d [-i idle_seconds]] [-s stats_socket] [-m metrics_port|metrics_socket]\n"
+                    "       [-r results_log [-p]] [-c capture.pcapng [-H]]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * log_result - append the session to the results log
+ * @param log
+ * @param cf configuration struct
+ * @param result verdict from post_probe_sender
+ * @param low_stats
+ * @param high_stats
+ * @param low arrival record of the low entropy train, logged if with_timings is set
+ * @param high
+ * @param with_timings
+ */
+void log_result(struct results_log* log, struct config* cf, struct result_summary* result,
+                const struct train_stats* low_stats, const struct train_stats* high_stats,
+                const struct train_record* low, const struct train_record* high, int with_timings) {
+    const struct train_stats* stats[2] = {low_stats, high_stats};
+    result->source = RESULT_SOURCE_SERVER;
+    result->payload_size = (uint16_t) strtol(cf->udp_payload_size, NULL, 10);
+    result->packets = (uint32_t) strtol(cf->num_udp_packets, NULL, 10);
+    for (int i = 0; i < 2; i++) {
+        result->received[i] = (uint32_t) stats[i]->received;
+        result->interval[i] = stats[i]->received > 1 ? (stats[i]->last_ns - stats[i]->first_ns) / 1e9 : -1;
+    }
+    result->capacity_bps = train_stats_capacity_bps(low_stats);
+
+    unsigned char* timings = NULL;
+    size_t timings_len = 0;
+    if (with_timings) {
+        timings = timing_export_encode(low, high, &timings_len);
+    }
+    if (results_log_append(log, result, timings, timings_len) < 0) {
+        perror("Error appending to the results log");
+    }
+    free(timings);
+}
+
+/**
+ * session_run - one measurement, from the configuration to the result
+ * @param s session with the control connection accepted
+ * @param log results log, NULL for none
+ * @param with_timings
+ * @return 0 on success, -1 if the session failed
+ */
+int session_run(struct session* s, struct results_log* log, int with_timings) {
+    metrics_session_start();
+    int phase = stats_phase_begin("config exchange");
+    int rc = pre_probe_config_receive(s);
+    stats_phase_end(phase);
+    if (rc < 0) {
+        metrics_session_failed();
+        return -1;
+    }
+    socklen_t local_len = sizeof(s->probe_local);
+    getsockname(s->cli_sock, (struct sockaddr *)&s->probe_local, &local_len);
+    s->probe_local.sin_port = htons((int) strtol(s->cf.dst_port_udp, NULL, 10));
+    printf("Timing with %s\n", mono_clock_setup(s->cf.timing_clock));
+    /* the result listener is up before the trains, so the client never connects too early */
+    s->probe_buf = (char*) malloc(strtol(s->cf.udp_payload_size, NULL, 10));
+    if (s->probe_buf == NULL) {
+        perror("Error allocating the probe buffer");
+        metrics_session_failed();
+        return -1;
+    }
+    s->probe_sock = probe_socket_setup(&s->cf);
+    s->post_sock = listen_socket((int) strtol(s->cf.post_probe_port, NULL, 10));
+    if (s->probe_sock < 0 || s->post_sock < 0) {
+        metrics_session_failed();
+        return -1;
+    }
+    if (strtol(s->cf.target_train_ms, NULL, 10) > 0) {
+        phase = stats_phase_begin("calibration");
+        rc = calibration_phase(s);
+        stats_phase_end(phase);
+        if (rc < 0) {
+            metrics_session_failed();
+            return -1;
+        }
+    }
+    session_close(&s->cli_sock);
+    phase = stats_idle_begin("startup wait");
+    metrics_sleep(1); // sleep one sec
+    stats_phase_end(phase);
+
+    if (probing_phase(s) < 0) {
+        metrics_session_failed();
+        return -1;
+    }
+    stats_rx_drops_disable(s->probe_sock);
+    session_close(&s->probe_sock);
+
+    phase = stats_phase_begin("result exchange");
+    rc = post_probe_sender(s);
+    stats_phase_end(phase);
+    if (rc < 0) {
+        metrics_session_failed();
+        return -1;
+    }
+    metrics_session_end();
+    if (log != NULL) {
+        log_result(log, &s->cf, &s->result, &s->low_stats, &s->high_stats, &s->low, &s->high, with_timings);
+    }
+    return 0;
+}
 
 /**
  * Main function
@@ -236,25 +688,114 @@ void post_probe_sender(struct config* cf, double time_diff) {
  * @return
  */
 int main(int argc, char** argv) {
-    int tcp_port = (int) strtol(argv[1], NULL, 10);
-
-    cJSON *root = NULL;
-    struct config* cf = (struct config*) malloc(sizeof(struct config));
-    if (cf == NULL) {
-        perror("Error allocating memory for config struct");
+    const char* stats_socket = NULL;
+    const char* metrics = NULL;
+    const char* results_path = NULL;
+    int with_timings = 0;
+    const char* capture_path = NULL;
+    int headers_only = 0;
+    int daemon_mode = 0;
+    int idle_sec = SESSION_IDLE_SEC;
+    int opt;
+    while ((opt = getopt(argc, argv, "di:s:m:r:pc:H")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 'i':
+                idle_sec = (int) strtol(optarg, NULL, 10);
+                if (idle_sec <= 0) usage(argv[0]);
+                break;
+            case 's':
+                stats_socket = optarg;
+                break;
+            case 'm':
+                metrics = optarg;
+                break;
+            case 'r':
+                results_path = optarg;
+                break;
+            case 'p':
+                with_timings = 1;
+                break;
+            case 'c':
+                capture_path = optarg;
+                break;
+            case 'H':
+                headers_only = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+    }
+    int tcp_port = (int) strtol(argv[optind], NULL, 10);
+    signal(SIGPIPE, SIG_IGN);     /* a client that hangs up fails its session, not the server */
+    if (daemon_mode) {
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    stats_init("compdetect_server", stats_socket);
+    metrics_worker_register();
+    if (metrics != NULL && metrics_serve(metrics) < 0) {
+        perror("Error opening the metrics endpoint");
         exit(EXIT_FAILURE);
     }
-    printf("Waiting For Configuration...\n");
-    pre_probe_conn_accept(tcp_port, cf, root);
-    cJSON_Delete(root);
-    sleep(1); // sleep one sec
-
-    double time_diff;
-    probing_phase(cf, &time_diff);
-
-    post_probe_sender(cf, time_diff);
+    struct results_log results;
+    if (results_path != NULL && results_log_open(&results, results_path) < 0) {
+        perror("Error opening the results log");
+        exit(EXIT_FAILURE);
+    }
+    if (capture_path != NULL && capture_open(capture_path, "compdetect_server", headers_only) < 0) {
+        perror("Error opening the capture file");
+        exit(EXIT_FAILURE);
+    }
+    int listen_sock = listen_socket(tcp_port);
+    if (listen_sock < 0) {
+        exit(EXIT_FAILURE);
+    }
+    timer_wheel_init(&timers, mono_now_ns());
 
-    free(cf);
+    /* one session at a time: trains measured side by side would skew each other's timing */
+    int failed = 0;
+    for (unsigned long id = 1; ; id++) {
+        if (daemon_mode) {
+            stats_phases_reset();
+        }
+        printf("Waiting For Configuration...\n");
+        struct session* s = session_new(id, idle_sec);
+        if (s == NULL) {
+            perror("Error allocating memory for the session");
+            exit(EXIT_FAILURE);
+        }
+        socklen_t client_len = sizeof(s->client);
+        s->cli_sock = accept(listen_sock, (struct sockaddr *)&s->client, &client_len);
+        if (s->cli_sock < 0) {
+            perror("Error accepting connection");
+            session_free(s);
+            if (daemon_mode && (errno == EINTR || errno == ECONNABORTED)) {
+                continue;
+            }
+            exit(EXIT_FAILURE);
+        }
+        session_touch(s);
+        if (daemon_mode) {
+            printf("Session %lu from %s\n", id, inet_ntoa(s->client.sin_addr));
+        }
+        failed = session_run(s, results_path != NULL ? &results : NULL, with_timings) < 0;
+        if (failed) {
+            fprintf(stderr, "Session %lu failed\n", id);
+        }
+        session_free(s);
+        if (!daemon_mode) {
+            break;
+        }
+    }
+    close(listen_sock);
+    if (results_path != NULL) {
+        results_log_close(&results);
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return failed ? EXIT_FAILURE : 0;
+}
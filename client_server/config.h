@@ -5,8 +5,16 @@
 #ifndef UNTITLED_CONFIG_H
 #define UNTITLED_CONFIG_H
 
+#include <errno.h>
 #include "cJSON.h"
 
+#define CALIBRATION_PACKETS 200
+#define MIN_TRAIN_PACKETS 100
+#define MAX_TRAIN_PACKETS 65535 /* sequence numbers are 16 bit */
+#define MIN_UDP_PAYLOAD 2       /* room for the sequence number */
+#define MAX_UDP_PAYLOAD 65507
+#define RTT_TRAIN_FACTOR 10
+
 struct config {
     char server_ip[20];
     char src_port_udp[20];
@@ -19,6 +27,23 @@ struct config {
     char inter_measure_time[20];
     char num_udp_packets[20];
     char udp_ttl[20];
+    char export_file[64];
+    char target_train_ms[20];
+    char slowdown_threshold[20];
+    char tx_ring[20];
+    char num_marker_ports[20];
+    char train_retries[20];
+    char targets_file[64];
+    char egress_budget_mbps[20];
+    char marker_strategy[20];
+    char marker_open_port[20];
+    char marker_udp_port[20];
+    char unreach_train_port[20];
+    char stats_socket[108];
+    char timing_clock[20];
+    char results_log[64];
+    char capture_file[64];
+    char capture_headers_only[20];
 };
 
 /**
@@ -66,34 +91,94 @@ cJSON* read_file_config(FILE* file) {
     return root;
 }
 
+/**
+ * get_optional_config - copy an optional string item, or a default when it is absent
+ * @param root
+ * @param key
+ * @param def
+ * @param dst
+ * @param size
+ */
+void get_optional_config(cJSON* root, const char* key, const char* def, char* dst, size_t size) {
+    cJSON* item = cJSON_GetObjectItem(root, key);
+    const char* value = (item != NULL && cJSON_IsString(item)) ? item->valuestring : def;
+    strncpy(dst, value, size - 1);
+    dst[size - 1] = '\0';
+}
+
+/**
+ * config_long - parse a numeric configuration value that must lie in a range
+ * @param value
+ * @param min
+ * @param max
+ * @param out the value, untouched on failure
+ * @return 0 on success, -1 if value is not a whole number in [min, max]
+ */
+int config_long(const char* value, long min, long max, long* out) {
+    char* end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno != 0 || parsed < min || parsed > max) {
+        return -1;
+    }
+    *out = parsed;
+    return 0;
+}
+
+/**
+ * check_configuration - whether get_configuration can read the JSON data, for programs that
+ * must not die on a bad configuration from the network
+ * @param root may be NULL
+ * @return NULL if it can, the first missing or non-string required key otherwise
+ */
+const char* check_configuration(cJSON* root) {
+    static const char* required[] = {"server_ip", "pre_probe_port", "post_probe_port", "src_port_udp",
+                                     "dst_port_udp", "dst_port_tcp_head", "dst_port_tcp_tail", "udp_payload_size",
+                                     "inter_measure_time", "num_udp_packets", "udp_ttl"};
+    for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+        if (!cJSON_IsString(cJSON_GetObjectItem(root, required[i]))) {
+            return required[i];
+        }
+    }
+    return NULL;
+}
+
 /**
  * get_configuration - get the configuration from the JSON data
  * @param cf
  * @param root
  */
 void get_configuration(struct config* cf, cJSON* root) {
-    strncpy(cf->server_ip, cJSON_GetObjectItem(root, "server_ip")->valuestring,
-            sizeof(cf->server_ip));
-    strncpy(cf->pre_probe_port, cJSON_GetObjectItem(root, "pre_probe_port")->valuestring,
-            sizeof(cf->pre_probe_port));
-    strncpy(cf->post_probe_port, cJSON_GetObjectItem(root, "post_probe_port")->valuestring,
-            sizeof(cf->post_probe_port));
-    strncpy(cf->src_port_udp, cJSON_GetObjectItem(root, "src_port_udp")->valuestring,
-            sizeof(cf->src_port_udp));
-    strncpy(cf->dst_port_udp, cJSON_GetObjectItem(root, "dst_port_udp")->valuestring,
-            sizeof(cf->dst_port_udp));
-    strncpy(cf->dst_port_tcp_head, cJSON_GetObjectItem(root, "dst_port_tcp_head")->valuestring,
-            sizeof(cf->dst_port_tcp_head));
-    strncpy(cf->dst_port_tcp_tail, cJSON_GetObjectItem(root, "dst_port_tcp_tail")->valuestring,
-            sizeof(cf->dst_port_tcp_tail));
-    strncpy(cf->udp_payload_size, cJSON_GetObjectItem(root, "udp_payload_size")->valuestring,
-            sizeof(cf->udp_payload_size));
-    strncpy(cf->inter_measure_time, cJSON_GetObjectItem(root, "inter_measure_time")->valuestring,
-            sizeof(cf->inter_measure_time));
-    strncpy(cf->num_udp_packets, cJSON_GetObjectItem(root, "num_udp_packets")->valuestring,
-            sizeof(cf->num_udp_packets));
-    strncpy(cf->udp_ttl, cJSON_GetObjectItem(root, "udp_ttl")->valuestring,
-            sizeof(cf->udp_ttl));
+    get_optional_config(root, "server_ip", "", cf->server_ip, sizeof(cf->server_ip));
+    get_optional_config(root, "pre_probe_port", "", cf->pre_probe_port, sizeof(cf->pre_probe_port));
+    get_optional_config(root, "post_probe_port", "", cf->post_probe_port, sizeof(cf->post_probe_port));
+    get_optional_config(root, "src_port_udp", "", cf->src_port_udp, sizeof(cf->src_port_udp));
+    get_optional_config(root, "dst_port_udp", "", cf->dst_port_udp, sizeof(cf->dst_port_udp));
+    get_optional_config(root, "dst_port_tcp_head", "", cf->dst_port_tcp_head, sizeof(cf->dst_port_tcp_head));
+    get_optional_config(root, "dst_port_tcp_tail", "", cf->dst_port_tcp_tail, sizeof(cf->dst_port_tcp_tail));
+    get_optional_config(root, "udp_payload_size", "", cf->udp_payload_size, sizeof(cf->udp_payload_size));
+    get_optional_config(root, "inter_measure_time", "", cf->inter_measure_time, sizeof(cf->inter_measure_time));
+    get_optional_config(root, "num_udp_packets", "", cf->num_udp_packets, sizeof(cf->num_udp_packets));
+    get_optional_config(root, "udp_ttl", "", cf->udp_ttl, sizeof(cf->udp_ttl));
+    get_optional_config(root, "export_file", "", cf->export_file, sizeof(cf->export_file));
+    get_optional_config(root, "target_train_ms", "200", cf->target_train_ms, sizeof(cf->target_train_ms));
+    get_optional_config(root, "slowdown_threshold", "0.1", cf->slowdown_threshold,
+                        sizeof(cf->slowdown_threshold));
+    get_optional_config(root, "tx_ring", "0", cf->tx_ring, sizeof(cf->tx_ring));
+    get_optional_config(root, "num_marker_ports", "1", cf->num_marker_ports, sizeof(cf->num_marker_ports));
+    get_optional_config(root, "train_retries", "2", cf->train_retries, sizeof(cf->train_retries));
+    get_optional_config(root, "targets_file", "", cf->targets_file, sizeof(cf->targets_file));
+    get_optional_config(root, "egress_budget_mbps", "0", cf->egress_budget_mbps, sizeof(cf->egress_budget_mbps));
+    get_optional_config(root, "marker_strategy", "rst", cf->marker_strategy, sizeof(cf->marker_strategy));
+    get_optional_config(root, "marker_open_port", "80", cf->marker_open_port, sizeof(cf->marker_open_port));
+    get_optional_config(root, "marker_udp_port", "33434", cf->marker_udp_port, sizeof(cf->marker_udp_port));
+    get_optional_config(root, "unreach_train_port", "", cf->unreach_train_port, sizeof(cf->unreach_train_port));
+    get_optional_config(root, "stats_socket", "", cf->stats_socket, sizeof(cf->stats_socket));
+    get_optional_config(root, "timing_clock", "raw", cf->timing_clock, sizeof(cf->timing_clock));
+    get_optional_config(root, "results_log", "", cf->results_log, sizeof(cf->results_log));
+    get_optional_config(root, "capture_file", "", cf->capture_file, sizeof(cf->capture_file));
+    get_optional_config(root, "capture_headers_only", "0", cf->capture_headers_only,
+                        sizeof(cf->capture_headers_only));
 }
 
 
@@ -0,0 +1,414 @@
+//
+// Server metrics in the Prometheus text exposition format, served over HTTP on a local
+// TCP port or a Unix socket.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_MAX_WORKERS 64
+#define METRICS_TRAINS 2        /* low and high entropy */
+#define METRICS_BUCKETS 10
+#define METRICS_BODY_LEN 16384
+
+const double metrics_train_buckets[METRICS_BUCKETS] = {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+const char* metrics_train_names[METRICS_TRAINS] = {"low", "high"};
+
+/**
+ * Counters of one worker thread. Only the owning thread writes them, so an update is a plain
+ * relaxed load and store with no read-modify-write and no shared cache line; the scraper sums
+ * all workers with relaxed loads. A slot is never reused, its totals outlive the thread.
+ */
+struct metrics_worker {
+    int used;
+    int running;
+    pthread_t thread;
+    double cpu_final;                   /* seconds, once the thread is gone */
+    uint64_t sessions_started;
+    uint64_t sessions_completed;
+    uint64_t sessions_failed;
+    uint64_t verdicts[2];               /* no compression, compression */
+    uint64_t train_buckets[METRICS_TRAINS][METRICS_BUCKETS + 1];
+    uint64_t train_sum_ns[METRICS_TRAINS];
+    uint64_t packets_expected[METRICS_TRAINS];
+    uint64_t packets_received[METRICS_TRAINS];
+    uint64_t rx_overflows;
+    uint64_t lag_count;
+    uint64_t lag_sum_ns;
+    uint64_t lag_max_ns;
+} __attribute__((aligned(64)));
+
+static struct metrics_worker metrics_workers[METRICS_MAX_WORKERS];
+static int metrics_worker_count = 0;
+static __thread struct metrics_worker* metrics_self = NULL;
+
+#define METRICS_ADD(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+/**
+ * metrics_worker_register - give the calling thread its counter slot
+ * @return 0 on success, -1 if all slots are taken
+ */
+int metrics_worker_register(void) {
+    int slot = __atomic_fetch_add(&metrics_worker_count, 1, __ATOMIC_ACQ_REL);
+    if (slot >= METRICS_MAX_WORKERS) {
+        return -1;
+    }
+    struct metrics_worker* w = &metrics_workers[slot];
+    w->thread = pthread_self();
+    w->running = 1;
+    __atomic_store_n(&w->used, 1, __ATOMIC_RELEASE);
+    metrics_self = w;
+    return 0;
+}
+
+/**
+ * metrics_thread_cpu - CPU time of a worker thread
+ * @param w
+ * @return seconds
+ */
+double metrics_thread_cpu(struct metrics_worker* w) {
+    if (!__atomic_load_n(&w->running, __ATOMIC_ACQUIRE)) {
+        return w->cpu_final;
+    }
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(w->thread, &clock) != 0 || clock_gettime(clock, &ts) < 0) {
+        return 0;
+    }
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * metrics_worker_exit - keep the calling thread's CPU time once it is gone
+ */
+void metrics_worker_exit(void) {
+    if (metrics_self == NULL) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    metrics_self->cpu_final = (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+    __atomic_store_n(&metrics_self->running, 0, __ATOMIC_RELEASE);
+    metrics_self = NULL;
+}
+
+void metrics_session_start(void) {
+    if (metrics_self != NULL) {
+        METRICS_ADD(metrics_self->sessions_started, 1);
+    }
+}
+
+void metrics_session_end(void) {
+    if (metrics_self != NULL) {
+        METRICS_ADD(metrics_self->sessions_completed, 1);
+    }
+}
+
+void metrics_session_failed(void) {
+    if (metrics_self != NULL) {
+        METRICS_ADD(metrics_self->sessions_failed, 1);
+    }
+}
+
+/**
+ * metrics_verdict
+ * @param compressed
+ */
+void metrics_verdict(int compressed) {
+    if (metrics_self != NULL) {
+        METRICS_ADD(metrics_self->verdicts[compressed != 0], 1);
+    }
+}
+
+/**
+ * metrics_train - record a received train
+ * @param train 0 low entropy, 1 high entropy
+ * @param duration seconds between the first and last arrival
+ * @param expected packets sent
+ * @param received packets that arrived
+ */
+void metrics_train(int train, double duration, int expected, int received) {
+    struct metrics_worker* w = metrics_self;
+    if (w == NULL) {
+        return;
+    }
+    int b = 0;
+    while (b < METRICS_BUCKETS && duration > metrics_train_buckets[b]) {
+        b++;
+    }
+    METRICS_ADD(w->train_buckets[train][b], 1);
+    METRICS_ADD(w->train_sum_ns[train], (uint64_t) (duration * 1e9));
+    METRICS_ADD(w->packets_expected[train], (uint64_t) expected);
+    METRICS_ADD(w->packets_received[train], (uint64_t) received);
+}
+
+/**
+ * metrics_rx_overflows - packets the kernel dropped from a full receive queue
+ * @param drops
+ */
+void metrics_rx_overflows(uint64_t drops) {
+    if (metrics_self != NULL) {
+        METRICS_ADD(metrics_self->rx_overflows, drops);
+    }
+}
+
+/**
+ * metrics_sleep - sleep and record how late the thread woke up, the lag a loop of this
+ * worker would see before it gets to run
+ * @param sec
+ */
+void metrics_sleep(double sec) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double deadline = (double) ts.tv_sec + (double) ts.tv_nsec / 1e9 + sec;
+    ts.tv_sec = (time_t) deadline;
+    ts.tv_nsec = (long) ((deadline - (double) ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+    struct metrics_worker* w = metrics_self;
+    if (w == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double lag = (double) ts.tv_sec + (double) ts.tv_nsec / 1e9 - deadline;
+    uint64_t lag_ns = lag > 0 ? (uint64_t) (lag * 1e9) : 0;
+    METRICS_ADD(w->lag_count, 1);
+    METRICS_ADD(w->lag_sum_ns, lag_ns);
+    if (lag_ns > w->lag_max_ns) {
+        __atomic_store_n(&w->lag_max_ns, lag_ns, __ATOMIC_RELAXED);
+    }
+}
+
+#define METRICS_SUM(total, field) \
+    for (int i_ = 0; i_ < workers; i_++) { \
+        (total) += __atomic_load_n(&metrics_workers[i_].field, __ATOMIC_RELAXED); \
+    }
+
+/**
+ * metrics_format - aggregate all workers into the text exposition format
+ * @param out
+ * @param len
+ * @return length written, truncated to len - 1
+ */
+int metrics_format(char* out, size_t len) {
+    int workers = __atomic_load_n(&metrics_worker_count, __ATOMIC_ACQUIRE);
+    if (workers > METRICS_MAX_WORKERS) {
+        workers = METRICS_MAX_WORKERS;
+    }
+    while (workers > 0 && !__atomic_load_n(&metrics_workers[workers - 1].used, __ATOMIC_ACQUIRE)) {
+        workers--;  /* still registering */
+    }
+    size_t n = 0;
+#define EMIT(...) \
+    if (n < len) { \
+        n += snprintf(out + n, len - n, __VA_ARGS__); \
+    }
+
+    uint64_t started = 0, completed = 0, failed = 0;
+    METRICS_SUM(started, sessions_started);
+    METRICS_SUM(completed, sessions_completed);
+    METRICS_SUM(failed, sessions_failed);
+    EMIT("# HELP compdetect_sessions_active Measurement sessions in progress.\n");
+    EMIT("# TYPE compdetect_sessions_active gauge\n");
+    EMIT("compdetect_sessions_active %llu\n",
+         (unsigned long long) (started > completed + failed ? started - completed - failed : 0));
+    EMIT("# HELP compdetect_sessions_completed_total Measurement sessions finished.\n");
+    EMIT("# TYPE compdetect_sessions_completed_total counter\n");
+    EMIT("compdetect_sessions_completed_total %llu\n", (unsigned long long) completed);
+    EMIT("# HELP compdetect_sessions_failed_total Measurement sessions given up on an error or reaped idle.\n");
+    EMIT("# TYPE compdetect_sessions_failed_total counter\n");
+    EMIT("compdetect_sessions_failed_total %llu\n", (unsigned long long) failed);
+
+    uint64_t verdicts[2] = {0, 0};
+    METRICS_SUM(verdicts[0], verdicts[0]);
+    METRICS_SUM(verdicts[1], verdicts[1]);
+    EMIT("# HELP compdetect_verdicts_total Verdicts sent to clients.\n");
+    EMIT("# TYPE compdetect_verdicts_total counter\n");
+    EMIT("compdetect_verdicts_total{verdict=\"none\"} %llu\n", (unsigned long long) verdicts[0]);
+    EMIT("compdetect_verdicts_total{verdict=\"compression\"} %llu\n", (unsigned long long) verdicts[1]);
+
+    EMIT("# HELP compdetect_train_duration_seconds Time from the first to the last packet of a train.\n");
+    EMIT("# TYPE compdetect_train_duration_seconds histogram\n");
+    for (int t = 0; t < METRICS_TRAINS; t++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= METRICS_BUCKETS; b++) {
+            uint64_t count = 0;
+            METRICS_SUM(count, train_buckets[t][b]);
+            cumulative += count;
+            if (b < METRICS_BUCKETS) {
+                EMIT("compdetect_train_duration_seconds_bucket{entropy=\"%s\",le=\"%g\"} %llu\n",
+                     metrics_train_names[t], metrics_train_buckets[b], (unsigned long long) cumulative);
+            } else {
+                EMIT("compdetect_train_duration_seconds_bucket{entropy=\"%s\",le=\"+Inf\"} %llu\n",
+                     metrics_train_names[t], (unsigned long long) cumulative);
+            }
+        }
+        uint64_t sum_ns = 0;
+        METRICS_SUM(sum_ns, train_sum_ns[t]);
+        EMIT("compdetect_train_duration_seconds_sum{entropy=\"%s\"} %.6f\n", metrics_train_names[t], sum_ns / 1e9);
+        EMIT("compdetect_train_duration_seconds_count{entropy=\"%s\"} %llu\n", metrics_train_names[t],
+             (unsigned long long) cumulative);
+    }
+
+    EMIT("# HELP compdetect_probe_packets_expected_total Probe packets the clients sent.\n");
+    EMIT("# TYPE compdetect_probe_packets_expected_total counter\n");
+    for (int t = 0; t < METRICS_TRAINS; t++) {
+        uint64_t expected = 0;
+        METRICS_SUM(expected, packets_expected[t]);
+        EMIT("compdetect_probe_packets_expected_total{entropy=\"%s\"} %llu\n", metrics_train_names[t],
+             (unsigned long long) expected);
+    }
+    EMIT("# HELP compdetect_probe_packets_lost_total Probe packets that did not arrive.\n");
+    EMIT("# TYPE compdetect_probe_packets_lost_total counter\n");
+    for (int t = 0; t < METRICS_TRAINS; t++) {
+        uint64_t expected = 0, received = 0;
+        METRICS_SUM(expected, packets_expected[t]);
+        METRICS_SUM(received, packets_received[t]);
+        EMIT("compdetect_probe_packets_lost_total{entropy=\"%s\"} %llu\n", metrics_train_names[t],
+             (unsigned long long) (expected > received ? expected - received : 0));
+    }
+
+    uint64_t overflows = 0;
+    METRICS_SUM(overflows, rx_overflows);
+    EMIT("# HELP compdetect_receive_buffer_overflows_total Probe packets dropped from a full socket receive queue.\n");
+    EMIT("# TYPE compdetect_receive_buffer_overflows_total counter\n");
+    EMIT("compdetect_receive_buffer_overflows_total %llu\n", (unsigned long long) overflows);
+
+    EMIT("# HELP compdetect_worker_cpu_seconds_total CPU time of each worker thread.\n");
+    EMIT("# TYPE compdetect_worker_cpu_seconds_total counter\n");
+    for (int i = 0; i < workers; i++) {
+        EMIT("compdetect_worker_cpu_seconds_total{worker=\"%d\"} %.6f\n", i, metrics_thread_cpu(&metrics_workers[i]));
+    }
+    EMIT("# HELP compdetect_worker_lag_seconds How late a worker woke up from its timed waits.\n");
+    EMIT("# TYPE compdetect_worker_lag_seconds summary\n");
+    for (int i = 0; i < workers; i++) {
+        struct metrics_worker* w = &metrics_workers[i];
+        EMIT("compdetect_worker_lag_seconds_sum{worker=\"%d\"} %.6f\n", i,
+             __atomic_load_n(&w->lag_sum_ns, __ATOMIC_RELAXED) / 1e9);
+        EMIT("compdetect_worker_lag_seconds_count{worker=\"%d\"} %llu\n", i,
+             (unsigned long long) __atomic_load_n(&w->lag_count, __ATOMIC_RELAXED));
+    }
+    EMIT("# HELP compdetect_worker_lag_max_seconds Largest wake up lag of each worker.\n");
+    EMIT("# TYPE compdetect_worker_lag_max_seconds gauge\n");
+    for (int i = 0; i < workers; i++) {
+        EMIT("compdetect_worker_lag_max_seconds{worker=\"%d\"} %.6f\n", i,
+             __atomic_load_n(&metrics_workers[i].lag_max_ns, __ATOMIC_RELAXED) / 1e9);
+    }
+#undef EMIT
+    return (int) (n < len ? n : len - 1);
+}
+
+/**
+ * metrics_server - answer each connection with one HTTP response holding a scrape, whatever
+ * was asked for
+ * @param args listening socket
+ * @return
+ */
+void* metrics_server(void* args) {
+    int sockfd = (int) (intptr_t) args;
+    char* body = (char*) malloc(METRICS_BODY_LEN);
+    if (body == NULL) {
+        perror("Error allocating the metrics buffer");
+        return NULL;
+    }
+    while (1) {
+        int conn = accept(sockfd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        /* the request is not looked at, a short timeout keeps a silent client from stalling scrapes */
+        struct timeval tv = {0, 200000};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char request[1024];
+        if (recv(conn, request, sizeof(request), 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            close(conn);
+            continue;
+        }
+        int len = metrics_format(body, METRICS_BODY_LEN);
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %d\r\n\r\n", len);
+        if (write(conn, header, header_len) < 0 || write(conn, body, len) < 0) {
+            perror("Warning: failed to write metrics");
+        }
+        close(conn);
+    }
+    free(body);
+    close(sockfd);
+    return NULL;
+}
+
+/**
+ * metrics_serve - serve metrics in the background
+ * @param where a TCP port on 127.0.0.1, or a Unix socket path if it contains a '/'
+ * @return 0 on success, -1 on failure
+ */
+int metrics_serve(const char* where) {
+    int sockfd;
+    if (strchr(where, '/') != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(where) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, where);
+        sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sockfd < 0) {
+            return -1;
+        }
+        unlink(where);
+        if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((int) strtol(where, NULL, 10));
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sockfd < 0) {
+            return -1;
+        }
+        int on = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+    }
+    if (listen(sockfd, 16) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_server, (void*) (intptr_t) sockfd) != 0) {
+        close(sockfd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif //METRICS_H
@@ -0,0 +1,159 @@
+//
+// Interval timing on CLOCK_MONOTONIC_RAW, which NTP neither steps nor slews, with an optional
+// calibrated TSC for cheap per-packet stamps and conversion of kernel (CLOCK_REALTIME)
+// timestamps onto the same timeline.
+//
+
+#ifndef MONO_CLOCK_H
+#define MONO_CLOCK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#define MONO_TSC_CALIBRATION_MS 50
+
+/**
+ * Linear map from TSC ticks to CLOCK_MONOTONIC_RAW nanoseconds, measured at calibration
+ */
+struct mono_tsc {
+    int enabled;
+    double ns_per_tick;
+    uint64_t base_tick;
+    int64_t base_ns;
+};
+
+static struct mono_tsc mono_tsc;
+
+/**
+ * mono_now_ns
+ * @return nanoseconds on CLOCK_MONOTONIC_RAW
+ */
+int64_t mono_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * mono_tsc_sample - read the TSC together with the time it corresponds to, taking the
+ * tightest of a few clock reads around it
+ * @param tick output
+ * @return nanoseconds on CLOCK_MONOTONIC_RAW
+ */
+int64_t mono_tsc_sample(uint64_t* tick) {
+#if defined(__x86_64__) || defined(__i386__)
+    int64_t best = -1, at = 0;
+    for (int i = 0; i < 5; i++) {
+        unsigned int aux;
+        int64_t before = mono_now_ns();
+        uint64_t t = __rdtscp(&aux);
+        int64_t after = mono_now_ns();
+        if (best < 0 || after - before < best) {
+            best = after - before;
+            at = before + (after - before) / 2;
+            *tick = t;
+        }
+    }
+    return at;
+#else
+    *tick = 0;
+    return mono_now_ns();
+#endif
+}
+
+/**
+ * mono_tsc_enable - calibrate the TSC against CLOCK_MONOTONIC_RAW and use it for mono_fast_ns.
+ * Needs an invariant TSC, which runs at a constant rate through frequency and sleep states.
+ * @return 0 on success, -1 if the CPU has no usable TSC
+ */
+int mono_tsc_enable(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || (edx & (1u << 27)) == 0) {
+        return -1;  /* no rdtscp */
+    }
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || (edx & (1u << 8)) == 0) {
+        return -1;  /* not invariant */
+    }
+    uint64_t tick0, tick1;
+    int64_t ns0 = mono_tsc_sample(&tick0);
+    struct timespec pause = {0, MONO_TSC_CALIBRATION_MS * 1000000L};
+    nanosleep(&pause, NULL);
+    int64_t ns1 = mono_tsc_sample(&tick1);
+    if (tick1 <= tick0) {
+        return -1;
+    }
+    mono_tsc.ns_per_tick = (double) (ns1 - ns0) / (double) (tick1 - tick0);
+    mono_tsc.base_tick = tick1;
+    mono_tsc.base_ns = ns1;
+    mono_tsc.enabled = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * mono_fast_ns - the cheapest stamp available, from the TSC once mono_tsc_enable succeeded
+ * @return nanoseconds on CLOCK_MONOTONIC_RAW
+ */
+int64_t mono_fast_ns(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (mono_tsc.enabled) {
+        unsigned int aux;
+        uint64_t tick = __rdtscp(&aux);
+        return mono_tsc.base_ns + (int64_t) ((double) (int64_t) (tick - mono_tsc.base_tick) * mono_tsc.ns_per_tick);
+    }
+#endif
+    return mono_now_ns();
+}
+
+/**
+ * mono_clock_setup - pick the clock mono_fast_ns reads, may be called again to change it
+ * @param source "tsc" or "raw"
+ * @return name of the clock in use
+ */
+const char* mono_clock_setup(const char* source) {
+    mono_tsc.enabled = 0;
+    if (strcmp(source, "tsc") == 0) {
+        if (mono_tsc_enable() == 0) {
+            return "tsc";
+        }
+        fprintf(stderr, "Warning: no invariant TSC, timing with CLOCK_MONOTONIC_RAW\n");
+    }
+    return "raw";
+}
+
+/**
+ * mono_from_realtime - move a kernel timestamp (SO_TIMESTAMPNS etc, CLOCK_REALTIME) onto the
+ * CLOCK_MONOTONIC_RAW timeline using the offset between the clocks now. Call it as soon as the
+ * timestamp is read, the offset drifts with NTP slewing.
+ * @param ts
+ * @return nanoseconds on CLOCK_MONOTONIC_RAW
+ */
+int64_t mono_from_realtime(const struct timespec* ts) {
+    struct timespec real;
+    int64_t before = mono_now_ns();
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t after = mono_now_ns();
+    int64_t offset = before + (after - before) / 2 - ((int64_t) real.tv_sec * 1000000000 + real.tv_nsec);
+    return (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec + offset;
+}
+
+/**
+ * mono_to_timespec
+ * @param ns
+ * @param ts output
+ */
+void mono_to_timespec(int64_t ns, struct timespec* ts) {
+    ts->tv_sec = (time_t) (ns / 1000000000);
+    ts->tv_nsec = (long) (ns % 1000000000);
+}
+
+#endif //MONO_CLOCK_H
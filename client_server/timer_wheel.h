@@ -0,0 +1,225 @@
+//
+// Hierarchical timer wheel: O(1) arming and cancelling, timers far in the future sit in coarse
+// upper levels and cascade down to finer ones as their time approaches. An occupancy bitmap per
+// level finds the next tick with work to do in O(levels), so idle stretches cost nothing.
+//
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4                  /* 64^4 ticks, 4.6 hours at 1 ms */
+#define WHEEL_TICK_NS 1000000L
+
+struct timer;
+typedef void (*timer_fn)(struct timer* t, void* arg);
+
+struct timer_wheel;
+
+/**
+ * A timer lives in one slot list at a time. pprev points at whatever points at it, so it
+ * can unlink itself, level and index say which occupancy bit to clear when the slot empties.
+ */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;       /* NULL while not armed */
+    uint64_t expires;           /* tick */
+    timer_fn fn;
+    void* arg;
+    struct timer_wheel* wheel;
+    int level;
+    int index;
+};
+
+struct timer_wheel {
+    uint64_t now;               /* next tick to run */
+    int64_t base_ns;            /* time of tick 0 */
+    uint64_t occupied[WHEEL_LEVELS];    /* bit i set while slots[level][i] is not empty */
+    struct timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/**
+ * timer_wheel_init
+ * @param w
+ * @param now_ns current time, on any monotonic clock used consistently
+ */
+void timer_wheel_init(struct timer_wheel* w, int64_t now_ns) {
+    w->now = 0;
+    w->base_ns = now_ns;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        w->occupied[l] = 0;
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            w->slots[l][i] = NULL;
+        }
+    }
+}
+
+/**
+ * timer_link - put a timer in the slot its tick belongs in, on the lowest level whose span
+ * covers it
+ * @param w
+ * @param t unlinked, expires set
+ */
+void timer_link(struct timer_wheel* w, struct timer* t) {
+    uint64_t expires = t->expires < w->now ? w->now : t->expires;     /* overdue, runs on the next tick */
+    uint64_t delta = expires - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS && delta >= (1ull << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (level == WHEEL_LEVELS) {
+        /* beyond the wheel, park in the top level and try again when it cascades */
+        level = WHEEL_LEVELS - 1;
+        expires = ((w->now >> (WHEEL_BITS * level)) + WHEEL_MASK) << (WHEEL_BITS * level);
+    }
+    int index = (int) ((expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    struct timer** slot = &w->slots[level][index];
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    *slot = t;
+    t->pprev = slot;
+    t->wheel = w;
+    t->level = level;
+    t->index = index;
+    w->occupied[level] |= 1ull << index;
+}
+
+/**
+ * timer_cancel - disarm a timer, a no-op if it is not armed
+ * @param t
+ */
+void timer_cancel(struct timer* t) {
+    if (t->pprev == NULL) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    if (t->wheel->slots[t->level][t->index] == NULL) {
+        t->wheel->occupied[t->level] &= ~(1ull << t->index);
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/**
+ * timer_arm - (re)arm a timer
+ * @param w
+ * @param t
+ * @param expires_ns when to run it
+ * @param fn
+ * @param arg
+ */
+void timer_arm(struct timer_wheel* w, struct timer* t, int64_t expires_ns, timer_fn fn, void* arg) {
+    timer_cancel(t);
+    int64_t ticks = (expires_ns - w->base_ns + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    t->expires = ticks > 0 ? (uint64_t) ticks : 0;
+    t->fn = fn;
+    t->arg = arg;
+    timer_link(w, t);
+}
+
+/**
+ * timer_wheel_cascade - move the timers of an upper level slot down to where they now belong
+ * @param w
+ * @param level
+ * @param index
+ */
+void timer_wheel_cascade(struct timer_wheel* w, int level, int index) {
+    struct timer* t = w->slots[level][index];
+    w->slots[level][index] = NULL;
+    w->occupied[level] &= ~(1ull << index);
+    while (t != NULL) {
+        struct timer* next = t->next;
+        timer_link(w, t);
+        t = next;
+    }
+}
+
+/**
+ * timer_wheel_next_tick - the next tick with work to do: a level 0 slot to run, or an occupied
+ * upper slot to cascade when its level wraps. Never later than the earliest expiry.
+ * @param w
+ * @return the tick, UINT64_MAX with no timers armed
+ */
+uint64_t timer_wheel_next_tick(const struct timer_wheel* w) {
+    uint64_t next = UINT64_MAX;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        if (w->occupied[l] == 0) {
+            continue;
+        }
+        int shift = WHEEL_BITS * l;
+        /* the period of now is still to be cascaded only if now is on its boundary */
+        uint64_t period = (w->now >> shift) + ((w->now & ((1ull << shift) - 1)) != 0);
+        int start = (int) (period & WHEEL_MASK);
+        uint64_t rotated = start == 0 ? w->occupied[l] :
+                           w->occupied[l] >> start | w->occupied[l] << (WHEEL_SLOTS - start);
+        uint64_t tick = (period + (uint64_t) __builtin_ctzll(rotated)) << shift;
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+/**
+ * timer_wheel_advance - run every timer due by now, in tick order. A timer function may arm
+ * or cancel any timer, including its own. The wheel jumps straight from one tick with work
+ * to the next, so a wheel left alone for hours catches up at once.
+ * @param w
+ * @param now_ns
+ * @return number of timers run
+ */
+int timer_wheel_advance(struct timer_wheel* w, int64_t now_ns) {
+    int fired = 0;
+    if (now_ns < w->base_ns) {
+        return 0;
+    }
+    uint64_t target = (uint64_t) ((now_ns - w->base_ns) / WHEEL_TICK_NS);
+    while (w->now <= target) {
+        uint64_t next = timer_wheel_next_tick(w);
+        if (next > target) {
+            w->now = target + 1;
+            break;
+        }
+        w->now = next;
+        for (int l = 1; l < WHEEL_LEVELS && (w->now & ((1ull << (WHEEL_BITS * l)) - 1)) == 0; l++) {
+            int index = (int) ((w->now >> (WHEEL_BITS * l)) & WHEEL_MASK);
+            if (w->occupied[l] & (1ull << index)) {
+                timer_wheel_cascade(w, l, index);
+            }
+        }
+        struct timer** slot = &w->slots[0][w->now & WHEEL_MASK];
+        w->now++;
+        while (*slot != NULL) {
+            struct timer* t = *slot;
+            timer_cancel(t);
+            t->fn(t, t->arg);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+/**
+ * timer_wheel_next_ns - when the wheel next has work to do, see timer_wheel_next_tick
+ * @param w
+ * @return time on the wheel's clock, INT64_MAX with no timers armed
+ */
+int64_t timer_wheel_next_ns(const struct timer_wheel* w) {
+    uint64_t next = timer_wheel_next_tick(w);
+    if (next == UINT64_MAX) {
+        return INT64_MAX;
+    }
+    return w->base_ns + (int64_t) next * WHEEL_TICK_NS;
+}
+
+#endif //TIMER_WHEEL_H
@@ -0,0 +1,232 @@
+//
+// Per-packet timing export, shared by the client and the server.
+//
+
+#ifndef TIMING_EXPORT_H
+#define TIMING_EXPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define EXPORT_MAGIC "CDTX"
+#define EXPORT_VERSION 1
+#define EXPORT_TRAINS 2
+#define VARINT_MAX_LEN 10
+
+/**
+ * Arrival record of one packet train, filled in by the server's receive loop.
+ * Timestamps are in nanoseconds, sequence numbers are the 16-bit values the
+ * client stamps into the first two payload bytes.
+ */
+struct train_record {
+    int count;
+    int capacity;
+    uint16_t* seq;
+    int64_t* arrival_ns;
+};
+
+/**
+ * train_record_init - preallocate room for a whole train so the receive loop never allocates
+ * @param rec
+ * @param capacity
+ * @return 0 on success, -1 on allocation failure
+ */
+int train_record_init(struct train_record* rec, int capacity) {
+    rec->count = 0;
+    rec->capacity = capacity;
+    rec->seq = (uint16_t*) malloc(sizeof(uint16_t) * (capacity > 0 ? capacity : 1));
+    rec->arrival_ns = (int64_t*) malloc(sizeof(int64_t) * (capacity > 0 ? capacity : 1));
+    if (rec->seq == NULL || rec->arrival_ns == NULL) {
+        free(rec->seq);
+        free(rec->arrival_ns);
+        rec->seq = NULL;
+        rec->arrival_ns = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * train_record_add - append one arrival, silently dropping anything past the capacity
+ * @param rec
+ * @param seq
+ * @param arrival_ns
+ */
+void train_record_add(struct train_record* rec, uint16_t seq, int64_t arrival_ns) {
+    if (rec->count >= rec->capacity) {
+        return;
+    }
+    rec->seq[rec->count] = seq;
+    rec->arrival_ns[rec->count] = arrival_ns;
+    rec->count++;
+}
+
+/**
+ * train_record_free
+ * @param rec
+ */
+void train_record_free(struct train_record* rec) {
+    free(rec->seq);
+    free(rec->arrival_ns);
+    rec->seq = NULL;
+    rec->arrival_ns = NULL;
+    rec->count = 0;
+    rec->capacity = 0;
+}
+
+/**
+ * varint_put - LEB128 encode an unsigned value
+ * @param out
+ * @param value
+ * @return number of bytes written
+ */
+size_t varint_put(unsigned char* out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char) value;
+    return n;
+}
+
+/**
+ * varint_get - LEB128 decode an unsigned value
+ * @param in
+ * @param len bytes available
+ * @param value
+ * @return number of bytes consumed, 0 if the input is truncated or malformed
+ */
+size_t varint_get(const unsigned char* in, size_t len, uint64_t* value) {
+    uint64_t result = 0;
+    for (size_t n = 0; n < len && n < VARINT_MAX_LEN; n++) {
+        result |= (uint64_t) (in[n] & 0x7F) << (7 * n);
+        if ((in[n] & 0x80) == 0) {
+            *value = result;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+int64_t zigzag_decode(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+/**
+ * train_record_encoded_max - worst case size of an encoded train
+ * @param rec
+ * @return
+ */
+size_t train_record_encoded_max(const struct train_record* rec) {
+    return VARINT_MAX_LEN * 2 + (size_t) rec->count * VARINT_MAX_LEN * 2;
+}
+
+/**
+ * train_record_encode - encode a train as: count, first arrival, then per packet the
+ * zigzag sequence delta and the zigzag delta-of-delta of the arrival time
+ * @param rec
+ * @param out buffer of at least train_record_encoded_max() bytes
+ * @return number of bytes written
+ */
+size_t train_record_encode(const struct train_record* rec, unsigned char* out) {
+    size_t n = varint_put(out, (uint64_t) rec->count);
+    if (rec->count == 0) {
+        return n;
+    }
+    n += varint_put(out + n, (uint64_t) rec->arrival_ns[0]);
+
+    int64_t prev_seq = 0, prev_delta = 0;
+    for (int i = 0; i < rec->count; i++) {
+        n += varint_put(out + n, zigzag_encode((int64_t) rec->seq[i] - prev_seq));
+        prev_seq = rec->seq[i];
+        if (i > 0) {
+            int64_t delta = rec->arrival_ns[i] - rec->arrival_ns[i - 1];
+            n += varint_put(out + n, zigzag_encode(delta - prev_delta));
+            prev_delta = delta;
+        }
+    }
+    return n;
+}
+
+/**
+ * train_record_decode - inverse of train_record_encode, allocates the record
+ * @param in
+ * @param len
+ * @param rec
+ * @return number of bytes consumed, 0 on malformed input
+ */
+size_t train_record_decode(const unsigned char* in, size_t len, struct train_record* rec) {
+    uint64_t value;
+    size_t n = varint_get(in, len, &value);
+    if (n == 0 || value > (uint64_t) len) {
+        return 0;
+    }
+    if (train_record_init(rec, (int) value) < 0) {
+        return 0;
+    }
+    int count = (int) value;
+    if (count == 0) {
+        return n;
+    }
+
+    size_t used = varint_get(in + n, len - n, &value);
+    if (used == 0) {
+        train_record_free(rec);
+        return 0;
+    }
+    n += used;
+    int64_t arrival = (int64_t) value, prev_seq = 0, delta = 0;
+    for (int i = 0; i < count; i++) {
+        used = varint_get(in + n, len - n, &value);
+        if (used == 0) {
+            train_record_free(rec);
+            return 0;
+        }
+        n += used;
+        prev_seq += zigzag_decode(value);
+        if (i > 0) {
+            used = varint_get(in + n, len - n, &value);
+            if (used == 0) {
+                train_record_free(rec);
+                return 0;
+            }
+            n += used;
+            delta += zigzag_decode(value);
+            arrival += delta;
+        }
+        train_record_add(rec, (uint16_t) prev_seq, arrival);
+    }
+    return n;
+}
+
+/**
+ * timing_export_encode - the export stream of both trains: magic, version, train count and
+ * the encoded low and high entropy trains
+ * @param low
+ * @param high
+ * @param len output, length of the stream
+ * @return the stream, the caller frees it; NULL on allocation failure
+ */
+unsigned char* timing_export_encode(const struct train_record* low, const struct train_record* high, size_t* len) {
+    size_t max_len = 6 + train_record_encoded_max(low) + train_record_encoded_max(high);
+    unsigned char* out = (unsigned char*) malloc(max_len);
+    if (out == NULL) {
+        return NULL;
+    }
+    memcpy(out, EXPORT_MAGIC, 4);
+    out[4] = EXPORT_VERSION;
+    out[5] = EXPORT_TRAINS;
+    *len = 6;
+    *len += train_record_encode(low, out + *len);
+    *len += train_record_encode(high, out + *len);
+    return out;
+}
+
+#endif //TIMING_EXPORT_H
@@ -0,0 +1,417 @@
+//
+// Per-train arrival statistics maintained by the server's receive path.
+//
+
+#ifndef TRAIN_STATS_H
+#define TRAIN_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT 40
+#define HIST_BUCKETS ((HIST_MAX_SHIFT + 1) * HIST_SUB_COUNT)
+
+#define IPV4_UDP_OVERHEAD 28
+#define SLOWDOWN_Z 3.0
+
+#define TDIGEST_COMPRESSION 100
+#define TDIGEST_CENTROIDS (2 * TDIGEST_COMPRESSION)
+#define TDIGEST_BUFFER 512
+
+/**
+ * HDR-style log-linear histogram: values below HIST_SUB_COUNT are exact, above that
+ * every power of two is split into HIST_SUB_COUNT linear sub-buckets (~6% precision)
+ */
+struct log_histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    int64_t min;
+    int64_t max;
+};
+
+/**
+ * Merging t-digest with a fixed centroid array, incoming points are buffered and
+ * folded into the centroids whenever the buffer fills up
+ */
+struct tdigest {
+    double centroid[TDIGEST_CENTROIDS + TDIGEST_BUFFER][2]; /* mean, weight */
+    int centroids;
+    int buffered;
+    double total;
+    double min;
+    double max;
+};
+
+/**
+ * Statistics of one train: histogram of inter-arrival gaps and a quantile sketch of
+ * arrival offsets from the first packet, both in nanoseconds. Gaps between packets
+ * with consecutive sequence numbers are also kept apart as packet-pair dispersions.
+ */
+struct train_stats {
+    struct log_histogram gaps;
+    struct log_histogram pair_gaps;
+    struct tdigest offsets;
+    int64_t first_ns;
+    int64_t last_ns;
+    int64_t bytes;
+    double gap_mean;
+    double gap_m2;
+    int last_seq;
+    int received;
+};
+
+/**
+ * log_histogram_index - bucket of a value, O(1)
+ * @param value
+ * @return
+ */
+int log_histogram_index(int64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return value < 0 ? 0 : (int) value;
+    }
+    int shift = 63 - __builtin_clzll((uint64_t) value) - HIST_SUB_BITS;
+    if (shift >= HIST_MAX_SHIFT) {
+        return HIST_BUCKETS - 1;
+    }
+    return (shift + 1) * HIST_SUB_COUNT + (int) ((value >> shift) - HIST_SUB_COUNT);
+}
+
+/**
+ * log_histogram_value - representative (midpoint) value of a bucket
+ * @param index
+ * @return
+ */
+int64_t log_histogram_value(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+    int shift = index / HIST_SUB_COUNT - 1;
+    int64_t lower = (int64_t) (HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+    return lower + ((int64_t) 1 << shift) / 2;
+}
+
+void log_histogram_init(struct log_histogram* h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void log_histogram_add(struct log_histogram* h, int64_t value) {
+    h->counts[log_histogram_index(value)]++;
+    if (h->total == 0 || value < h->min) {
+        h->min = value;
+    }
+    if (h->total == 0 || value > h->max) {
+        h->max = value;
+    }
+    h->total++;
+}
+
+/**
+ * log_histogram_percentile
+ * @param h
+ * @param pct in [0, 100]
+ * @return representative value of the bucket holding the percentile, 0 when empty
+ */
+int64_t log_histogram_percentile(const struct log_histogram* h, double pct) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (pct / 100.0 * (double) h->total);
+    if (rank >= h->total) {
+        return h->max;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            int64_t value = log_histogram_value(i);
+            return value < h->min ? h->min : (value > h->max ? h->max : value);
+        }
+    }
+    return h->max;
+}
+
+void tdigest_init(struct tdigest* td) {
+    td->centroids = 0;
+    td->buffered = 0;
+    td->total = 0;
+    td->min = 0;
+    td->max = 0;
+}
+
+int tdigest_compare(const void* a, const void* b) {
+    const double* x = (const double*) a;
+    const double* y = (const double*) b;
+    return (*x > *y) - (*x < *y);
+}
+
+/**
+ * tdigest_merge - sort centroids and buffered points together and fold them using the
+ * q(1-q) size bound, in place
+ * @param td
+ */
+void tdigest_merge(struct tdigest* td) {
+    int n = td->centroids + td->buffered;
+    if (td->buffered == 0) {
+        return;
+    }
+    double (*c)[2] = td->centroid;
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        total += c[i][1];
+    }
+    qsort(c, n, sizeof(c[0]), tdigest_compare);
+
+    int out = 0;
+    double cur_mean = c[0][0], cur_weight = c[0][1], weight_so_far = 0;
+    for (int i = 1; i < n; i++) {
+        double proposed = cur_weight + c[i][1];
+        double q = (weight_so_far + proposed / 2) / total;
+        double limit = 4 * total * q * (1 - q) / TDIGEST_COMPRESSION;
+        if (proposed <= limit || proposed <= 1) {
+            cur_mean += (c[i][0] - cur_mean) * c[i][1] / proposed;
+            cur_weight = proposed;
+        } else {
+            c[out][0] = cur_mean;
+            c[out][1] = cur_weight;
+            out++;
+            weight_so_far += cur_weight;
+            cur_mean = c[i][0];
+            cur_weight = c[i][1];
+        }
+    }
+    c[out][0] = cur_mean;
+    c[out][1] = cur_weight;
+    out++;
+    /* the bound keeps the count near the compression, but never let it eat the buffer */
+    while (out > TDIGEST_CENTROIDS) {
+        int j = 0;
+        for (int i = 0; i + 1 < out; i += 2) {
+            double w = c[i][1] + c[i + 1][1];
+            c[j][0] = (c[i][0] * c[i][1] + c[i + 1][0] * c[i + 1][1]) / w;
+            c[j][1] = w;
+            j++;
+        }
+        if (out % 2 == 1) {
+            c[j][0] = c[out - 1][0];
+            c[j][1] = c[out - 1][1];
+            j++;
+        }
+        out = j;
+    }
+    td->centroids = out;
+    td->buffered = 0;
+    td->total = total;
+}
+
+/**
+ * tdigest_add - buffer a point, amortised O(1) per call
+ * @param td
+ * @param value
+ */
+void tdigest_add(struct tdigest* td, double value) {
+    if (td->centroids == 0 && td->buffered == 0) {
+        td->min = value;
+        td->max = value;
+    }
+    if (value < td->min) {
+        td->min = value;
+    }
+    if (value > td->max) {
+        td->max = value;
+    }
+    int slot = td->centroids + td->buffered;
+    td->centroid[slot][0] = value;
+    td->centroid[slot][1] = 1;
+    td->buffered++;
+    if (td->buffered == TDIGEST_BUFFER) {
+        tdigest_merge(td);
+    }
+}
+
+/**
+ * tdigest_quantile - interpolate between centroid centres
+ * @param td merged before the lookup
+ * @param q in [0, 1]
+ * @return
+ */
+double tdigest_quantile(struct tdigest* td, double q) {
+    tdigest_merge(td);
+    double (*c)[2] = td->centroid;
+    int n = td->centroids;
+    if (n == 0) {
+        return 0;
+    }
+    if (q <= 0) {
+        return td->min;
+    }
+    if (q >= 1) {
+        return td->max;
+    }
+    if (n == 1) {
+        return c[0][0];
+    }
+    double target = q * td->total;
+    double cumulative = 0;
+    for (int i = 0; i < n; i++) {
+        double center = cumulative + c[i][1] / 2;
+        if (target < center) {
+            if (i == 0) {
+                return td->min + (c[0][0] - td->min) * target / center;
+            }
+            double prev_center = cumulative - c[i - 1][1] / 2;
+            double t = (target - prev_center) / (center - prev_center);
+            return c[i - 1][0] + (c[i][0] - c[i - 1][0]) * t;
+        }
+        cumulative += c[i][1];
+    }
+    double last_center = td->total - c[n - 1][1] / 2;
+    double t = (target - last_center) / (td->total - last_center);
+    return c[n - 1][0] + (td->max - c[n - 1][0]) * t;
+}
+
+void train_stats_init(struct train_stats* st) {
+    log_histogram_init(&st->gaps);
+    log_histogram_init(&st->pair_gaps);
+    tdigest_init(&st->offsets);
+    st->first_ns = 0;
+    st->last_ns = 0;
+    st->bytes = 0;
+    st->gap_mean = 0;
+    st->gap_m2 = 0;
+    st->last_seq = -1;
+    st->received = 0;
+}
+
+/**
+ * train_stats_add - account one arrival
+ * @param st
+ * @param seq sequence number stamped by the sender
+ * @param bytes UDP payload length
+ * @param arrival_ns
+ */
+void train_stats_add(struct train_stats* st, uint16_t seq, int bytes, int64_t arrival_ns) {
+    if (st->received == 0) {
+        st->first_ns = arrival_ns;
+    } else {
+        int64_t gap = arrival_ns - st->last_ns;
+        log_histogram_add(&st->gaps, gap);
+        /* Welford running mean and variance of the gaps */
+        double delta = (double) gap - st->gap_mean;
+        st->gap_mean += delta / (double) st->gaps.total;
+        st->gap_m2 += delta * ((double) gap - st->gap_mean);
+        if (seq == (uint16_t) (st->last_seq + 1)) {
+            log_histogram_add(&st->pair_gaps, gap);
+        }
+    }
+    tdigest_add(&st->offsets, (double) (arrival_ns - st->first_ns));
+    st->last_ns = arrival_ns;
+    st->last_seq = seq;
+    st->bytes += bytes;
+    st->received++;
+}
+
+/**
+ * train_stats_capacity_bps - bottleneck capacity from the most common dispersion of
+ * back-to-back pairs, cross traffic only ever widens a pair so the mode is the bottleneck
+ * @param st
+ * @return bits per second on the wire (IP and UDP headers included), 0 when unknown
+ */
+double train_stats_capacity_bps(const struct train_stats* st) {
+    int mode = -1;
+    for (int i = 1; i < HIST_BUCKETS; i++) {
+        if (st->pair_gaps.counts[i] > 0 && (mode < 0 || st->pair_gaps.counts[i] > st->pair_gaps.counts[mode])) {
+            mode = i;
+        }
+    }
+    if (mode < 0 || st->received == 0) {
+        return 0;
+    }
+    double wire_bits = ((double) st->bytes / st->received + IPV4_UDP_OVERHEAD) * 8;
+    return wire_bits * 1e9 / (double) log_histogram_value(mode);
+}
+
+/**
+ * train_stats_goodput_bps - payload bits delivered over the span of the train
+ * @param st
+ * @return bits per second, 0 when the train is too short to tell
+ */
+double train_stats_goodput_bps(const struct train_stats* st) {
+    if (st->received < 2 || st->last_ns <= st->first_ns) {
+        return 0;
+    }
+    double first_packet = (double) st->bytes / st->received;
+    return ((double) st->bytes - first_packet) * 8 * 1e9 / (double) (st->last_ns - st->first_ns);
+}
+
+/**
+ * train_stats_line_time_ms - how long the received packets occupy the bottleneck link
+ * @param st
+ * @return milliseconds, 0 when the capacity is unknown
+ */
+double train_stats_line_time_ms(const struct train_stats* st) {
+    double capacity = train_stats_capacity_bps(st);
+    if (capacity <= 0) {
+        return 0;
+    }
+    double wire_bits = ((double) st->bytes + (double) st->received * IPV4_UDP_OVERHEAD) * 8;
+    return wire_bits / capacity * 1000;
+}
+
+/**
+ * compression_verdict - compare the mean per-packet dispersion of the two trains. Using the
+ * dispersion rather than a fixed duration difference makes the rule independent of link
+ * speed and train length, and of packet loss. The slowdown must clear the relative
+ * threshold and be SLOWDOWN_Z standard errors away from zero to count.
+ * @param low
+ * @param high
+ * @param threshold minimum relative slowdown of the high entropy train, e.g. 0.1
+ * @param slowdown output, high / low mean gap - 1
+ * @param z output, slowdown in standard errors
+ * @return 1 if compression is detected
+ */
+int compression_verdict(const struct train_stats* low, const struct train_stats* high, double threshold,
+                        double* slowdown, double* z) {
+    *slowdown = 0;
+    *z = 0;
+    if (low->gaps.total < 2 || high->gaps.total < 2 || low->gap_mean <= 0) {
+        return 0;
+    }
+    double var = low->gap_m2 / (double) (low->gaps.total - 1) / (double) low->gaps.total +
+                 high->gap_m2 / (double) (high->gaps.total - 1) / (double) high->gaps.total;
+    double diff = high->gap_mean - low->gap_mean;
+    *slowdown = diff / low->gap_mean;
+    *z = var > 0 ? diff / sqrt(var) : (diff > 0 ? INFINITY : 0);
+    return *slowdown > threshold && *z > SLOWDOWN_Z;
+}
+
+/**
+ * train_stats_format - one line summary of a train for the result message
+ * @param st
+ * @param name
+ * @param out
+ * @param len
+ * @return number of characters written, as snprintf
+ */
+int train_stats_format(struct train_stats* st, const char* name, char* out, size_t len) {
+    return snprintf(out, len,
+                    "%s: %d pkts, capacity %.1f Mbps, goodput %.1f Mbps, "
+                    "gap us p50=%.3f p90=%.3f p99=%.3f max=%.3f, "
+                    "arrival ms p10=%.1f p50=%.1f p90=%.1f p100=%.1f",
+                    name, st->received,
+                    train_stats_capacity_bps(st) / 1e6, train_stats_goodput_bps(st) / 1e6,
+                    (double) log_histogram_percentile(&st->gaps, 50) / 1e3,
+                    (double) log_histogram_percentile(&st->gaps, 90) / 1e3,
+                    (double) log_histogram_percentile(&st->gaps, 99) / 1e3,
+                    (double) st->gaps.max / 1e3,
+                    tdigest_quantile(&st->offsets, 0.1) / 1e6,
+                    tdigest_quantile(&st->offsets, 0.5) / 1e6,
+                    tdigest_quantile(&st->offsets, 0.9) / 1e6,
+                    tdigest_quantile(&st->offsets, 1.0) / 1e6);
+}
+
+#endif //TRAIN_STATS_H
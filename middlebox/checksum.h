@@ -0,0 +1,180 @@
+//
+// Internet checksum (RFC 1071) with SSE2/AVX2 paths picked at runtime.
+//
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86 1
+#endif
+
+/*
+ * The one's complement sum does not depend on byte order as long as every word is read
+ * the same way, so all paths add native-order words and only the odd trailing byte needs
+ * care: it is the first byte of a zero padded word.
+ */
+
+/**
+ * checksum_add_scalar - add a buffer to a running sum, 32 bits at a time into 64 bits
+ * @param p
+ * @param len
+ * @param sum
+ * @return
+ */
+uint64_t checksum_add_scalar(const unsigned char *p, size_t len, uint64_t sum) {
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        sum += (uint32_t) w;
+        sum += w >> 32;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, sizeof(w));
+        sum += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, sizeof(w));
+        sum += w;
+        p += 2;
+        len -= 2;
+    }
+    if (len == 1) {
+        uint16_t w = 0;
+        memcpy(&w, p, 1);
+        sum += w;
+    }
+    return sum;
+}
+
+#ifdef CHECKSUM_X86
+/* 16-bit words are widened into 32-bit lanes, each block adds at most 2 * 0xFFFF per lane */
+#define CHECKSUM_INNER_BLOCKS 16384
+
+__attribute__((target("sse2")))
+uint64_t checksum_add_sse2(const unsigned char *p, size_t len, uint64_t sum) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc64 = zero;
+    while (len >= 16) {
+        __m128i acc32 = zero;
+        for (int i = 0; i < CHECKSUM_INNER_BLOCKS && len >= 16; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i *) p);
+            acc32 = _mm_add_epi32(acc32, _mm_add_epi32(_mm_unpacklo_epi16(v, zero),
+                                                       _mm_unpackhi_epi16(v, zero)));
+            p += 16;
+            len -= 16;
+        }
+        acc64 = _mm_add_epi64(acc64, _mm_add_epi64(_mm_unpacklo_epi32(acc32, zero),
+                                                   _mm_unpackhi_epi32(acc32, zero)));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc64);
+    return checksum_add_scalar(p, len, sum + lanes[0] + lanes[1]);
+}
+
+__attribute__((target("avx2")))
+uint64_t checksum_add_avx2(const unsigned char *p, size_t len, uint64_t sum) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc64 = zero;
+    while (len >= 32) {
+        __m256i acc32 = zero;
+        for (int i = 0; i < CHECKSUM_INNER_BLOCKS && len >= 32; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) p);
+            acc32 = _mm256_add_epi32(acc32, _mm256_add_epi32(_mm256_unpacklo_epi16(v, zero),
+                                                             _mm256_unpackhi_epi16(v, zero)));
+            p += 32;
+            len -= 32;
+        }
+        acc64 = _mm256_add_epi64(acc64, _mm256_add_epi64(_mm256_unpacklo_epi32(acc32, zero),
+                                                         _mm256_unpackhi_epi32(acc32, zero)));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc64);
+    return checksum_add_sse2(p, len, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+#endif
+
+typedef uint64_t (*checksum_add_fn)(const unsigned char *, size_t, uint64_t);
+
+/**
+ * checksum_resolve - pick the widest implementation the CPU supports
+ * @return
+ */
+checksum_add_fn checksum_resolve(void) {
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return checksum_add_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return checksum_add_sse2;
+    }
+#endif
+    return checksum_add_scalar;
+}
+
+/**
+ * checksum_add - add a buffer to a running 64-bit sum. When summing a packet in several
+ * pieces, every piece but the last must have an even length.
+ * @param buf
+ * @param len
+ * @param sum
+ * @return
+ */
+uint64_t checksum_add(const void *buf, size_t len, uint64_t sum) {
+    static checksum_add_fn impl = NULL;
+    if (impl == NULL) {
+        impl = checksum_resolve();
+    }
+    return impl((const unsigned char *) buf, len, sum);
+}
+
+/**
+ * checksum_fold - fold a running sum to 16 bits and complement it
+ * @param sum
+ * @return checksum as stored in the packet
+ */
+uint16_t checksum_fold(uint64_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t) ~sum;
+}
+
+/**
+ * Checksum function
+ * @param buf
+ * @param size
+ * @return
+ */
+unsigned short checksum(const char *buf, unsigned size) {
+    return checksum_fold(checksum_add(buf, size, 0));
+}
+
+/**
+ * Incremental checksum update for one changed 16-bit word (RFC 1624, eqn. 3).
+ * All arguments are taken as stored in the packet, the sum is byte order independent.
+ * @param check current checksum
+ * @param old_word
+ * @param new_word
+ * @return updated checksum
+ */
+uint16_t checksum_update(uint16_t check, uint16_t old_word, uint16_t new_word) {
+    uint32_t sum = (uint16_t) ~check + (uint16_t) ~old_word + (uint32_t) new_word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t) ~sum;
+}
+
+#endif //CHECKSUM_H
@@ -0,0 +1,179 @@
+//
+// Bottleneck link model: rate limit, optional payload compression, loss, delay and jitter.
+//
+
+#ifndef LINK_MODEL_H
+#define LINK_MODEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <zlib.h>
+
+#define FRAME_MAX 2048
+#define QUEUE_SLOTS 8192
+
+struct link_config {
+    double rate;            /* bytes per second, 0 for unlimited */
+    int level;              /* zlib level for UDP payloads, 0 for no compression */
+    double loss;            /* drop probability */
+    double delay;           /* seconds */
+    double jitter;          /* seconds, uniform on top of the delay */
+    int queue_bytes;        /* drop tail beyond this many bytes waiting to be serialized */
+};
+
+struct link_stats {
+    unsigned long forwarded;
+    unsigned long lost;
+    unsigned long overflowed;
+    unsigned long late;         /* left over a millisecond after their departure time */
+    unsigned long bytes_in;
+    unsigned long bytes_wire;   /* after compression */
+};
+
+struct frame {
+    double depart;
+    int len;
+    char data[FRAME_MAX];
+};
+
+/**
+ * FIFO of frames waiting to leave, in departure order. The link is busy serializing
+ * until busy_until; jitter never reorders frames.
+ */
+struct link_queue {
+    struct frame* slots;
+    int head;
+    int count;
+    double busy_until;
+    double last_depart;
+};
+
+/**
+ * link_queue_init
+ * @param queue
+ */
+void link_queue_init(struct link_queue* queue) {
+    memset(queue, 0, sizeof(*queue));
+    queue->slots = (struct frame*) malloc(sizeof(struct frame) * QUEUE_SLOTS);
+    if (queue->slots == NULL) {
+        perror("Error allocating the link queue");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void link_queue_free(struct link_queue* queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+/**
+ * udp_payload_find - locate the UDP payload of an Ethernet frame
+ * @param data
+ * @param len
+ * @param payload_len output
+ * @return offset of the payload, -1 if the frame is not an unfragmented IPv4/UDP datagram
+ */
+int udp_payload_find(const char* data, int len, int* payload_len) {
+    const struct ethhdr* eth = (const struct ethhdr*) data;
+    if (len < ETH_HLEN + (int) sizeof(struct iphdr) || ntohs(eth->h_proto) != ETH_P_IP) {
+        return -1;
+    }
+    const struct iphdr* ip_h = (const struct iphdr*) (data + ETH_HLEN);
+    int offset = ETH_HLEN + ip_h->ihl * 4 + (int) sizeof(struct udphdr);
+    if (ip_h->protocol != IPPROTO_UDP || (ntohs(ip_h->frag_off) & 0x3FFF) != 0 || offset > len) {
+        return -1;
+    }
+    *payload_len = len - offset;
+    return offset;
+}
+
+/**
+ * link_wire_length - bytes a frame occupies on the bottleneck. A compressing link sends
+ * the compressed UDP payload when it is smaller and the original otherwise; the far side
+ * gets the original back, so only the time on the link changes.
+ * @param cf
+ * @param data
+ * @param len
+ * @return
+ */
+int link_wire_length(const struct link_config* cf, const char* data, int len) {
+    int payload_len;
+    int offset = udp_payload_find(data, len, &payload_len);
+    if (cf->level <= 0 || offset < 0 || payload_len == 0) {
+        return len;
+    }
+    Bytef out[FRAME_MAX + 64];
+    uLongf out_len = sizeof(out);
+    if (compress2(out, &out_len, (const Bytef*) data + offset, payload_len, cf->level) != Z_OK ||
+        (int) out_len >= payload_len) {
+        return len;
+    }
+    return offset + (int) out_len;
+}
+
+/**
+ * link_enqueue - put a frame on the link, or drop it for loss or a full queue
+ * @param queue
+ * @param cf
+ * @param stats
+ * @param data
+ * @param len at most FRAME_MAX
+ * @param now CLOCK_MONOTONIC seconds
+ * @return 0 if queued, -1 if dropped
+ */
+int link_enqueue(struct link_queue* queue, const struct link_config* cf, struct link_stats* stats,
+                 const char* data, int len, double now) {
+    stats->bytes_in += len;
+    if (cf->loss > 0 && (double) rand() / RAND_MAX < cf->loss) {
+        stats->lost++;
+        return -1;
+    }
+    int wire_len = link_wire_length(cf, data, len);
+    double backlog = queue->busy_until > now ? (queue->busy_until - now) * cf->rate : 0;
+    if (queue->count == QUEUE_SLOTS || (cf->queue_bytes > 0 && backlog + wire_len > cf->queue_bytes)) {
+        stats->overflowed++;
+        return -1;
+    }
+    struct frame* f = &queue->slots[(queue->head + queue->count) % QUEUE_SLOTS];
+    memcpy(f->data, data, len);
+    f->len = len;
+
+    double start = queue->busy_until > now ? queue->busy_until : now;
+    queue->busy_until = cf->rate > 0 ? start + wire_len / cf->rate : start;
+    f->depart = queue->busy_until + cf->delay;
+    if (cf->jitter > 0) {
+        f->depart += cf->jitter * rand() / RAND_MAX;
+    }
+    if (f->depart < queue->last_depart) {
+        f->depart = queue->last_depart;
+    }
+    queue->last_depart = f->depart;
+    queue->count++;
+    stats->bytes_wire += wire_len;
+    return 0;
+}
+
+/**
+ * link_peek - the next frame to leave
+ * @param queue
+ * @return NULL if the queue is empty
+ */
+struct frame* link_peek(struct link_queue* queue) {
+    return queue->count == 0 ? NULL : &queue->slots[queue->head];
+}
+
+/**
+ * link_dequeue - remove the frame returned by link_peek
+ * @param queue
+ */
+void link_dequeue(struct link_queue* queue) {
+    queue->head = (queue->head + 1) % QUEUE_SLOTS;
+    queue->count--;
+}
+
+#endif //LINK_MODEL_H
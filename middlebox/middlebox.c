@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "checksum.h"
+#include "link_model.h"
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+#define PORT_RCVBUF (32 * 1024 * 1024)
+#define RECV_BATCH 32
+
+/*
+ * Transparent bridge between two interfaces that emulates a compressing bottleneck in the
+ * upstream direction: every frame arriving on the first interface goes through the link
+ * model before it leaves on the second, frames coming back are forwarded at once.
+ */
+
+volatile sig_atomic_t stop = 0;
+
+void set_stop_flag(int signal) {
+    (void) signal;
+    stop = 1;
+}
+
+struct port {
+    int fd;
+    int ifindex;
+    const char* name;
+};
+
+/**
+ * monotonic_now
+ * @return seconds on CLOCK_MONOTONIC
+ */
+double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Open a promiscuous packet socket on an interface that sees every frame the interface
+ * receives but not the ones sent through it
+ * @param name
+ * @param port output
+ */
+void port_open(const char* name, struct port* port) {
+    port->name = name;
+    port->ifindex = (int) if_nametoindex(name);
+    if (port->ifindex == 0) {
+        perror("Error finding interface");
+        exit(EXIT_FAILURE);
+    }
+    port->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (port->fd < 0) {
+        perror("Error creating packet socket");
+        exit(EXIT_FAILURE);
+    }
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = port->ifindex;
+    if (bind(port->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror("Error binding packet socket");
+        exit(EXIT_FAILURE);
+    }
+    struct packet_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = port->ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("Error setting promiscuous mode");
+        exit(EXIT_FAILURE);
+    }
+    int on = 1;
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_AUXDATA, &on, sizeof(on)) < 0) {
+        perror("Error enabling packet auxdata");
+        exit(EXIT_FAILURE);
+    }
+    /* older kernels lack it, port_recv also skips outgoing frames */
+    setsockopt(port->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+    if (setsockopt(port->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        perror("Error enabling receive timestamps");
+        exit(EXIT_FAILURE);
+    }
+    /* a whole train arrives back to back, faster than it is let out */
+    int rcvbuf = PORT_RCVBUF;
+    if (setsockopt(port->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        setsockopt(port->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+}
+
+/**
+ * Fill in the TCP or UDP checksum of an IPv4 frame the sender left to offload
+ * @param data
+ * @param len
+ */
+void l4_checksum_complete(char* data, int len) {
+    if (len < ETH_HLEN + (int) sizeof(struct iphdr) || ntohs(((struct ethhdr*) data)->h_proto) != ETH_P_IP) {
+        return;
+    }
+    struct iphdr* ip_h = (struct iphdr*) (data + ETH_HLEN);
+    int ip_len = ntohs(ip_h->tot_len);
+    int l4_len = ip_len - ip_h->ihl * 4;
+    char* l4 = data + ETH_HLEN + ip_h->ihl * 4;
+    if (ETH_HLEN + ip_len > len || l4_len <= 0) {
+        return;
+    }
+    uint16_t* check;
+    if (ip_h->protocol == IPPROTO_TCP && l4_len >= (int) sizeof(struct tcphdr)) {
+        check = &((struct tcphdr*) l4)->check;
+    } else if (ip_h->protocol == IPPROTO_UDP && l4_len >= (int) sizeof(struct udphdr)) {
+        check = &((struct udphdr*) l4)->check;
+    } else {
+        return;
+    }
+    struct {
+        uint32_t saddr;
+        uint32_t daddr;
+        uint8_t zero;
+        uint8_t protocol;
+        uint16_t len;
+    } __attribute__((packed)) pseudo = {ip_h->saddr, ip_h->daddr, 0, ip_h->protocol, htons(l4_len)};
+    *check = 0;
+    uint64_t sum = checksum_add(&pseudo, sizeof(pseudo), 0);
+    *check = checksum_fold(checksum_add(l4, l4_len, sum));
+    if (*check == 0 && ip_h->protocol == IPPROTO_UDP) {
+        *check = 0xFFFF;
+    }
+}
+
+/**
+ * Receive one frame without blocking, completing checksums left to offload. The arrival
+ * time is the kernel's, so time spent compressing earlier frames does not shift it.
+ * @param port
+ * @param buf
+ * @param len
+ * @param arrival output, CLOCK_MONOTONIC seconds
+ * @return frame length, 0 for a frame to skip, -1 when nothing is pending
+ */
+int port_recv(struct port* port, char* buf, int len, double* arrival) {
+    char control[CMSG_SPACE(sizeof(struct tpacket_auxdata)) + CMSG_SPACE(sizeof(struct timespec))];
+    struct sockaddr_ll from;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int n = (int) recvmsg(port->fd, &msg, MSG_DONTWAIT | MSG_TRUNC);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return -1;
+        }
+        perror("Error receiving frame");
+        exit(EXIT_FAILURE);
+    }
+    if (from.sll_pkttype == PACKET_OUTGOING || n > len) {
+        return 0;
+    }
+    *arrival = monotonic_now();
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_AUXDATA) {
+            struct tpacket_auxdata aux;
+            memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+            if (aux.tp_status & TP_STATUS_CSUMNOTREADY) {
+                l4_checksum_complete(buf, n);
+            }
+        } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS) {
+            struct timespec stamp, real;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            clock_gettime(CLOCK_REALTIME, &real);
+            double age = (double) (real.tv_sec - stamp.tv_sec) + (double) (real.tv_nsec - stamp.tv_nsec) / 1e9;
+            if (age > 0) {
+                *arrival -= age;
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * Send one frame out of a port
+ * @param port
+ * @param data
+ * @param len
+ */
+void port_send(struct port* port, const char* data, int len) {
+    if (send(port->fd, data, len, 0) < 0 && errno != ENOBUFS && errno != EAGAIN) {
+        perror("Error sending frame");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s -a upstream_if -b downstream_if [-r mbps] [-z zlib_level] [-l loss] "
+                    "[-d delay_ms] [-j jitter_ms] [-q queue_kb]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * main
+ * @param argc
+ * @param argv
+ * @return
+ */
+int main(int argc, char *argv[]) {
+    const char* upstream = NULL;
+    const char* downstream = NULL;
+    struct link_config cf;
+    memset(&cf, 0, sizeof(cf));
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:r:z:l:d:j:q:")) != -1) {
+        switch (opt) {
+            case 'a': upstream = optarg; break;
+            case 'b': downstream = optarg; break;
+            case 'r': cf.rate = strtod(optarg, NULL) * 1e6 / 8; break;
+            case 'z': cf.level = (int) strtol(optarg, NULL, 10); break;
+            case 'l': cf.loss = strtod(optarg, NULL); break;
+            case 'd': cf.delay = strtod(optarg, NULL) / 1000; break;
+            case 'j': cf.jitter = strtod(optarg, NULL) / 1000; break;
+            case 'q': cf.queue_bytes = (int) strtol(optarg, NULL, 10) * 1024; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (upstream == NULL || downstream == NULL || cf.level < 0 || cf.level > 9) {
+        usage(argv[0]);
+    }
+    srand(time(NULL));
+
+    struct port a, b;
+    port_open(upstream, &a);
+    port_open(downstream, &b);
+    struct link_queue queue;
+    link_queue_init(&queue);
+    struct link_stats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    signal(SIGINT, set_stop_flag);
+    signal(SIGTERM, set_stop_flag);
+    printf("Forwarding %s -> %s at %.1f Mbps, compression level %d, loss %.3f, delay %.1f ms, jitter %.1f ms\n",
+           a.name, b.name, cf.rate * 8 / 1e6, cf.level, cf.loss, cf.delay * 1000, cf.jitter * 1000);
+
+    char buf[FRAME_MAX];
+    struct pollfd fds[2] = {{a.fd, POLLIN, 0}, {b.fd, POLLIN, 0}};
+    while (!stop) {
+        struct frame* next = link_peek(&queue);
+        struct timespec timeout = {1, 0};
+        if (next != NULL) {
+            double wait = next->depart - monotonic_now();
+            wait = wait > 0 ? wait : 0;
+            timeout.tv_sec = (time_t) wait;
+            timeout.tv_nsec = (long) ((wait - (double) timeout.tv_sec) * 1e9);
+        }
+        if (ppoll(fds, 2, &timeout, NULL) < 0 && errno != EINTR) {
+            perror("Error polling");
+            exit(EXIT_FAILURE);
+        }
+
+        /* replies first, they time the markers; then a bounded batch of the upstream */
+        int n;
+        double arrival;
+        while ((n = port_recv(&b, buf, sizeof(buf), &arrival)) >= 0) {
+            if (n > 0) {
+                port_send(&a, buf, n);
+            }
+        }
+        for (int i = 0; i < RECV_BATCH && (n = port_recv(&a, buf, sizeof(buf), &arrival)) >= 0; i++) {
+            if (n > 0) {
+                link_enqueue(&queue, &cf, &stats, buf, n, arrival);
+            }
+        }
+        double now = monotonic_now();
+        while ((next = link_peek(&queue)) != NULL && next->depart <= now) {
+            stats.late += now - next->depart > 1e-3;
+            port_send(&b, next->data, next->len);
+            link_dequeue(&queue);
+            stats.forwarded++;
+        }
+    }
+
+    printf("Forwarded %lu frames, lost %lu, queue drops %lu, late %lu\n", stats.forwarded, stats.lost,
+           stats.overflowed, stats.late);
+    if (stats.late > 0) {
+        printf("Late frames mean the emulator could not keep up, lower the rate or give it a core of its own\n");
+    }
+    printf("Bytes in %lu, on the link %lu (%.1f%%)\n", stats.bytes_in, stats.bytes_wire,
+           stats.bytes_in > 0 ? 100.0 * (double) stats.bytes_wire / (double) stats.bytes_in : 0);
+    link_queue_free(&queue);
+    close(a.fd);
+    close(b.fd);
+    return 0;
+}
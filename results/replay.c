@@ -0,0 +1,689 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "../client_server/timing_export.h"
+#include "../client_server/train_stats.h"
+#include "../client_server/results_log.h"
+#include "../client_server/mono_clock.h"
+
+/*
+ * Offline replay of recorded runs through the server's analysis: sequence tracking, train
+ * durations, per-train statistics and the compression test, for any number of thresholds in
+ * one pass. Runs come from results logs written with compdetect_server -r -p, from the CSV the
+ * client writes to export_file, or from a pcap or pcapng capture of the probe port.
+ */
+
+#define MAX_THRESHOLDS 16
+
+#define PCAP_MAGIC_US 0xa1b2c3d4u
+#define PCAP_MAGIC_NS 0xa1b23c4du
+#define DLT_EN10MB 1
+#define DLT_RAW 101
+#define DLT_LINUX_SLL 113
+#define DLT_LINUX_SLL2 276
+#define PCAPNG_SHB 0x0A0D0D0Au
+#define PCAPNG_IDB 1u
+#define PCAPNG_EPB 6u
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4Du
+#define PCAPNG_MAX_INTERFACES 16
+
+struct replay_options {
+    double thresholds[MAX_THRESHOLDS];
+    int threshold_count;
+    in_addr_t address;          /* INADDR_NONE for all */
+    int port;                   /* probe port in captures */
+    int payload_size;           /* for CSV exports, which carry no sizes */
+    double split_gap;           /* seconds of silence that end a burst in a capture */
+    double inter_train;         /* minimum gap between the low and the high train of a run */
+};
+
+/**
+ * What the replay of one run found, next to what was logged for it
+ */
+struct replay_result {
+    int received[2];
+    int duplicates[2];
+    int reordered[2];
+    double interval[2];         /* first to last arrival, seconds; -1 with fewer than two */
+    double slowdown;
+    double z;
+    int verdict[MAX_THRESHOLDS];
+};
+
+struct replay_totals {
+    long runs;
+    long skipped;               /* logged results without timings, unpaired bursts */
+    long compressed[MAX_THRESHOLDS];
+    long changed[MAX_THRESHOLDS];
+    long compared;
+};
+
+static struct train_stats replay_stats[2];
+static uint8_t replay_seen[65536 / 8];
+
+/**
+ * replay_analyse - run both trains through the receive path's accounting and the verdict
+ * @param opts
+ * @param train low and high entropy arrivals, in arrival order
+ * @param bytes UDP payload length of each train's packets
+ * @param r output
+ */
+void replay_analyse(const struct replay_options* opts, const struct train_record* train[2], const int bytes[2],
+                    struct replay_result* r) {
+    for (int t = 0; t < 2; t++) {
+        struct train_stats* st = &replay_stats[t];
+        train_stats_init(st);
+        memset(replay_seen, 0, sizeof(replay_seen));
+        r->duplicates[t] = 0;
+        r->reordered[t] = 0;
+        uint16_t highest = 0;
+        for (int i = 0; i < train[t]->count; i++) {
+            uint16_t seq = train[t]->seq[i];
+            if (replay_seen[seq >> 3] & (1 << (seq & 7))) {
+                r->duplicates[t]++;
+            }
+            replay_seen[seq >> 3] |= (uint8_t) (1 << (seq & 7));
+            /* sequence numbers wrap at 16 bits, so compare by distance */
+            if (i > 0 && (int16_t) (seq - highest) < 0) {
+                r->reordered[t]++;
+            } else {
+                highest = seq;
+            }
+            train_stats_add(st, seq, bytes[t], train[t]->arrival_ns[i]);
+        }
+        r->received[t] = st->received;
+        r->interval[t] = st->received > 1 ? (st->last_ns - st->first_ns) / 1e9 : -1;
+    }
+    for (int i = 0; i < opts->threshold_count; i++) {
+        r->verdict[i] = compression_verdict(&replay_stats[0], &replay_stats[1], opts->thresholds[i],
+                                            &r->slowdown, &r->z);
+    }
+}
+
+/**
+ * replay_report - print a replayed run as a CSV row and count it
+ * @param opts
+ * @param totals
+ * @param input file the run came from
+ * @param time when the run was logged or captured, may be empty
+ * @param target
+ * @param logged RESULT_* of the original run, -1 if unknown
+ * @param r
+ */
+void replay_report(const struct replay_options* opts, struct replay_totals* totals, const char* input,
+                   const char* time, uint32_t target, int logged, const struct replay_result* r) {
+    static const char* logged_names[] = {"none", "compression", "failed"};
+    char address[INET_ADDRSTRLEN] = "";
+    if (target != 0) {
+        inet_ntop(AF_INET, &target, address, sizeof(address));
+    }
+    printf("%s,%s,%s,%d,%d,%d,%d,%d,%d,%.6f,%.6f,%.4f,%.2f,%s", input, time, address,
+           r->received[0], r->received[1], r->duplicates[0], r->duplicates[1], r->reordered[0], r->reordered[1],
+           r->interval[0], r->interval[1], r->slowdown, r->z,
+           logged >= 0 && logged <= RESULT_FAILED ? logged_names[logged] : "");
+    int compare = logged == RESULT_NONE || logged == RESULT_COMPRESSION;
+    for (int i = 0; i < opts->threshold_count; i++) {
+        printf(",%s", r->verdict[i] ? "compression" : "none");
+        totals->compressed[i] += r->verdict[i];
+        if (compare && r->verdict[i] != (logged == RESULT_COMPRESSION)) {
+            totals->changed[i]++;
+        }
+    }
+    printf("\n");
+    totals->compared += compare;
+    totals->runs++;
+}
+
+/**
+ * replay_log - replay every result of a log that was logged with its packet timings
+ * @param opts
+ * @param totals
+ * @param path
+ * @return 0 on success, -1 if the log could not be read
+ */
+int replay_log(const struct replay_options* opts, struct replay_totals* totals, const char* path) {
+    struct results_reader reader;
+    if (results_reader_open(&reader, path) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < reader.count; i++) {
+        struct result_summary summary;
+        const unsigned char* data;
+        if (opts->address != INADDR_NONE && reader.index[i].target != opts->address) {
+            continue;
+        }
+        size_t len = reader.index[i].timings_len;
+        if (results_reader_get(&reader, i, &summary, &data) < 0 || len < 6 ||
+            memcmp(data, EXPORT_MAGIC, 4) != 0 || data[4] != EXPORT_VERSION || data[5] != EXPORT_TRAINS) {
+            totals->skipped++;
+            continue;
+        }
+        struct train_record rec[2];
+        size_t used = train_record_decode(data + 6, len - 6, &rec[0]);
+        if (used == 0) {
+            totals->skipped++;
+            continue;
+        }
+        if (train_record_decode(data + 6 + used, len - 6 - used, &rec[1]) == 0) {
+            train_record_free(&rec[0]);
+            totals->skipped++;
+            continue;
+        }
+        const struct train_record* train[2] = {&rec[0], &rec[1]};
+        int bytes[2] = {summary.payload_size, summary.payload_size};
+        struct replay_result r;
+        replay_analyse(opts, train, bytes, &r);
+        char time[40];
+        results_format_time(summary.time_ns, time, sizeof(time));
+        replay_report(opts, totals, path, time, summary.target, summary.verdict, &r);
+        train_record_free(&rec[0]);
+        train_record_free(&rec[1]);
+    }
+    results_reader_close(&reader);
+    return 0;
+}
+
+/**
+ * replay_csv - replay a client export (train,seq,arrival_ns)
+ * @param opts
+ * @param totals
+ * @param file positioned at the start
+ * @param path
+ * @return 0 on success, -1 on a malformed file
+ */
+int replay_csv(const struct replay_options* opts, struct replay_totals* totals, FILE* file, const char* path) {
+    char line[128];
+    int lines = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lines++;
+    }
+    rewind(file);
+    struct train_record rec[2];
+    if (train_record_init(&rec[0], lines) < 0 || train_record_init(&rec[1], lines) < 0) {
+        return -1;
+    }
+    int rc = 0;
+    if (fgets(line, sizeof(line), file) == NULL || strncmp(line, "train,seq,arrival_ns", 20) != 0) {
+        rc = -1;
+    }
+    while (rc == 0 && fgets(line, sizeof(line), file) != NULL) {
+        char name[8];
+        unsigned int seq;
+        long long arrival;
+        if (sscanf(line, "%7[^,],%u,%lld", name, &seq, &arrival) != 3) {
+            rc = -1;
+        } else {
+            train_record_add(&rec[strcmp(name, "high") == 0], (uint16_t) seq, arrival);
+        }
+    }
+    if (rc == 0) {
+        const struct train_record* train[2] = {&rec[0], &rec[1]};
+        int bytes[2] = {opts->payload_size, opts->payload_size};
+        struct replay_result r;
+        replay_analyse(opts, train, bytes, &r);
+        replay_report(opts, totals, path, "", 0, -1, &r);
+    }
+    train_record_free(&rec[0]);
+    train_record_free(&rec[1]);
+    return rc;
+}
+
+/**
+ * A probe packet found in a capture
+ */
+struct capture_packet {
+    uint32_t src;
+    uint32_t order;             /* position in the capture, keeps the sort stable */
+    int64_t arrival_ns;
+    uint16_t seq;
+    uint16_t bytes;
+};
+
+int capture_packet_compare(const void* a, const void* b) {
+    const struct capture_packet* x = (const struct capture_packet*) a;
+    const struct capture_packet* y = (const struct capture_packet*) b;
+    if (x->src != y->src) {
+        return x->src < y->src ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+/**
+ * capture_udp_probe - pick a probe out of a captured frame
+ * @param opts
+ * @param linktype
+ * @param frame
+ * @param len captured length
+ * @param pkt output, src, seq and bytes are filled in
+ * @return 1 for a probe to the probe port, 0 otherwise
+ */
+int capture_udp_probe(const struct replay_options* opts, uint32_t linktype, const unsigned char* frame, size_t len,
+                      struct capture_packet* pkt) {
+    size_t offset;
+    uint16_t proto;
+    switch (linktype) {
+        case DLT_EN10MB:
+            if (len < 14) return 0;
+            offset = 14;
+            proto = (uint16_t) (frame[12] << 8 | frame[13]);
+            if (proto == 0x8100 && len >= 18) {
+                proto = (uint16_t) (frame[16] << 8 | frame[17]);
+                offset = 18;
+            }
+            break;
+        case DLT_RAW:
+            offset = 0;
+            proto = 0x0800;
+            break;
+        case DLT_LINUX_SLL:
+            if (len < 16) return 0;
+            offset = 16;
+            proto = (uint16_t) (frame[14] << 8 | frame[15]);
+            break;
+        case DLT_LINUX_SLL2:
+            if (len < 20) return 0;
+            offset = 20;
+            proto = (uint16_t) (frame[0] << 8 | frame[1]);
+            break;
+        default:
+            return 0;
+    }
+    if (proto != 0x0800 || len < offset + 20 || (frame[offset] >> 4) != 4) {
+        return 0;
+    }
+    const unsigned char* ip = frame + offset;
+    size_t ihl = (size_t) (ip[0] & 0x0f) * 4;
+    /* only first fragments carry the UDP header */
+    if (ip[9] != IPPROTO_UDP || (((ip[6] << 8) | ip[7]) & 0x1fff) != 0 || len < offset + ihl + 8 + 2) {
+        return 0;
+    }
+    const unsigned char* udp = ip + ihl;
+    if (((udp[2] << 8) | udp[3]) != opts->port || ((udp[4] << 8) | udp[5]) < 10) {
+        return 0;
+    }
+    memcpy(&pkt->src, ip + 12, 4);
+    pkt->bytes = (uint16_t) (((udp[4] << 8) | udp[5]) - 8);
+    pkt->seq = (uint16_t) (udp[8] << 8 | udp[9]);
+    return 1;
+}
+
+/**
+ * replay_bursts - pair up the bursts of one source into runs and replay them. A run is a burst
+ * followed by another at least inter_train later; a calibration burst is followed by its low
+ * entropy train much sooner, so it stays unpaired.
+ * @param opts
+ * @param totals
+ * @param path
+ * @param pkts packets of one source in capture order
+ * @param count
+ */
+void replay_bursts(const struct replay_options* opts, struct replay_totals* totals, const char* path,
+                   const struct capture_packet* pkts, size_t count) {
+    int64_t split_ns = (int64_t) (opts->split_gap * 1e9), inter_ns = (int64_t) (opts->inter_train * 1e9);
+    size_t start[2], end[2];
+    size_t burst = 0, have = 0;
+    while (burst < count) {
+        size_t next = burst + 1;
+        while (next < count && pkts[next].arrival_ns - pkts[next - 1].arrival_ns <= split_ns) {
+            next++;
+        }
+        if (have == 1 && pkts[burst].arrival_ns - pkts[end[0] - 1].arrival_ns < inter_ns) {
+            totals->skipped++;      /* the previous burst was not a low entropy train */
+            have = 0;
+        }
+        start[have] = burst;
+        end[have] = next;
+        have++;
+        burst = next;
+        if (have < 2) {
+            continue;
+        }
+        struct train_record rec[2];
+        for (int t = 0; t < 2; t++) {
+            train_record_init(&rec[t], (int) (end[t] - start[t]));
+            for (size_t i = start[t]; i < end[t]; i++) {
+                train_record_add(&rec[t], pkts[i].seq, pkts[i].arrival_ns);
+            }
+        }
+        const struct train_record* train[2] = {&rec[0], &rec[1]};
+        int bytes[2] = {pkts[start[0]].bytes, pkts[start[1]].bytes};
+        struct replay_result r;
+        replay_analyse(opts, train, bytes, &r);
+        char time[40];
+        results_format_time(pkts[start[0]].arrival_ns, time, sizeof(time));
+        replay_report(opts, totals, path, time, pkts[start[0]].src, -1, &r);
+        train_record_free(&rec[0]);
+        train_record_free(&rec[1]);
+        have = 0;
+    }
+    totals->skipped += have;
+}
+
+/**
+ * Probe packets collected from a capture
+ */
+struct capture_list {
+    struct capture_packet* pkts;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * capture_list_add - keep a captured frame if it is a probe
+ * @param opts
+ * @param list
+ * @param linktype
+ * @param frame
+ * @param len captured length
+ * @param arrival_ns
+ * @return 0 on success, -1 on allocation failure
+ */
+int capture_list_add(const struct replay_options* opts, struct capture_list* list, uint32_t linktype,
+                     const unsigned char* frame, size_t len, int64_t arrival_ns) {
+    struct capture_packet pkt;
+    if (!capture_udp_probe(opts, linktype, frame, len, &pkt) ||
+        (opts->address != INADDR_NONE && pkt.src != opts->address)) {
+        return 0;
+    }
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+        struct capture_packet* grown = (struct capture_packet*) realloc(list->pkts, capacity * sizeof(pkt));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->pkts = grown;
+        list->capacity = capacity;
+    }
+    pkt.order = (uint32_t) list->count;
+    pkt.arrival_ns = arrival_ns;
+    list->pkts[list->count++] = pkt;
+    return 0;
+}
+
+/**
+ * replay_sources - replay the runs of every source in a capture
+ * @param opts
+ * @param totals
+ * @param path
+ * @param list
+ */
+void replay_sources(const struct replay_options* opts, struct replay_totals* totals, const char* path,
+                    struct capture_list* list) {
+    qsort(list->pkts, list->count, sizeof(*list->pkts), capture_packet_compare);
+    for (size_t first = 0, last; first < list->count; first = last) {
+        for (last = first + 1; last < list->count && list->pkts[last].src == list->pkts[first].src; last++) {
+        }
+        replay_bursts(opts, totals, path, list->pkts + first, last - first);
+    }
+}
+
+/**
+ * pcap_read - collect the probes of a pcap capture
+ * @param opts
+ * @param list
+ * @param data the mapped file
+ * @param len
+ * @return 0 on success, -1 on allocation failure
+ */
+int pcap_read(const struct replay_options* opts, struct capture_list* list, const unsigned char* data, size_t len) {
+    uint32_t magic;
+    memcpy(&magic, data, 4);
+    int swapped = magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+    int nanos = magic == PCAP_MAGIC_NS || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+    uint32_t linktype;
+    memcpy(&linktype, data + 20, 4);
+    if (swapped) {
+        linktype = __builtin_bswap32(linktype);
+    }
+    linktype &= 0x0fffffff;
+
+    size_t offset = 24;
+    while (offset + 16 <= len) {
+        uint32_t hdr[4];
+        memcpy(hdr, data + offset, 16);
+        if (swapped) {
+            for (int i = 0; i < 4; i++) {
+                hdr[i] = __builtin_bswap32(hdr[i]);
+            }
+        }
+        offset += 16;
+        if (hdr[2] > len - offset) {
+            break;      /* cut off mid packet */
+        }
+        int64_t arrival_ns = (int64_t) hdr[0] * 1000000000 + (nanos ? hdr[1] : (int64_t) hdr[1] * 1000);
+        if (capture_list_add(opts, list, linktype, data + offset, hdr[2], arrival_ns) < 0) {
+            return -1;
+        }
+        offset += hdr[2];
+    }
+    return 0;
+}
+
+/**
+ * pcapng_read - collect the probes of a pcapng capture, as written by capture.h or by tcpdump
+ * and Wireshark: enhanced packet blocks on any number of interfaces, each with its own link
+ * type and timestamp resolution
+ * @param opts
+ * @param list
+ * @param data the mapped file
+ * @param len
+ * @return 0 on success, -1 on allocation failure
+ */
+int pcapng_read(const struct replay_options* opts, struct capture_list* list, const unsigned char* data,
+                size_t len) {
+    uint32_t linktype[PCAPNG_MAX_INTERFACES];
+    uint64_t units[PCAPNG_MAX_INTERFACES];     /* timestamp ticks per second */
+    int interfaces = 0, swapped = 0;
+    size_t offset = 0;
+    while (offset + 12 <= len) {
+        uint32_t type, block_len;
+        memcpy(&type, data + offset, 4);
+        memcpy(&block_len, data + offset + 4, 4);
+        if (type == PCAPNG_SHB) {
+            uint32_t order;
+            memcpy(&order, data + offset + 8, 4);
+            swapped = order != PCAPNG_BYTE_ORDER;
+            interfaces = 0;     /* a new section starts its own interface numbering */
+        }
+        if (swapped) {
+            type = __builtin_bswap32(type);
+            block_len = __builtin_bswap32(block_len);
+        }
+        if (block_len < 12 || block_len % 4 != 0 || block_len > len - offset) {
+            break;
+        }
+        const unsigned char* body = data + offset + 8;
+        size_t body_len = block_len - 12;
+        if (type == PCAPNG_IDB && body_len >= 8 && interfaces < PCAPNG_MAX_INTERFACES) {
+            uint16_t link;
+            memcpy(&link, body, 2);
+            linktype[interfaces] = swapped ? __builtin_bswap16(link) : link;
+            units[interfaces] = 1000000;
+            for (size_t o = 8; o + 4 <= body_len;) {
+                uint16_t code, opt_len;
+                memcpy(&code, body + o, 2);
+                memcpy(&opt_len, body + o + 2, 2);
+                if (swapped) {
+                    code = __builtin_bswap16(code);
+                    opt_len = __builtin_bswap16(opt_len);
+                }
+                if (code == 0 || o + 4 + opt_len > body_len) {
+                    break;
+                }
+                if (code == 9 && opt_len >= 1) {
+                    uint8_t resol = body[o + 4];
+                    units[interfaces] = 1;
+                    for (int i = 0; i < (resol & 0x7f) && units[interfaces] < UINT64_MAX / 10; i++) {
+                        units[interfaces] *= resol & 0x80 ? 2 : 10;
+                    }
+                }
+                o += 4 + (opt_len + 3u) / 4 * 4;
+            }
+            interfaces++;
+        } else if (type == PCAPNG_EPB && body_len >= 20) {
+            uint32_t fields[5];     /* interface, timestamp high and low, captured and original length */
+            memcpy(fields, body, sizeof(fields));
+            if (swapped) {
+                for (int i = 0; i < 5; i++) {
+                    fields[i] = __builtin_bswap32(fields[i]);
+                }
+            }
+            if (fields[0] < (uint32_t) interfaces && fields[3] <= body_len - 20) {
+                uint64_t ts = (uint64_t) fields[1] << 32 | fields[2];
+                uint64_t unit = units[fields[0]];
+                /* the fraction goes through a double, ts % unit * 1e9 overflows for fine resolutions */
+                int64_t arrival_ns = (int64_t) (ts / unit * 1000000000) +
+                                     (int64_t) ((double) (ts % unit) * 1e9 / (double) unit);
+                if (capture_list_add(opts, list, linktype[fields[0]], body + 20, fields[3], arrival_ns) < 0) {
+                    return -1;
+                }
+            }
+        }
+        offset += block_len;
+    }
+    return 0;
+}
+
+/**
+ * replay_capture - replay every run of every source in a pcap or pcapng capture
+ * @param opts
+ * @param totals
+ * @param data the mapped file
+ * @param len
+ * @param path
+ * @return 0 on success, -1 on failure
+ */
+int replay_capture(const struct replay_options* opts, struct replay_totals* totals, const unsigned char* data,
+                   size_t len, const char* path) {
+    struct capture_list list = {NULL, 0, 0};
+    uint32_t magic;
+    memcpy(&magic, data, 4);
+    int rc = magic == PCAPNG_SHB ? pcapng_read(opts, &list, data, len) : pcap_read(opts, &list, data, len);
+    if (rc == 0) {
+        replay_sources(opts, totals, path, &list);
+    }
+    free(list.pkts);
+    return rc;
+}
+
+/**
+ * replay_file - replay a results log, a client export or a pcap capture, told apart by content
+ * @param opts
+ * @param totals
+ * @param path
+ * @return 0 on success, -1 on failure
+ */
+int replay_file(const struct replay_options* opts, struct replay_totals* totals, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    unsigned char head[4] = {0};
+    size_t n = fread(head, 1, sizeof(head), file);
+    rewind(file);
+    uint32_t magic;
+    memcpy(&magic, head, 4);
+    int rc;
+    if (n == 4 && memcmp(head, RESULTS_MAGIC, 4) == 0) {
+        rc = replay_log(opts, totals, path);
+    } else if (n == 4 && (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS || magic == PCAPNG_SHB ||
+                          magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS))) {
+        struct stat st;
+        rc = -1;
+        if (fstat(fileno(file), &st) == 0 && st.st_size >= 24) {
+            void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            if (data != MAP_FAILED) {
+                rc = replay_capture(opts, totals, (const unsigned char*) data, (size_t) st.st_size, path);
+                munmap(data, (size_t) st.st_size);
+            }
+        }
+    } else {
+        rc = replay_csv(opts, totals, file, path);
+    }
+    fclose(file);
+    return rc;
+}
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-T threshold[,threshold...]] [-a address] [-u probe_port] [-b payload_size] "
+                    "[-g burst_gap_sec] [-i inter_train_sec] input...\n"
+                    "Inputs are results logs, export_file CSVs or pcap/pcapng captures\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * main
+ * @param argc
+ * @param argv
+ * @return
+ */
+int main(int argc, char** argv) {
+    struct replay_options opts = {{0.1}, 1, INADDR_NONE, 8765, 1000, 0.5, 5};
+    int opt;
+    while ((opt = getopt(argc, argv, "T:a:u:b:g:i:")) != -1) {
+        switch (opt) {
+            case 'T': {
+                opts.threshold_count = 0;
+                char* end = optarg;
+                do {
+                    if (opts.threshold_count == MAX_THRESHOLDS) usage(argv[0]);
+                    char* start = end + (*end == ',');
+                    opts.thresholds[opts.threshold_count++] = strtod(start, &end);
+                    if (end == start) usage(argv[0]);
+                } while (*end == ',');
+                if (*end != '\0') usage(argv[0]);
+                break;
+            }
+            case 'a':
+                opts.address = inet_addr(optarg);
+                if (opts.address == INADDR_NONE) usage(argv[0]);
+                break;
+            case 'u': opts.port = (int) strtol(optarg, NULL, 10); break;
+            case 'b': opts.payload_size = (int) strtol(optarg, NULL, 10); break;
+            case 'g': opts.split_gap = strtod(optarg, NULL); break;
+            case 'i': opts.inter_train = strtod(optarg, NULL); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+    }
+
+    printf("input,time,target,received_low,received_high,duplicates_low,duplicates_high,reordered_low,"
+           "reordered_high,interval_low,interval_high,slowdown,z,logged");
+    for (int i = 0; i < opts.threshold_count; i++) {
+        printf(",threshold_%g", opts.thresholds[i]);
+    }
+    printf("\n");
+
+    struct replay_totals totals;
+    memset(&totals, 0, sizeof(totals));
+    int64_t start = mono_now_ns();
+    for (int i = optind; i < argc; i++) {
+        errno = 0;
+        if (replay_file(&opts, &totals, argv[i]) < 0) {
+            fprintf(stderr, "Error replaying %s: %s\n", argv[i], errno ? strerror(errno) : "malformed input");
+        }
+    }
+    double elapsed = (double) (mono_now_ns() - start) / 1e9;
+
+    fprintf(stderr, "%ld runs replayed in %.3f s (%.0f runs/s), %ld skipped without timings or a pair\n",
+            totals.runs, elapsed, elapsed > 0 ? totals.runs / elapsed : 0, totals.skipped);
+    for (int i = 0; i < opts.threshold_count; i++) {
+        fprintf(stderr, "threshold %g: %ld compression", opts.thresholds[i], totals.compressed[i]);
+        if (totals.compared > 0) {
+            fprintf(stderr, ", %ld of %ld differ from the logged verdict", totals.changed[i], totals.compared);
+        }
+        fprintf(stderr, "\n");
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../client_server/timing_export.h"
+#include "../client_server/results_log.h"
+
+/*
+ * Query tool for the results log written by compdetect_server -r and by the standalone tool's
+ * results_log setting. Selects results by time range and target address and prints them as
+ * CSV, one row per result or, with -p, one row per logged probe packet.
+ */
+
+static const char* source_names[] = {"", "server", "standalone"};
+static const char* verdict_names[] = {"none", "compression", "failed"};
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s results_log [-f from] [-t to] [-a address] [-p]\n"
+                    "Times are unix seconds or UTC as YYYY-MM-DD[THH:MM:SS]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * parse_time
+ * @param text unix seconds, possibly fractional, or a UTC date with an optional time of day
+ * @param ns output, nanoseconds since the epoch
+ * @return 0 on success, -1 if the text is neither
+ */
+int parse_time(const char* text, int64_t* ns) {
+    char* end;
+    double seconds = strtod(text, &end);
+    if (end != text && *end == '\0') {
+        *ns = (int64_t) (seconds * 1e9);
+        return 0;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(text, "%Y-%m-%d", &tm);
+    if (end != NULL && (*end == 'T' || *end == ' ')) {
+        end = strptime(end + 1, "%H:%M:%S", &tm);
+    }
+    if (end == NULL || (*end != '\0' && strcmp(end, "Z") != 0)) {
+        return -1;
+    }
+    *ns = (int64_t) timegm(&tm) * 1000000000;
+    return 0;
+}
+
+/**
+ * print_timings - one CSV row per packet of the logged timings
+ * @param time logging time, formatted
+ * @param target
+ * @param data export stream from timing_export_encode
+ * @param len
+ * @return 0 on success, -1 if the timings are malformed
+ */
+int print_timings(const char* time, const char* target, const unsigned char* data, size_t len) {
+    if (len < 6 || memcmp(data, EXPORT_MAGIC, 4) != 0 || data[4] != EXPORT_VERSION) {
+        return -1;
+    }
+    size_t offset = 6;
+    for (int t = 0; t < data[5]; t++) {
+        struct train_record rec;
+        size_t used = train_record_decode(data + offset, len - offset, &rec);
+        if (used == 0) {
+            return -1;
+        }
+        offset += used;
+        for (int i = 0; i < rec.count; i++) {
+            printf("%s,%s,%s,%u,%lld\n", time, target, t == 0 ? "low" : "high", rec.seq[i],
+                   (long long) rec.arrival_ns[i]);
+        }
+        train_record_free(&rec);
+    }
+    return 0;
+}
+
+/**
+ * print_summary - one CSV row per result
+ * @param time logging time, formatted
+ * @param target
+ * @param r
+ */
+void print_summary(const char* time, const char* target, const struct result_summary* r) {
+    printf("%s,%s,%s,%s,%s,%u,%u,%u,%u,%.6f,%.6f,%.4f,%.2f,%.0f\n", time,
+           source_names[r->source <= RESULT_SOURCE_STANDALONE ? r->source : 0], target,
+           verdict_names[r->verdict <= RESULT_FAILED ? r->verdict : RESULT_FAILED], r->detail,
+           r->payload_size, r->packets, r->received[0], r->received[1], r->interval[0], r->interval[1],
+           r->slowdown, r->z, r->capacity_bps);
+}
+
+/**
+ * main
+ * @param argc
+ * @param argv
+ * @return
+ */
+int main(int argc, char** argv) {
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    in_addr_t address = INADDR_NONE;
+    int packets = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t:a:p")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (parse_time(optarg, &from) < 0) usage(argv[0]);
+                break;
+            case 't':
+                if (parse_time(optarg, &to) < 0) usage(argv[0]);
+                break;
+            case 'a':
+                address = inet_addr(optarg);
+                if (address == INADDR_NONE) usage(argv[0]);
+                break;
+            case 'p': packets = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+    }
+
+    struct results_reader reader;
+    if (results_reader_open(&reader, argv[optind]) < 0) {
+        perror("Error opening the results log");
+        exit(EXIT_FAILURE);
+    }
+    if (packets) {
+        printf("time,target,train,seq,arrival_ns\n");
+    } else {
+        printf("time,source,target,verdict,detail,payload_size,packets,received_low,received_high,"
+               "interval_low,interval_high,slowdown,z,capacity_bps\n");
+    }
+    size_t matched = 0, damaged = 0;
+    for (size_t i = results_reader_first(&reader, from); i < reader.count; i++) {
+        const struct result_index_entry* entry = &reader.index[i];
+        if (entry->time_ns > to) {
+            if (reader.sorted) {
+                break;
+            }
+            continue;
+        }
+        if (entry->time_ns < from || (address != INADDR_NONE && entry->target != address)) {
+            continue;
+        }
+        struct result_summary summary;
+        const unsigned char* timings;
+        if (results_reader_get(&reader, i, &summary, &timings) < 0) {
+            damaged++;
+            continue;
+        }
+        char time[40], target[INET_ADDRSTRLEN];
+        results_format_time(summary.time_ns, time, sizeof(time));
+        inet_ntop(AF_INET, &summary.target, target, sizeof(target));
+        if (!packets) {
+            print_summary(time, target, &summary);
+        } else if (entry->timings_len > 0 && print_timings(time, target, timings, entry->timings_len) < 0) {
+            damaged++;
+        }
+        matched++;
+    }
+    fprintf(stderr, "%zu of %zu results matched\n", matched, reader.count);
+    if (damaged > 0) {
+        fprintf(stderr, "Warning: %zu damaged records skipped\n", damaged);
+    }
+    results_reader_close(&reader);
+    return 0;
+}
@@ -0,0 +1,143 @@
+//
+// Target list and egress pacing for probing many destinations from one process.
+//
+
+#ifndef CAMPAIGN_H
+#define CAMPAIGN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "mono_clock.h"
+
+/**
+ * Token bucket over egress bytes. A train is never split, so the bucket holds at least
+ * one train and only the average rate across trains is limited.
+ */
+struct egress_budget {
+    double rate;        /* bytes per second, 0 for unlimited */
+    double burst;
+    double tokens;
+    int64_t last;       /* mono_now_ns of the last refill */
+};
+
+/**
+ * sleep_until - sleep until a mono_now_ns time, returns at once if it has passed. The raw
+ * clock has no absolute sleep, so this sleeps for what is left until it has run out.
+ * @param when nanoseconds
+ */
+void sleep_until(int64_t when) {
+    int64_t left;
+    while ((left = when - mono_now_ns()) > 0) {
+        struct timespec ts;
+        mono_to_timespec(left, &ts);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * egress_budget_init
+ * @param budget
+ * @param mbps average egress limit, 0 for unlimited
+ * @param train_bytes size of the largest train
+ */
+void egress_budget_init(struct egress_budget* budget, double mbps, double train_bytes) {
+    budget->rate = mbps > 0 ? mbps * 1e6 / 8 : 0;
+    budget->burst = train_bytes;
+    budget->tokens = train_bytes;
+    budget->last = mono_now_ns();
+}
+
+/**
+ * egress_budget_take - wait until bytes may be sent and take them from the bucket
+ * @param budget
+ * @param bytes
+ */
+void egress_budget_take(struct egress_budget* budget, double bytes) {
+    if (budget->rate <= 0) {
+        return;
+    }
+    int64_t now = mono_now_ns();
+    budget->tokens += (double) (now - budget->last) / 1e9 * budget->rate;
+    if (budget->tokens > budget->burst) {
+        budget->tokens = budget->burst;
+    }
+    budget->last = now;
+    if (budget->tokens < bytes) {
+        int64_t wait = (int64_t) ((bytes - budget->tokens) / budget->rate * 1e9);
+        sleep_until(now + wait);
+        budget->tokens = bytes;
+        budget->last = now + wait;
+    }
+    budget->tokens -= bytes;
+}
+
+/**
+ * One line of a targets file
+ */
+struct target_entry {
+    in_addr_t addr;     /* network order */
+    char marker[16];    /* marker strategy name, empty for the configured default */
+};
+
+/**
+ * targets_load - read IPv4 destinations, one per line with an optional marker strategy
+ * after the address, '#' starts a comment
+ * @param path
+ * @param count output
+ * @return allocated array of entries, exits on error
+ */
+struct target_entry* targets_load(const char* path, int* count) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Error opening targets file");
+        exit(EXIT_FAILURE);
+    }
+    int capacity = 64;
+    struct target_entry* targets = (struct target_entry*) malloc(sizeof(struct target_entry) * capacity);
+    if (targets == NULL) {
+        perror("Error allocating targets");
+        exit(EXIT_FAILURE);
+    }
+    char line[256];
+    *count = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char addr[INET_ADDRSTRLEN];
+        char marker[16] = "";
+        if (sscanf(line, "%15s %15s", addr, marker) < 1) {
+            continue;
+        }
+        struct in_addr parsed;
+        if (inet_pton(AF_INET, addr, &parsed) != 1) {
+            fprintf(stderr, "Skipping invalid target %s\n", addr);
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            targets = (struct target_entry*) realloc(targets, sizeof(struct target_entry) * capacity);
+        }
+        if (targets == NULL) {
+            perror("Error allocating targets");
+            exit(EXIT_FAILURE);
+        }
+        targets[*count].addr = parsed.s_addr;
+        strcpy(targets[*count].marker, marker);
+        (*count)++;
+    }
+    fclose(file);
+    if (*count == 0) {
+        fprintf(stderr, "No targets in %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return targets;
+}
+
+#endif //CAMPAIGN_H
@@ -0,0 +1,399 @@
+//
+// pcapng capture of received probe traffic. The receive path copies each packet into a
+// preallocated ring and a writer thread turns the ring into buffered file writes, so the
+// measurement never waits on the disk.
+//
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#define CAPTURE_SLOTS 4096
+#define CAPTURE_SNAPLEN 2048
+#define CAPTURE_WRITE_BUF (256 * 1024)
+#define CAPTURE_IDLE_NS 2000000L
+
+#define PCAPNG_SHB 0x0A0D0D0Au
+#define PCAPNG_IDB 1u
+#define PCAPNG_EPB 6u
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4Du
+#define PCAPNG_LINKTYPE_RAW 101
+#define PCAPNG_HASH_CRC32 2
+
+/**
+ * One captured packet. caplen bytes of data are kept out of len on the wire, and with
+ * headers_only the CRC32 of the whole packet stands in for the payload.
+ */
+struct capture_slot {
+    int64_t time_ns;            /* CLOCK_REALTIME */
+    uint32_t len;
+    uint32_t caplen;
+    uint32_t crc;
+    unsigned char data[CAPTURE_SNAPLEN];
+};
+
+/**
+ * Single producer (the receiving thread), single consumer (the writer thread) ring. Each side
+ * only writes its own index, published with release and read with acquire.
+ */
+struct capture {
+    int enabled;
+    int headers_only;
+    int fd;
+    struct capture_slot* slots;
+    unsigned long head;         /* next slot to fill, producer */
+    unsigned long tail;         /* next slot to write, consumer */
+    unsigned long dropped;      /* ring full */
+    int stop;
+    pthread_t writer;
+    unsigned char* out;
+    size_t out_len;
+    uint32_t crc_table[256];
+};
+
+static struct capture capture;
+
+/**
+ * capture_crc32 - IEEE CRC32, the pcapng epb_hash algorithm 2, continued over more data
+ * @param crc 0 to start
+ * @param data
+ * @param len
+ * @return
+ */
+uint32_t capture_crc32(uint32_t crc, const void* data, size_t len) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    crc ^= 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc = capture.crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * capture_headers_len - how much of an IPv4 packet is kept in headers only mode: the IP and
+ * transport headers, the sequence number of UDP probes and the quoted headers of ICMP errors
+ * @param data
+ * @param len
+ * @return
+ */
+size_t capture_headers_len(const unsigned char* data, size_t len) {
+    if (len < sizeof(struct iphdr)) {
+        return len;
+    }
+    const struct iphdr* ip = (const struct iphdr*) data;
+    size_t keep = (size_t) ip->ihl * 4;
+    switch (ip->protocol) {
+        case IPPROTO_UDP:
+            keep += sizeof(struct udphdr) + 2;
+            break;
+        case IPPROTO_TCP:
+            keep += len >= keep + sizeof(struct tcphdr) ? (size_t) ((const struct tcphdr*) (data + keep))->doff * 4
+                                                        : sizeof(struct tcphdr);
+            break;
+        case IPPROTO_ICMP:
+            keep += sizeof(struct icmphdr) + 60 + 8;
+            break;
+    }
+    return keep < len ? keep : len;
+}
+
+void capture_flush(void) {
+    if (capture.out_len > 0 && write(capture.fd, capture.out, capture.out_len) != (ssize_t) capture.out_len) {
+        perror("Error writing the capture");
+    }
+    capture.out_len = 0;
+}
+
+/**
+ * capture_out - append to the write buffer, writing it out when it fills up
+ * @param data
+ * @param len
+ */
+void capture_out(const void* data, size_t len) {
+    if (capture.out_len + len > CAPTURE_WRITE_BUF) {
+        capture_flush();
+    }
+    memcpy(capture.out + capture.out_len, data, len);
+    capture.out_len += len;
+}
+
+void capture_out32(uint32_t value) {
+    capture_out(&value, sizeof(value));
+}
+
+void capture_out16(uint16_t value) {
+    capture_out(&value, sizeof(value));
+}
+
+/**
+ * capture_option - one pcapng option, padded to 32 bits
+ * @param code
+ * @param value
+ * @param len
+ */
+void capture_option(uint16_t code, const void* value, uint16_t len) {
+    static const unsigned char pad[4] = {0};
+    capture_out16(code);
+    capture_out16(len);
+    capture_out(value, len);
+    capture_out(pad, (4 - len % 4) % 4);
+}
+
+/**
+ * capture_headers - section header block and the one interface, raw IPv4 with ns timestamps
+ * @param program shb_userappl
+ */
+void capture_headers(const char* program) {
+    uint16_t appl_len = (uint16_t) strlen(program);
+    /* fixed fields, shb_userappl, end of options and the trailing length */
+    uint32_t shb_len = 24 + 4 + (appl_len + 3u) / 4 * 4 + 4 + 4;
+    capture_out32(PCAPNG_SHB);
+    capture_out32(shb_len);
+    capture_out32(PCAPNG_BYTE_ORDER);
+    capture_out16(1);
+    capture_out16(0);
+    capture_out32(0xFFFFFFFFu);     /* section length unknown */
+    capture_out32(0xFFFFFFFFu);
+    capture_option(4, program, appl_len);
+    capture_out32(0);
+    capture_out32(shb_len);
+
+    const unsigned char tsresol = 9;
+    /* fixed fields, if_name, if_tsresol, end of options and the trailing length */
+    uint32_t idb_len = 16 + 12 + 8 + 4 + 4;
+    capture_out32(PCAPNG_IDB);
+    capture_out32(idb_len);
+    capture_out16(PCAPNG_LINKTYPE_RAW);
+    capture_out16(0);
+    capture_out32(CAPTURE_SNAPLEN);
+    capture_option(2, "probe", 5);
+    capture_option(9, &tsresol, 1);
+    capture_out32(0);
+    capture_out32(idb_len);
+}
+
+/**
+ * capture_block - enhanced packet block of a slot
+ * @param slot
+ */
+void capture_block(const struct capture_slot* slot) {
+    static const unsigned char pad[4] = {0};
+    uint32_t padded = (slot->caplen + 3) / 4 * 4;
+    /* fixed fields, the data, epb_hash and end of options, and the trailing length */
+    uint32_t block_len = 28 + padded + (capture.headers_only ? 12 + 4 : 0) + 4;
+    capture_out32(PCAPNG_EPB);
+    capture_out32(block_len);
+    capture_out32(0);
+    capture_out32((uint32_t) ((uint64_t) slot->time_ns >> 32));
+    capture_out32((uint32_t) slot->time_ns);
+    capture_out32(slot->caplen);
+    capture_out32(slot->len);
+    capture_out(slot->data, slot->caplen);
+    capture_out(pad, padded - slot->caplen);
+    if (capture.headers_only) {
+        unsigned char hash[5] = {PCAPNG_HASH_CRC32};
+        memcpy(hash + 1, &slot->crc, 4);
+        capture_option(3, hash, sizeof(hash));
+        capture_out32(0);
+    }
+    capture_out32(block_len);
+}
+
+/**
+ * capture_writer - drain the ring into the file until capture_close
+ * @param arg unused
+ * @return
+ */
+void* capture_writer(void* arg) {
+    (void) arg;
+    for (;;) {
+        unsigned long head = __atomic_load_n(&capture.head, __ATOMIC_ACQUIRE);
+        if (capture.tail == head) {
+            if (__atomic_load_n(&capture.stop, __ATOMIC_ACQUIRE) &&
+                capture.tail == __atomic_load_n(&capture.head, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            struct timespec idle = {0, CAPTURE_IDLE_NS};
+            nanosleep(&idle, NULL);
+            /* write out once the receive path has gone quiet, not between packets of a train */
+            if (capture.tail == __atomic_load_n(&capture.head, __ATOMIC_ACQUIRE)) {
+                capture_flush();
+            }
+            continue;
+        }
+        while (capture.tail != head) {
+            capture_block(&capture.slots[capture.tail % CAPTURE_SLOTS]);
+            __atomic_store_n(&capture.tail, capture.tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    capture_flush();
+    return NULL;
+}
+
+/**
+ * capture_close - write out what is left in the ring and close the file. Registered with atexit.
+ */
+void capture_close(void) {
+    if (!capture.enabled) {
+        return;
+    }
+    capture.enabled = 0;
+    __atomic_store_n(&capture.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(capture.writer, NULL);
+    close(capture.fd);
+    printf("Captured %lu packets, %lu dropped\n", capture.tail, capture.dropped);
+    free(capture.slots);
+    free(capture.out);
+}
+
+/**
+ * capture_open - start capturing to a pcapng file
+ * @param path
+ * @param program name recorded in the file
+ * @param headers_only keep only the headers and a CRC32 of each packet
+ * @return 0 on success, -1 on failure
+ */
+int capture_open(const char* path, const char* program, int headers_only) {
+    capture.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture.fd < 0) {
+        return -1;
+    }
+    capture.slots = (struct capture_slot*) malloc(sizeof(struct capture_slot) * CAPTURE_SLOTS);
+    capture.out = (unsigned char*) malloc(CAPTURE_WRITE_BUF);
+    if (capture.slots == NULL || capture.out == NULL) {
+        free(capture.slots);
+        free(capture.out);
+        close(capture.fd);
+        return -1;
+    }
+    /* fault the ring in now rather than on the first packets of a train */
+    memset(capture.slots, 0, sizeof(struct capture_slot) * CAPTURE_SLOTS);
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        capture.crc_table[i] = c;
+    }
+    capture.headers_only = headers_only;
+    capture.head = capture.tail = capture.dropped = 0;
+    capture.stop = 0;
+    capture.out_len = 0;
+    capture_headers(program);
+    if (pthread_create(&capture.writer, NULL, capture_writer, NULL) != 0) {
+        free(capture.slots);
+        free(capture.out);
+        close(capture.fd);
+        return -1;
+    }
+    capture.enabled = 1;
+    atexit(capture_close);
+    return 0;
+}
+
+/**
+ * capture_reserve - the next free slot of the ring
+ * @return NULL if the writer has fallen a whole ring behind, the packet is then counted as dropped
+ */
+struct capture_slot* capture_reserve(void) {
+    if (capture.head - __atomic_load_n(&capture.tail, __ATOMIC_ACQUIRE) >= CAPTURE_SLOTS) {
+        capture.dropped++;
+        return NULL;
+    }
+    return &capture.slots[capture.head % CAPTURE_SLOTS];
+}
+
+/**
+ * capture_commit - hand a filled slot to the writer
+ * @param slot
+ * @param ts arrival time, CLOCK_REALTIME
+ * @param len length of the packet
+ * @param crc of the whole packet, used in headers only mode
+ */
+void capture_commit(struct capture_slot* slot, const struct timespec* ts, size_t len, uint32_t crc) {
+    slot->time_ns = (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+    slot->len = (uint32_t) len;
+    if (capture.headers_only) {
+        slot->crc = crc;
+        slot->caplen = (uint32_t) capture_headers_len(slot->data, slot->caplen);
+    }
+    __atomic_store_n(&capture.head, capture.head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * capture_packet - capture an IPv4 packet as received on a raw socket
+ * @param ts arrival time, CLOCK_REALTIME
+ * @param data
+ * @param len
+ */
+void capture_packet(const struct timespec* ts, const void* data, size_t len) {
+    if (!capture.enabled) {
+        return;
+    }
+    struct capture_slot* slot = capture_reserve();
+    if (slot == NULL) {
+        return;
+    }
+    slot->caplen = (uint32_t) (len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN);
+    memcpy(slot->data, data, slot->caplen);
+    capture_commit(slot, ts, len, capture.headers_only ? capture_crc32(0, data, len) : 0);
+}
+
+/**
+ * capture_udp - capture a datagram received on a UDP socket, under IPv4 and UDP headers
+ * rebuilt from its addresses (the kernel has stripped the real ones, so TTL, IP ID and the
+ * checksums are not the ones on the wire)
+ * @param ts arrival time, CLOCK_REALTIME
+ * @param from sender
+ * @param to local address and port the datagram arrived on
+ * @param payload
+ * @param len
+ */
+void capture_udp(const struct timespec* ts, const struct sockaddr_in* from, const struct sockaddr_in* to,
+                 const void* payload, size_t len) {
+    if (!capture.enabled) {
+        return;
+    }
+    struct capture_slot* slot = capture_reserve();
+    if (slot == NULL) {
+        return;
+    }
+    size_t headers = sizeof(struct iphdr) + sizeof(struct udphdr);
+    struct iphdr* ip = (struct iphdr*) slot->data;
+    memset(ip, 0, headers);
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons((uint16_t) (headers + len));
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = from->sin_addr.s_addr;
+    ip->daddr = to->sin_addr.s_addr;
+    struct udphdr* udp = (struct udphdr*) (slot->data + sizeof(*ip));
+    udp->source = from->sin_port;
+    udp->dest = to->sin_port;
+    udp->len = htons((uint16_t) (sizeof(*udp) + len));
+    size_t copy = len < CAPTURE_SNAPLEN - headers ? len : CAPTURE_SNAPLEN - headers;
+    memcpy(slot->data + headers, payload, copy);
+    slot->caplen = (uint32_t) (headers + copy);
+    uint32_t crc = 0;
+    if (capture.headers_only) {
+        crc = capture_crc32(capture_crc32(0, slot->data, headers), payload, len);
+    }
+    capture_commit(slot, ts, headers + len, crc);
+}
+
+#endif //CAPTURE_H
@@ -0,0 +1,146 @@
+//
+// Kernel receive and transmit timestamps (SO_TIMESTAMPNS / SO_TIMESTAMPING).
+//
+
+#ifndef KERNEL_TS_H
+#define KERNEL_TS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/if_packet.h>
+
+#ifndef SCM_TIMESTAMPING
+#define SCM_TIMESTAMPING SO_TIMESTAMPING
+#endif
+
+/**
+ * rx_timestamps_enable - have the kernel stamp every received packet
+ * @param sockfd
+ * @return setsockopt result
+ */
+int rx_timestamps_enable(int sockfd) {
+    int on = 1;
+    return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+/**
+ * recv_timestamped - receive one packet together with its kernel arrival time, falling
+ * back to the current time if the kernel did not stamp it
+ * @param sockfd
+ * @param buf
+ * @param len
+ * @param ts output, CLOCK_REALTIME
+ * @param drops output, the socket's SO_RXQ_OVFL drop count, left alone if the socket does
+ * not report it; may be NULL
+ * @return recvmsg result
+ */
+ssize_t recv_timestamped(int sockfd, void* buf, size_t len, struct timespec* ts, uint32_t* drops) {
+    char control[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sockfd, &msg, 0);
+    if (n < 0) {
+        return n;
+    }
+    int stamped = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS) {
+            memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+            stamped = 1;
+        } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL && drops != NULL) {
+            memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+        }
+    }
+    if (!stamped) {
+        clock_gettime(CLOCK_REALTIME, ts);
+    }
+    return n;
+}
+
+/**
+ * tx_timestamps_enable - report a software timestamp for every packet leaving through the
+ * socket on its error queue, keyed by a per-socket counter starting at 0
+ * @param sockfd
+ * @return setsockopt result
+ */
+int tx_timestamps_enable(int sockfd) {
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/**
+ * tx_timestamps_collect - drain the error queue and pick out the timestamps of the packets
+ * with the given keys
+ * @param sockfd
+ * @param keys packet keys, in send order of the socket
+ * @param out output, left zeroed for keys that did not show up
+ * @param count number of keys
+ * @param timeout_ms how long to wait for missing timestamps
+ * @return number of keys found
+ */
+int tx_timestamps_collect(int sockfd, const uint32_t* keys, struct timespec* out, int count, int timeout_ms) {
+    int found = 0;
+    memset(out, 0, sizeof(struct timespec) * count);
+    while (found < count) {
+        struct pollfd pfd = { .fd = sockfd, .events = 0 };
+        if (poll(&pfd, 1, timeout_ms) <= 0 || (pfd.revents & POLLERR) == 0) {
+            break;
+        }
+        char control[512];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        while (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0) {
+            struct timespec ts = {0, 0};
+            int64_t key = -1;
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                    struct scm_timestamping stamps;
+                    memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+                    ts = stamps.ts[0];
+                } else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                           (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_TX_TIMESTAMP)) {
+                    struct sock_extended_err err;
+                    memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                    if (err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                        key = err.ee_data;
+                    }
+                }
+            }
+            for (int i = 0; i < count; i++) {
+                if (key == keys[i] && out[i].tv_sec == 0 && out[i].tv_nsec == 0) {
+                    out[i] = ts;
+                    found++;
+                }
+            }
+            msg.msg_controllen = sizeof(control);
+        }
+    }
+    return found;
+}
+
+/**
+ * timespec_diff - b - a in seconds
+ * @param a
+ * @param b
+ * @return
+ */
+double timespec_diff(const struct timespec* a, const struct timespec* b) {
+    return (double) (b->tv_sec - a->tv_sec) + (double) (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+#endif //KERNEL_TS_H
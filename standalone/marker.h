@@ -0,0 +1,297 @@
+//
+// Timing markers: prebuilt packets sent around a train whose replies bracket it.
+//
+
+#ifndef MARKER_H
+#define MARKER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include "checksum.h"
+#include "probe_table.h"
+
+#define OPT_SIZE 20
+#define MARKER_MAX_LEN (sizeof(struct iphdr) + sizeof(struct tcphdr) + OPT_SIZE)
+#define MARKER_SRC_PORT 12345   /* head i uses MARKER_SRC_PORT + i, tail i adds MAX_MARKER_PORTS */
+
+/*
+ * Strategies, also the automatic fallback order. Every marker carries its probe key so the
+ * reply can be matched: TCP markers in the sequence number (answered with ack = key + 1,
+ * by a RST from a closed port or a SYN/ACK from an open one), echo requests in the
+ * identifier and sequence fields, UDP markers in the IP identification, which comes back
+ * inside the port unreachable error. Port unreachables are rate limited per host, so unreach
+ * comes last: it only works when the train itself draws none of them.
+ */
+#define MARKER_RST 0
+#define MARKER_SYNACK 1
+#define MARKER_ECHO 2
+#define MARKER_UNREACH 3
+#define MARKER_STRATEGIES 4
+#define MARKER_AUTO (-1)
+#define MARKER_INVALID (-2)
+
+static const char* marker_names[MARKER_STRATEGIES] = {"rst", "synack", "echo", "unreach"};
+
+struct pseudo_header
+{
+    u_int32_t source_address;
+    u_int32_t dest_address;
+    u_int8_t placeholder;
+    u_int8_t protocol;
+    u_int16_t tcp_length;
+};
+
+/**
+ * Prebuilt marker packet for one destination, built once per session
+ */
+struct marker_template {
+    char packet[MARKER_MAX_LEN];
+    int len;
+    struct sockaddr_in dest_addr;
+};
+
+/**
+ * marker_strategy_parse
+ * @param name one of marker_names or "auto"
+ * @return strategy, MARKER_AUTO, or MARKER_INVALID
+ */
+int marker_strategy_parse(const char* name) {
+    if (strcmp(name, "auto") == 0) {
+        return MARKER_AUTO;
+    }
+    for (int i = 0; i < MARKER_STRATEGIES; i++) {
+        if (strcmp(name, marker_names[i]) == 0) {
+            return i;
+        }
+    }
+    return MARKER_INVALID;
+}
+
+/**
+ * Fill in the IP header of a marker, checksum included
+ * @param tpl
+ * @param saddr network order
+ * @param daddr network order
+ * @param protocol
+ * @param len total length
+ */
+void marker_ip_init(struct marker_template *tpl, in_addr_t saddr, in_addr_t daddr, int protocol, int len) {
+    memset(tpl, 0, sizeof(*tpl));
+    tpl->len = len;
+    tpl->dest_addr.sin_family = AF_INET;
+    tpl->dest_addr.sin_addr.s_addr = daddr;
+
+    struct iphdr* ip_h = (struct iphdr*) tpl->packet;
+    ip_h->ihl = 5;
+    ip_h->version = 4;
+    ip_h->tos = 0;
+    ip_h->tot_len = htons(len);
+    ip_h->id = htons(rand() % 65535);
+    ip_h->frag_off = 0;
+    ip_h->ttl = 255;
+    ip_h->protocol = protocol;
+    ip_h->check = 0;
+    ip_h->saddr = saddr;
+    ip_h->daddr = daddr;
+    ip_h->check = checksum(tpl->packet, sizeof(struct iphdr));
+}
+
+/**
+ * Build a SYN to dest_port with full IP and TCP checksums
+ * @param tpl
+ * @param saddr source, network order
+ * @param daddr destination, network order
+ * @param src_port
+ * @param dest_port
+ */
+void syn_template_init(struct marker_template *tpl, in_addr_t saddr, in_addr_t daddr, int src_port, int dest_port) {
+    // CITE: https://github.com/MaxXor/raw-sockets-example/blob/master/rawsockets.c
+    marker_ip_init(tpl, saddr, daddr, IPPROTO_TCP, sizeof(struct iphdr) + sizeof(struct tcphdr) + OPT_SIZE);
+    struct tcphdr* tcp_h = (struct tcphdr*) (tpl->packet + sizeof(struct iphdr));
+    struct pseudo_header ps_h;
+
+    tcp_h->source = htons(src_port);
+    tcp_h->dest = htons(dest_port);
+    tcp_h->seq = 0;
+    tcp_h->ack_seq = 0;
+    tcp_h->doff = 10;
+    tcp_h->syn = 1;
+    tcp_h->check = 0;
+    tcp_h->window = htons (5840);
+    tcp_h->urg_ptr = 0;
+
+    memset(&ps_h, 0, sizeof(ps_h));
+    ps_h.source_address = saddr;
+    ps_h.dest_address = daddr;
+    ps_h.placeholder = 0;
+    ps_h.protocol = IPPROTO_TCP;
+    ps_h.tcp_length = htons(sizeof(struct tcphdr) + OPT_SIZE);
+
+    uint64_t sum = checksum_add(&ps_h, sizeof(ps_h), 0);
+    sum = checksum_add(tcp_h, sizeof(struct tcphdr) + OPT_SIZE, sum);
+    tcp_h->check = checksum_fold(sum);
+}
+
+/**
+ * Build an ICMP echo request
+ * @param tpl
+ * @param saddr source, network order
+ * @param daddr destination, network order
+ */
+void echo_template_init(struct marker_template *tpl, in_addr_t saddr, in_addr_t daddr) {
+    marker_ip_init(tpl, saddr, daddr, IPPROTO_ICMP, sizeof(struct iphdr) + sizeof(struct icmphdr));
+    struct icmphdr* icmp_h = (struct icmphdr*) (tpl->packet + sizeof(struct iphdr));
+    icmp_h->type = ICMP_ECHO;
+    icmp_h->code = 0;
+    icmp_h->checksum = checksum((const char*) icmp_h, sizeof(struct icmphdr));
+}
+
+/**
+ * Build an empty UDP datagram to a port expected to be closed
+ * @param tpl
+ * @param saddr source, network order
+ * @param daddr destination, network order
+ * @param src_port
+ * @param dest_port
+ */
+void udp_marker_template_init(struct marker_template *tpl, in_addr_t saddr, in_addr_t daddr, int src_port,
+                              int dest_port) {
+    marker_ip_init(tpl, saddr, daddr, IPPROTO_UDP, sizeof(struct iphdr) + sizeof(struct udphdr));
+    struct udphdr* udp_h = (struct udphdr*) (tpl->packet + sizeof(struct iphdr));
+    udp_h->source = htons(src_port);
+    udp_h->dest = htons(dest_port);
+    udp_h->len = htons(sizeof(struct udphdr));
+
+    struct pseudo_header ps_h;
+    memset(&ps_h, 0, sizeof(ps_h));
+    ps_h.source_address = saddr;
+    ps_h.dest_address = daddr;
+    ps_h.protocol = IPPROTO_UDP;
+    ps_h.tcp_length = udp_h->len;
+    uint64_t sum = checksum_add(&ps_h, sizeof(ps_h), 0);
+    sum = checksum_add(udp_h, sizeof(struct udphdr), sum);
+    udp_h->check = checksum_fold(sum);
+    if (udp_h->check == 0) {
+        udp_h->check = 0xFFFF;
+    }
+}
+
+/**
+ * Patch the IP identification field
+ * @param tpl
+ * @param id host order
+ */
+void marker_template_set_id(struct marker_template *tpl, uint16_t id) {
+    struct iphdr* ip_h = (struct iphdr*) tpl->packet;
+    uint16_t new_id = htons(id);
+    ip_h->check = checksum_update(ip_h->check, ip_h->id, new_id);
+    ip_h->id = new_id;
+}
+
+/**
+ * Patch two 16-bit words with a 32-bit value, network order, updating a checksum
+ * @param field
+ * @param value host order
+ * @param check
+ */
+void marker_set_word32(void *field, uint32_t value, uint16_t *check) {
+    uint32_t new_value = htonl(value);
+    uint16_t old_words[2], new_words[2];
+    memcpy(old_words, field, sizeof(old_words));
+    memcpy(new_words, &new_value, sizeof(new_words));
+    *check = checksum_update(*check, old_words[0], new_words[0]);
+    *check = checksum_update(*check, old_words[1], new_words[1]);
+    memcpy(field, &new_value, sizeof(new_value));
+}
+
+/**
+ * Stamp the probe key into a marker, call after marker_template_set_id since UDP markers
+ * carry it in the IP identification
+ * @param tpl
+ * @param key host order
+ */
+void marker_template_set_key(struct marker_template *tpl, uint32_t key) {
+    struct iphdr* ip_h = (struct iphdr*) tpl->packet;
+    char *l4 = tpl->packet + sizeof(struct iphdr);
+    if (ip_h->protocol == IPPROTO_TCP) {
+        struct tcphdr* tcp_h = (struct tcphdr*) l4;
+        marker_set_word32(&tcp_h->seq, key, &tcp_h->check);
+    } else if (ip_h->protocol == IPPROTO_ICMP) {
+        struct icmphdr* icmp_h = (struct icmphdr*) l4;
+        marker_set_word32(&icmp_h->un.echo, key, &icmp_h->checksum);
+    } else {
+        marker_template_set_id(tpl, (uint16_t) key);
+    }
+}
+
+/**
+ * marker_port_ours - whether a port is one of the marker source ports
+ * @param port network order
+ * @return
+ */
+int marker_port_ours(uint16_t port) {
+    int p = ntohs(port);
+    return p >= MARKER_SRC_PORT && p < MARKER_SRC_PORT + 2 * MAX_MARKER_PORTS;
+}
+
+/**
+ * marker_reply_parse - recognise a reply to a marker: a TCP RST or SYN/ACK, an ICMP echo
+ * reply, or an ICMP port unreachable quoting a UDP marker
+ * @param buffer packet from a raw socket, starting at the IP header
+ * @param n length
+ * @param addr output, the marker's destination, network order
+ * @param key output, the probe key; only the low 16 bits for UDP markers
+ * @return protocol of the marker answered, 0 if the packet is not a marker reply
+ */
+int marker_reply_parse(const char *buffer, int n, in_addr_t *addr, uint32_t *key) {
+    const struct iphdr *ip_h = (const struct iphdr *) buffer;
+    if (n < (int) sizeof(struct iphdr) || ip_h->ihl < 5 || n < ip_h->ihl * 4 + 8) {
+        return 0;
+    }
+    const char *l4 = buffer + ip_h->ihl * 4;
+    int l4_len = n - ip_h->ihl * 4;
+    *addr = ip_h->saddr;
+
+    if (ip_h->protocol == IPPROTO_TCP && l4_len >= (int) sizeof(struct tcphdr)) {
+        const struct tcphdr *tcp_h = (const struct tcphdr *) l4;
+        if (!marker_port_ours(tcp_h->dest) || !tcp_h->ack || !(tcp_h->rst || tcp_h->syn)) {
+            return 0;
+        }
+        *key = ntohl(tcp_h->ack_seq) - 1;
+        return IPPROTO_TCP;
+    }
+    if (ip_h->protocol != IPPROTO_ICMP) {
+        return 0;
+    }
+    const struct icmphdr *icmp_h = (const struct icmphdr *) l4;
+    if (icmp_h->type == ICMP_ECHOREPLY) {
+        uint32_t words;
+        memcpy(&words, &icmp_h->un.echo, sizeof(words));
+        *key = ntohl(words);
+        return IPPROTO_ICMP;
+    }
+    if (icmp_h->type != ICMP_DEST_UNREACH || icmp_h->code != ICMP_PORT_UNREACH) {
+        return 0;
+    }
+    const struct iphdr *inner = (const struct iphdr *) (l4 + sizeof(struct icmphdr));
+    int inner_len = l4_len - (int) sizeof(struct icmphdr);
+    if (inner_len < (int) sizeof(struct iphdr) || inner->ihl < 5 ||
+        inner_len < inner->ihl * 4 + (int) sizeof(struct udphdr) || inner->protocol != IPPROTO_UDP) {
+        return 0;
+    }
+    const struct udphdr *udp_h = (const struct udphdr *) ((const char *) inner + inner->ihl * 4);
+    if (!marker_port_ours(udp_h->source)) {
+        return 0;
+    }
+    *addr = inner->daddr;
+    *key = ntohs(inner->id);
+    return IPPROTO_UDP;
+}
+
+#endif //MARKER_H
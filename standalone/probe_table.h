@@ -0,0 +1,187 @@
+//
+// Outstanding marker probes, matched to their replies by key.
+//
+
+#ifndef PROBE_TABLE_H
+#define PROBE_TABLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define MAX_MARKER_PORTS 16
+#define PROBE_HEAD 0
+#define PROBE_TAIL 1
+
+struct probe {
+    in_addr_t addr;
+    int proto;          /* protocol of the marker packet */
+    int train;
+    int role;
+    int answered;
+    struct timespec reply_time;     /* CLOCK_MONOTONIC_RAW */
+};
+
+/**
+ * Probe i carries key base_seq + i in its marker packet and the reply echoes it, so a reply
+ * finds its probe without a search; the probe's destination and marker protocol must match
+ * the reply so trains to different targets stay apart. The sender only
+ * appends, the listener only fills in answers of probes already sent; callers that
+ * share a table between threads serialize access themselves.
+ */
+struct probe_table {
+    uint32_t base_seq;
+    int count;
+    int capacity;
+    int answered;
+    struct probe* probes;
+};
+
+/**
+ * probe_table_init
+ * @param table
+ * @param base_seq key of the first probe
+ * @param capacity most probes that will be registered
+ */
+void probe_table_init(struct probe_table* table, uint32_t base_seq, int capacity) {
+    memset(table, 0, sizeof(*table));
+    table->base_seq = base_seq;
+    table->capacity = capacity;
+    table->probes = (struct probe*) calloc(capacity, sizeof(struct probe));
+    if (table->probes == NULL) {
+        perror("Error allocating the probe table");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void probe_table_free(struct probe_table* table) {
+    free(table->probes);
+    table->probes = NULL;
+    table->count = 0;
+    table->capacity = 0;
+}
+
+/**
+ * probe_register - add a probe before sending it
+ * @param table
+ * @param addr destination, network order
+ * @param proto protocol of the marker packet
+ * @param train
+ * @param role PROBE_HEAD or PROBE_TAIL
+ * @return key to put in the marker
+ */
+uint32_t probe_register(struct probe_table* table, in_addr_t addr, int proto, int train, int role) {
+    if (table->count >= table->capacity) {
+        fprintf(stderr, "Too many outstanding probes\n");
+        exit(EXIT_FAILURE);
+    }
+    struct probe* p = &table->probes[table->count];
+    p->addr = addr;
+    p->proto = proto;
+    p->train = train;
+    p->role = role;
+    p->answered = 0;
+    return table->base_seq + (uint32_t) table->count++;
+}
+
+/**
+ * probe_match - record the arrival of a marker reply, ignoring duplicates and strays
+ * @param table
+ * @param addr destination of the marker answered, network order
+ * @param proto protocol of the marker answered
+ * @param key probe key from the reply, host order; for UDP markers only the low 16 bits
+ * are returned, taken as the latest registered key with those bits
+ * @param arrival
+ * @return index of the probe answered, -1 if none
+ */
+int probe_match(struct probe_table* table, in_addr_t addr, int proto, uint32_t key, const struct timespec* arrival) {
+    uint32_t index = key - table->base_seq;
+    if (proto == IPPROTO_UDP) {
+        index &= 0xFFFF;
+        while (index + 0x10000 < (uint32_t) table->count) {
+            index += 0x10000;
+        }
+    }
+    if (index >= (uint32_t) table->count || table->probes[index].addr != addr ||
+        table->probes[index].proto != proto || table->probes[index].answered) {
+        return -1;
+    }
+    table->probes[index].answered = 1;
+    table->probes[index].reply_time = *arrival;
+    table->answered++;
+    return (int) index;
+}
+
+/**
+ * probe_answered - number of answered probes of a train in a role
+ * @param table
+ * @param train
+ * @param role
+ * @return
+ */
+int probe_answered(const struct probe_table* table, int train, int role) {
+    int n = 0;
+    for (int i = 0; i < table->count; i++) {
+        const struct probe* p = &table->probes[i];
+        n += p->train == train && p->role == role && p->answered;
+    }
+    return n;
+}
+
+int interval_compare(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * interval_median - median over every head/tail pair of tail minus head; pairing each head
+ * with each tail keeps one late marker from shifting the estimate
+ * @param heads
+ * @param head_count at most MAX_MARKER_PORTS
+ * @param tails
+ * @param tail_count at most MAX_MARKER_PORTS
+ * @return seconds, -1 if either side is empty
+ */
+double interval_median(const struct timespec* heads, int head_count, const struct timespec* tails, int tail_count) {
+    double intervals[MAX_MARKER_PORTS * MAX_MARKER_PORTS];
+    int n = 0;
+    for (int i = 0; i < head_count; i++) {
+        for (int j = 0; j < tail_count; j++) {
+            intervals[n++] = (double) (tails[j].tv_sec - heads[i].tv_sec) +
+                             (double) (tails[j].tv_nsec - heads[i].tv_nsec) / 1e9;
+        }
+    }
+    if (n == 0) {
+        return -1;
+    }
+    qsort(intervals, n, sizeof(double), interval_compare);
+    return n % 2 ? intervals[n / 2] : (intervals[n / 2 - 1] + intervals[n / 2]) / 2;
+}
+
+/**
+ * probe_interval - median reply interval between the head and tail probes of a train
+ * @param table
+ * @param train
+ * @return seconds, -1 if all head or all tail replies are missing
+ */
+double probe_interval(const struct probe_table* table, int train) {
+    struct timespec heads[MAX_MARKER_PORTS], tails[MAX_MARKER_PORTS];
+    int head_count = 0, tail_count = 0;
+    for (int i = 0; i < table->count; i++) {
+        const struct probe* p = &table->probes[i];
+        if (p->train != train || !p->answered) {
+            continue;
+        }
+        if (p->role == PROBE_HEAD && head_count < MAX_MARKER_PORTS) {
+            heads[head_count++] = p->reply_time;
+        } else if (p->role == PROBE_TAIL && tail_count < MAX_MARKER_PORTS) {
+            tails[tail_count++] = p->reply_time;
+        }
+    }
+    return interval_median(heads, head_count, tails, tail_count);
+}
+
+#endif //PROBE_TABLE_H
@@ -0,0 +1,487 @@
+//
+// Append-only binary log of measurement results, with an index by time and target that
+// readers map into memory.
+//
+
+#ifndef RESULTS_LOG_H
+#define RESULTS_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RESULTS_MAGIC "CDRL"
+#define RESULTS_INDEX_MAGIC "CDRI"
+#define RESULTS_VERSION 1
+#define RESULTS_HEADER_LEN 8
+#define RESULTS_FRAME_MAGIC 0x52524443u
+#define RESULTS_TIMINGS_MAX (64u << 20)
+
+#define RESULT_SOURCE_SERVER 1
+#define RESULT_SOURCE_STANDALONE 2
+
+#define RESULT_NONE 0
+#define RESULT_COMPRESSION 1
+#define RESULT_FAILED 2
+
+/**
+ * Summary of one session, or of one target of a standalone campaign. Stored as is, so a log
+ * is read on the architecture that wrote it.
+ */
+struct result_summary {
+    int64_t time_ns;            /* CLOCK_REALTIME when the result was logged */
+    uint32_t target;            /* IPv4, network order: the client for the server */
+    uint8_t source;             /* RESULT_SOURCE_* */
+    uint8_t verdict;            /* RESULT_* */
+    uint16_t payload_size;
+    uint32_t packets;           /* per train */
+    uint32_t received[2];       /* low, high; 0 if not counted */
+    double interval[2];         /* seconds, -1 if missing */
+    double slowdown;            /* relative, high over low entropy */
+    double z;                   /* standard errors, 0 if not computed */
+    double capacity_bps;        /* 0 if not measured */
+    char detail[16];            /* marker strategy for the standalone tool */
+};
+
+/**
+ * On disk every record is a frame followed by the summary and timings_len bytes of per-packet
+ * timings in the export format of timing_export.h.
+ */
+struct result_frame {
+    uint32_t magic;
+    uint32_t timings_len;
+};
+
+struct result_index_entry {
+    int64_t time_ns;
+    uint32_t target;
+    uint32_t timings_len;
+    uint64_t offset;            /* of the frame in the log */
+};
+
+/**
+ * Index file: RESULTS_INDEX_MAGIC, version, and whether the entries are in time order, then
+ * the entries. Out of order times (the wall clock stepped back) clear the flag and readers
+ * scan instead of searching.
+ */
+struct result_index_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t sorted;
+    uint16_t reserved;
+};
+
+struct results_log {
+    int fd;
+    int index_fd;
+    int64_t last_time_ns;
+    int sorted;
+};
+
+/**
+ * results_frame_len
+ * @param timings_len
+ * @return size of a whole record
+ */
+size_t results_frame_len(uint32_t timings_len) {
+    return sizeof(struct result_frame) + sizeof(struct result_summary) + timings_len;
+}
+
+/**
+ * results_index_rebuild - rewrite the index from the log and cut off a record left half written
+ * @param log open log
+ * @return 0 on success, -1 on failure
+ */
+int results_index_rebuild(struct results_log* log) {
+    struct stat st;
+    if (fstat(log->fd, &st) < 0 || ftruncate(log->index_fd, 0) < 0) {
+        return -1;
+    }
+    struct result_index_header header = { {'C', 'D', 'R', 'I'}, RESULTS_VERSION, 1, 0 };
+    if (pwrite(log->index_fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+        return -1;
+    }
+    log->sorted = 1;
+    log->last_time_ns = INT64_MIN;
+    off_t offset = RESULTS_HEADER_LEN, index_offset = sizeof(header);
+    while (offset + (off_t) results_frame_len(0) <= st.st_size) {
+        struct result_frame frame;
+        struct result_summary summary;
+        if (pread(log->fd, &frame, sizeof(frame), offset) != (ssize_t) sizeof(frame) ||
+            frame.magic != RESULTS_FRAME_MAGIC || frame.timings_len > RESULTS_TIMINGS_MAX ||
+            offset + (off_t) results_frame_len(frame.timings_len) > st.st_size ||
+            pread(log->fd, &summary, sizeof(summary), offset + sizeof(frame)) != (ssize_t) sizeof(summary)) {
+            break;
+        }
+        struct result_index_entry entry = { summary.time_ns, summary.target, frame.timings_len, (uint64_t) offset };
+        if (pwrite(log->index_fd, &entry, sizeof(entry), index_offset) != (ssize_t) sizeof(entry)) {
+            return -1;
+        }
+        if (summary.time_ns < log->last_time_ns) {
+            log->sorted = 0;
+        }
+        log->last_time_ns = summary.time_ns;
+        index_offset += sizeof(entry);
+        offset += (off_t) results_frame_len(frame.timings_len);
+    }
+    if (offset < st.st_size) {
+        fprintf(stderr, "Warning: dropping %lld trailing bytes of the results log\n",
+                (long long) (st.st_size - offset));
+        if (ftruncate(log->fd, offset) < 0) {
+            return -1;
+        }
+    }
+    header.sorted = (uint8_t) log->sorted;
+    return pwrite(log->index_fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) ? 0 : -1;
+}
+
+/**
+ * results_index_check - whether the index covers exactly the records in the log
+ * @param log
+ * @return 1 if it does, 0 if it has to be rebuilt
+ */
+int results_index_check(struct results_log* log) {
+    struct stat st, index_st;
+    struct result_index_header header;
+    if (fstat(log->fd, &st) < 0 || fstat(log->index_fd, &index_st) < 0 ||
+        pread(log->index_fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        memcmp(header.magic, RESULTS_INDEX_MAGIC, 4) != 0 ||
+        (index_st.st_size - (off_t) sizeof(header)) % (off_t) sizeof(struct result_index_entry) != 0) {
+        return 0;
+    }
+    if (index_st.st_size == (off_t) sizeof(header)) {
+        log->sorted = header.sorted;
+        log->last_time_ns = INT64_MIN;
+        return st.st_size == RESULTS_HEADER_LEN;
+    }
+    struct result_index_entry last;
+    if (pread(log->index_fd, &last, sizeof(last), index_st.st_size - (off_t) sizeof(last)) != (ssize_t) sizeof(last) ||
+        (off_t) (last.offset + results_frame_len(last.timings_len)) != st.st_size) {
+        return 0;
+    }
+    log->sorted = header.sorted;
+    log->last_time_ns = last.time_ns;
+    return 1;
+}
+
+/**
+ * results_log_open - open a log for appending, creating it and its index (path.idx) if needed
+ * @param log
+ * @param path
+ * @return 0 on success, -1 on failure
+ */
+int results_log_open(struct results_log* log, const char* path) {
+    char index_path[512];
+    if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >= (int) sizeof(index_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    log->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd < 0) {
+        return -1;
+    }
+    log->index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->index_fd < 0) {
+        close(log->fd);
+        return -1;
+    }
+    flock(log->fd, LOCK_EX);
+    int rc = 0;
+    char header[RESULTS_HEADER_LEN] = {'C', 'D', 'R', 'L', RESULTS_VERSION, 0, 0, 0};
+    char existing[RESULTS_HEADER_LEN];
+    struct stat st;
+    if (fstat(log->fd, &st) < 0) {
+        rc = -1;
+    } else if (st.st_size == 0) {
+        if (write(log->fd, header, sizeof(header)) != (ssize_t) sizeof(header)) {
+            rc = -1;
+        }
+    } else if (pread(log->fd, existing, sizeof(existing), 0) != (ssize_t) sizeof(existing) ||
+               memcmp(existing, RESULTS_MAGIC, 4) != 0 || existing[4] != RESULTS_VERSION) {
+        errno = EINVAL;
+        rc = -1;
+    }
+    if (rc == 0 && !results_index_check(log)) {
+        rc = results_index_rebuild(log);
+    }
+    flock(log->fd, LOCK_UN);
+    if (rc < 0) {
+        close(log->fd);
+        close(log->index_fd);
+    }
+    return rc;
+}
+
+/**
+ * results_log_append - append a result and index it. Processes sharing a log take turns
+ * through a lock on it.
+ * @param log
+ * @param summary time_ns is filled in
+ * @param timings per-packet timings, may be NULL
+ * @param timings_len
+ * @return 0 on success, -1 on failure
+ */
+int results_log_append(struct results_log* log, struct result_summary* summary, const unsigned char* timings,
+                       size_t timings_len) {
+    if (timings_len > RESULTS_TIMINGS_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    summary->time_ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+    size_t len = results_frame_len((uint32_t) timings_len);
+    unsigned char* record = (unsigned char*) malloc(len);
+    if (record == NULL) {
+        return -1;
+    }
+    struct result_frame frame = { RESULTS_FRAME_MAGIC, (uint32_t) timings_len };
+    memcpy(record, &frame, sizeof(frame));
+    memcpy(record + sizeof(frame), summary, sizeof(*summary));
+    if (timings_len > 0) {
+        memcpy(record + sizeof(frame) + sizeof(*summary), timings, timings_len);
+    }
+
+    flock(log->fd, LOCK_EX);
+    /* another process may have appended since, pick up where its index ends */
+    int rc = results_index_check(log) ? 0 : results_index_rebuild(log);
+    off_t offset = lseek(log->fd, 0, SEEK_END);
+    if (rc < 0 || offset < 0 || write(log->fd, record, len) != (ssize_t) len) {
+        rc = -1;
+    } else {
+        struct result_index_entry entry = { summary->time_ns, summary->target, (uint32_t) timings_len,
+                                            (uint64_t) offset };
+        off_t index_end = lseek(log->index_fd, 0, SEEK_END);
+        if (pwrite(log->index_fd, &entry, sizeof(entry), index_end) != (ssize_t) sizeof(entry)) {
+            rc = -1;
+        } else if (log->sorted && summary->time_ns < log->last_time_ns) {
+            struct result_index_header header = { {'C', 'D', 'R', 'I'}, RESULTS_VERSION, 0, 0 };
+            log->sorted = 0;
+            if (pwrite(log->index_fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+                rc = -1;
+            }
+        }
+        log->last_time_ns = summary->time_ns;
+    }
+    flock(log->fd, LOCK_UN);
+    free(record);
+    return rc;
+}
+
+void results_log_close(struct results_log* log) {
+    close(log->fd);
+    close(log->index_fd);
+}
+
+/**
+ * results_format_time - UTC with milliseconds
+ * @param ns since the epoch
+ * @param out
+ * @param len
+ */
+void results_format_time(int64_t ns, char* out, size_t len) {
+    time_t seconds = (time_t) (ns / 1000000000);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    size_t n = strftime(out, len, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(out + n, len - n, ".%03dZ", (int) (ns % 1000000000 / 1000000));
+}
+
+/**
+ * A log and its index mapped for reading. When the index on disk is missing or does not match
+ * the log, the reader builds one in memory instead.
+ */
+struct results_reader {
+    const unsigned char* data;
+    size_t data_len;
+    const struct result_index_entry* index;
+    size_t count;
+    size_t index_len;           /* of the mapping, 0 for an index built in memory */
+    int sorted;
+};
+
+/**
+ * results_reader_scan - index the complete records of a mapped log in memory, a half written
+ * record at the end is left out
+ * @param reader data and data_len are set
+ * @return 0 on success, -1 if out of memory
+ */
+int results_reader_scan(struct results_reader* reader) {
+    size_t capacity = 0, offset = RESULTS_HEADER_LEN;
+    struct result_index_entry* index = NULL;
+    int64_t last = INT64_MIN;
+    reader->count = 0;
+    reader->sorted = 1;
+    while (offset + results_frame_len(0) <= reader->data_len) {
+        struct result_frame frame;
+        struct result_summary summary;
+        memcpy(&frame, reader->data + offset, sizeof(frame));
+        if (frame.magic != RESULTS_FRAME_MAGIC || frame.timings_len > RESULTS_TIMINGS_MAX ||
+            offset + results_frame_len(frame.timings_len) > reader->data_len) {
+            break;
+        }
+        memcpy(&summary, reader->data + offset + sizeof(frame), sizeof(summary));
+        if (reader->count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 256;
+            struct result_index_entry* grown = (struct result_index_entry*) realloc(index, capacity * sizeof(*index));
+            if (grown == NULL) {
+                free(index);
+                return -1;
+            }
+            index = grown;
+        }
+        struct result_index_entry entry = { summary.time_ns, summary.target, frame.timings_len, (uint64_t) offset };
+        index[reader->count++] = entry;
+        if (summary.time_ns < last) {
+            reader->sorted = 0;
+        }
+        last = summary.time_ns;
+        offset += results_frame_len(frame.timings_len);
+    }
+    reader->index = index;
+    reader->index_len = 0;
+    return 0;
+}
+
+/**
+ * results_reader_map - map an open log, and its index if it matches the log
+ * @param reader
+ * @param log open read only, index_fd -1 if there is no index
+ * @return 0 on success, -1 on failure
+ */
+int results_reader_map(struct results_reader* reader, struct results_log* log) {
+    struct stat st, index_st;
+    char header[RESULTS_HEADER_LEN];
+    if (fstat(log->fd, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size < RESULTS_HEADER_LEN || pread(log->fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        memcmp(header, RESULTS_MAGIC, 4) != 0 || header[4] != RESULTS_VERSION) {
+        errno = EINVAL;
+        return -1;
+    }
+    reader->data_len = (size_t) st.st_size;
+    reader->data = (const unsigned char*) mmap(NULL, reader->data_len, PROT_READ, MAP_SHARED, log->fd, 0);
+    if (reader->data == MAP_FAILED) {
+        reader->data = NULL;
+        return -1;
+    }
+    if (log->index_fd >= 0 && results_index_check(log) && fstat(log->index_fd, &index_st) == 0) {
+        const unsigned char* index = (const unsigned char*) mmap(NULL, (size_t) index_st.st_size, PROT_READ,
+                                                                 MAP_SHARED, log->index_fd, 0);
+        if (index != MAP_FAILED) {
+            reader->index_len = (size_t) index_st.st_size;
+            reader->sorted = ((const struct result_index_header*) index)->sorted;
+            reader->index = (const struct result_index_entry*) (index + sizeof(struct result_index_header));
+            reader->count = (reader->index_len - sizeof(struct result_index_header)) / sizeof(struct result_index_entry);
+            return 0;
+        }
+    }
+    if (results_reader_scan(reader) < 0) {
+        munmap((void*) reader->data, reader->data_len);
+        reader->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * results_reader_open - map a log and its index read only, under a shared lock so no record
+ * is half written while the index is checked. Neither file is created or changed: a missing
+ * or stale index is rebuilt in memory.
+ * @param reader
+ * @param path
+ * @return 0 on success, -1 on failure
+ */
+int results_reader_open(struct results_reader* reader, const char* path) {
+    char index_path[512];
+    if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >= (int) sizeof(index_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(reader, 0, sizeof(*reader));
+    struct results_log log;
+    log.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (log.fd < 0) {
+        return -1;
+    }
+    log.index_fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    flock(log.fd, LOCK_SH);
+    int rc = results_reader_map(reader, &log);
+    int saved = errno;
+    flock(log.fd, LOCK_UN);
+    close(log.fd);
+    if (log.index_fd >= 0) {
+        close(log.index_fd);
+    }
+    errno = saved;
+    return rc;
+}
+
+/**
+ * results_reader_first - first entry at or after a time
+ * @param reader
+ * @param from_ns
+ * @return its position in the index, 0 if the index is not in time order
+ */
+size_t results_reader_first(const struct results_reader* reader, int64_t from_ns) {
+    if (!reader->sorted) {
+        return 0;
+    }
+    size_t lo = 0, hi = reader->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (reader->index[mid].time_ns < from_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * results_reader_get - the summary and timings of an indexed record, without copying the timings
+ * @param reader
+ * @param i position in the index
+ * @param summary output
+ * @param timings output, points into the mapped log
+ * @return 0 on success, -1 if the record is damaged
+ */
+int results_reader_get(const struct results_reader* reader, size_t i, struct result_summary* summary,
+                       const unsigned char** timings) {
+    const struct result_index_entry* entry = &reader->index[i];
+    if (entry->offset + results_frame_len(entry->timings_len) > reader->data_len) {
+        return -1;
+    }
+    struct result_frame frame;
+    memcpy(&frame, reader->data + entry->offset, sizeof(frame));
+    if (frame.magic != RESULTS_FRAME_MAGIC || frame.timings_len != entry->timings_len) {
+        return -1;
+    }
+    memcpy(summary, reader->data + entry->offset + sizeof(frame), sizeof(*summary));
+    *timings = reader->data + entry->offset + sizeof(frame) + sizeof(*summary);
+    return 0;
+}
+
+void results_reader_close(struct results_reader* reader) {
+    if (reader->data != NULL) {
+        munmap((void*) reader->data, reader->data_len);
+    }
+    if (reader->index != NULL && reader->index_len > 0) {
+        munmap((void*) ((const unsigned char*) reader->index - sizeof(struct result_index_header)), reader->index_len);
+    } else {
+        free((void*) reader->index);
+    }
+}
+
+#endif //RESULTS_LOG_H
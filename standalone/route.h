@@ -0,0 +1,166 @@
+//
+// Egress route lookup over rtnetlink, cached per destination.
+//
+
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define ROUTE_CACHE_SIZE 256
+
+/**
+ * How the kernel would send to a destination: the source address it would pick, the
+ * egress interface and the gateway, 0 when the destination is on link.
+ */
+struct route_info {
+    in_addr_t src;
+    in_addr_t gateway;
+    int ifindex;
+    char ifname[IF_NAMESIZE];
+};
+
+/**
+ * route_source_fallback - source address for dst from a connected datagram socket, for
+ * routes the kernel reports without a preferred source
+ * @param dst network order
+ * @param src output
+ * @return 0 on success, -1 on failure
+ */
+int route_source_fallback(in_addr_t dst, in_addr_t* src) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = dst;
+    addr.sin_port = htons(9); /* discard, nothing is sent */
+    socklen_t len = sizeof(addr);
+    int n = connect(sockfd, (struct sockaddr*) &addr, sizeof(addr));
+    if (n == 0) {
+        n = getsockname(sockfd, (struct sockaddr*) &addr, &len);
+    }
+    close(sockfd);
+    if (n < 0) {
+        return -1;
+    }
+    *src = addr.sin_addr.s_addr;
+    return 0;
+}
+
+/**
+ * route_lookup - ask the kernel for the route to dst with RTM_GETROUTE
+ * @param dst network order
+ * @param out
+ * @return 0 on success, -1 on failure with errno set
+ */
+int route_lookup(in_addr_t dst, struct route_info* out) {
+    struct {
+        struct nlmsghdr nh;
+        struct rtmsg rt;
+        char attrs[RTA_SPACE(sizeof(in_addr_t))];
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.nh.nlmsg_type = RTM_GETROUTE;
+    req.nh.nlmsg_flags = NLM_F_REQUEST;
+    req.nh.nlmsg_seq = 1;
+    req.rt.rtm_family = AF_INET;
+    req.rt.rtm_dst_len = 32;
+    struct rtattr* rta = (struct rtattr*) ((char*) &req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    rta->rta_type = RTA_DST;
+    rta->rta_len = RTA_LENGTH(sizeof(in_addr_t));
+    memcpy(RTA_DATA(rta), &dst, sizeof(in_addr_t));
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_LENGTH(sizeof(in_addr_t));
+
+    int sockfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sockfd < 0) {
+        return -1;
+    }
+    char buffer[8192];
+    ssize_t n = -1;
+    if (send(sockfd, &req, req.nh.nlmsg_len, 0) >= 0) {
+        n = recv(sockfd, buffer, sizeof(buffer), 0);
+    }
+    close(sockfd);
+    if (n < 0) {
+        return -1;
+    }
+
+    memset(out, 0, sizeof(*out));
+    int found = 0, remaining = (int) n;
+    for (struct nlmsghdr* nh = (struct nlmsghdr*) buffer; NLMSG_OK(nh, remaining); nh = NLMSG_NEXT(nh, remaining)) {
+        if (nh->nlmsg_type == NLMSG_ERROR) {
+            struct nlmsgerr* err = (struct nlmsgerr*) NLMSG_DATA(nh);
+            errno = err->error != 0 ? -err->error : EHOSTUNREACH;
+            return -1;
+        }
+        if (nh->nlmsg_type != RTM_NEWROUTE) {
+            continue;
+        }
+        struct rtmsg* rt = (struct rtmsg*) NLMSG_DATA(nh);
+        int len = (int) RTM_PAYLOAD(nh);
+        for (struct rtattr* attr = RTM_RTA(rt); RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+            if (attr->rta_type == RTA_OIF) {
+                memcpy(&out->ifindex, RTA_DATA(attr), sizeof(int));
+            } else if (attr->rta_type == RTA_PREFSRC) {
+                memcpy(&out->src, RTA_DATA(attr), sizeof(in_addr_t));
+            } else if (attr->rta_type == RTA_GATEWAY) {
+                memcpy(&out->gateway, RTA_DATA(attr), sizeof(in_addr_t));
+            }
+        }
+        found = 1;
+        break;
+    }
+    if (!found || out->ifindex == 0 || if_indextoname(out->ifindex, out->ifname) == NULL) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    if (out->src == 0 && route_source_fallback(dst, &out->src) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * route_get - route_lookup with a small per-destination cache, so a destination is looked
+ * up once however many packets or sockets are set up for it
+ * @param dst network order
+ * @param out
+ * @return 0 on success, -1 on failure with errno set
+ */
+int route_get(in_addr_t dst, struct route_info* out) {
+    static struct {
+        in_addr_t dst;
+        struct route_info info;
+    } cache[ROUTE_CACHE_SIZE];
+    static int cached = 0, next = 0;
+    for (int i = 0; i < cached; i++) {
+        if (cache[i].dst == dst) {
+            *out = cache[i].info;
+            return 0;
+        }
+    }
+    if (route_lookup(dst, out) < 0) {
+        return -1;
+    }
+    cache[next].dst = dst;
+    cache[next].info = *out;
+    next = (next + 1) % ROUTE_CACHE_SIZE;
+    if (cached < ROUTE_CACHE_SIZE) {
+        cached++;
+    }
+    return 0;
+}
+
+#endif //ROUTE_H
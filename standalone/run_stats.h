@@ -0,0 +1,491 @@
+//
+// Run instrumentation: phase timings, socket call and error counters, receive queue drops.
+// Printed as JSON at exit and served on an optional Unix stats socket while running.
+//
+
+#ifndef RUN_STATS_H
+#define RUN_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/sock_diag.h>
+
+#include "cJSON.h"
+
+#define STATS_MAX_PHASES 64
+#define STATS_NAME_LEN 48
+#define STATS_MAX_SOCKETS 8
+
+struct stats_phase {
+    char name[STATS_NAME_LEN];
+    double start;               /* CLOCK_MONOTONIC seconds */
+    double end;                 /* 0 while running */
+    int idle;
+};
+
+/**
+ * Counters are bumped with relaxed atomics from any thread, phases are kept under the lock.
+ * A receive drop counter is the kernel's SO_RXQ_OVFL count of the socket, last value seen.
+ */
+struct run_stats {
+    const char* program;
+    double started;
+    pthread_mutex_t lock;
+    struct stats_phase phases[STATS_MAX_PHASES];
+    int phase_count;
+    unsigned long phases_dropped;
+    double idle_sec;
+    unsigned long send_calls;
+    unsigned long recv_calls;
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    unsigned long eagain;
+    unsigned long enobufs;
+    unsigned long errors;
+    int drop_fd[STATS_MAX_SOCKETS];
+    uint32_t drops[STATS_MAX_SOCKETS];
+    int drop_sockets;
+    uint32_t drops_closed;      /* final counts of the sockets no longer tracked */
+    char socket_path[108];
+};
+
+static struct run_stats run_stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * stats_now
+ * @return seconds on CLOCK_MONOTONIC
+ */
+double stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * stats_count_error - classify a failed socket call by errno
+ */
+void stats_count_error(void) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        __atomic_fetch_add(&run_stats.eagain, 1, __ATOMIC_RELAXED);
+    } else if (errno == ENOBUFS) {
+        __atomic_fetch_add(&run_stats.enobufs, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&run_stats.errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * stats_count_send - account for one send call, errno is left as the call set it
+ * @param rc return value of the call
+ * @return rc
+ */
+ssize_t stats_count_send(ssize_t rc) {
+    __atomic_fetch_add(&run_stats.send_calls, 1, __ATOMIC_RELAXED);
+    if (rc < 0) {
+        stats_count_error();
+    } else {
+        __atomic_fetch_add(&run_stats.bytes_sent, (unsigned long) rc, __ATOMIC_RELAXED);
+    }
+    return rc;
+}
+
+/**
+ * stats_count_recv - account for one receive call, errno is left as the call set it
+ * @param rc return value of the call
+ * @return rc
+ */
+ssize_t stats_count_recv(ssize_t rc) {
+    __atomic_fetch_add(&run_stats.recv_calls, 1, __ATOMIC_RELAXED);
+    if (rc < 0) {
+        stats_count_error();
+    } else {
+        __atomic_fetch_add(&run_stats.bytes_received, (unsigned long) rc, __ATOMIC_RELAXED);
+    }
+    return rc;
+}
+
+/**
+ * stats_rx_drops_enable - have the kernel report on every received packet how many packets
+ * the socket has dropped for a full receive queue so far
+ * @param sockfd
+ * @return setsockopt result
+ */
+int stats_rx_drops_enable(int sockfd) {
+    int on = 1;
+    int rc = setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+    pthread_mutex_lock(&run_stats.lock);
+    if (rc == 0 && run_stats.drop_sockets < STATS_MAX_SOCKETS) {
+        run_stats.drop_fd[run_stats.drop_sockets] = sockfd;
+        run_stats.drops[run_stats.drop_sockets] = 0;
+        run_stats.drop_sockets++;
+    }
+    pthread_mutex_unlock(&run_stats.lock);
+    return rc;
+}
+
+/**
+ * stats_rx_drops_disable - stop tracking a socket before it is closed, keeping its count in the
+ * total, so the fd can be reused and its table entry taken by another socket
+ * @param sockfd
+ */
+void stats_rx_drops_disable(int sockfd) {
+    pthread_mutex_lock(&run_stats.lock);
+    for (int i = 0; i < run_stats.drop_sockets; i++) {
+        if (run_stats.drop_fd[i] == sockfd) {
+            run_stats.drops_closed += __atomic_load_n(&run_stats.drops[i], __ATOMIC_RELAXED);
+            run_stats.drop_sockets--;
+            run_stats.drop_fd[i] = run_stats.drop_fd[run_stats.drop_sockets];
+            run_stats.drops[i] = run_stats.drops[run_stats.drop_sockets];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&run_stats.lock);
+}
+
+/**
+ * stats_rx_drops_set - record the drop count a socket reported
+ * @param sockfd
+ * @param drops
+ */
+void stats_rx_drops_set(int sockfd, uint32_t drops) {
+    for (int i = 0; i < run_stats.drop_sockets; i++) {
+        if (run_stats.drop_fd[i] == sockfd) {
+            __atomic_store_n(&run_stats.drops[i], drops, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+/**
+ * stats_rx_drops_refresh - read a socket's drop count directly. SO_RXQ_OVFL reports it only
+ * with a later packet, so drops at the end of a burst would go unseen.
+ * @param sockfd
+ */
+void stats_rx_drops_refresh(int sockfd) {
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 &&
+        len > SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+        stats_rx_drops_set(sockfd, meminfo[SK_MEMINFO_DROPS]);
+    }
+}
+
+/**
+ * stats_rx_drops_get
+ * @param sockfd
+ * @return the last drop count the socket reported, 0 if it is not tracked
+ */
+uint32_t stats_rx_drops_get(int sockfd) {
+    for (int i = 0; i < run_stats.drop_sockets; i++) {
+        if (run_stats.drop_fd[i] == sockfd) {
+            return __atomic_load_n(&run_stats.drops[i], __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+/**
+ * stats_recvfrom_ts - recvfrom that is counted, picks up the socket's drop count and its kernel
+ * arrival timestamp (SO_TIMESTAMPNS)
+ * @param sockfd
+ * @param buf
+ * @param len
+ * @param flags
+ * @param addr may be NULL
+ * @param addr_len may be NULL
+ * @param ts output, CLOCK_REALTIME, the current time if the kernel did not stamp the packet; may be NULL
+ * @return recvmsg result
+ */
+ssize_t stats_recvfrom_ts(int sockfd, void* buf, size_t len, int flags, struct sockaddr* addr, socklen_t* addr_len,
+                          struct timespec* ts) {
+    char control[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr_len != NULL ? *addr_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = stats_count_recv(recvmsg(sockfd, &msg, flags));
+    if (n < 0) {
+        return n;
+    }
+    if (addr_len != NULL) {
+        *addr_len = msg.msg_namelen;
+    }
+    int stamped = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            stats_rx_drops_set(sockfd, drops);
+        } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS && ts != NULL) {
+            memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+            stamped = 1;
+        }
+    }
+    if (ts != NULL && !stamped) {
+        clock_gettime(CLOCK_REALTIME, ts);
+    }
+    return n;
+}
+
+/**
+ * stats_recvfrom - recvfrom that is counted and picks up the socket's drop count
+ * @param sockfd
+ * @param buf
+ * @param len
+ * @param flags
+ * @param addr may be NULL
+ * @param addr_len may be NULL
+ * @return recvmsg result
+ */
+ssize_t stats_recvfrom(int sockfd, void* buf, size_t len, int flags, struct sockaddr* addr, socklen_t* addr_len) {
+    return stats_recvfrom_ts(sockfd, buf, len, flags, addr, addr_len, NULL);
+}
+
+/**
+ * stats_phase_open
+ * @param name
+ * @param idle time spent waiting on purpose
+ * @return phase handle for stats_phase_end, -1 once the phase table is full
+ */
+int stats_phase_open(const char* name, int idle) {
+    pthread_mutex_lock(&run_stats.lock);
+    int phase = -1;
+    if (run_stats.phase_count < STATS_MAX_PHASES) {
+        phase = run_stats.phase_count++;
+        struct stats_phase* p = &run_stats.phases[phase];
+        snprintf(p->name, sizeof(p->name), "%s", name);
+        p->start = stats_now();
+        p->end = 0;
+        p->idle = idle;
+    } else {
+        run_stats.phases_dropped++;
+    }
+    pthread_mutex_unlock(&run_stats.lock);
+    return phase;
+}
+
+/**
+ * stats_phase_begin - start timing a phase of the run
+ * @param name
+ * @return phase handle
+ */
+int stats_phase_begin(const char* name) {
+    return stats_phase_open(name, 0);
+}
+
+/**
+ * stats_idle_begin - start timing a deliberate wait
+ * @param name
+ * @return phase handle
+ */
+int stats_idle_begin(const char* name) {
+    return stats_phase_open(name, 1);
+}
+
+/**
+ * stats_phase_end
+ * @param phase handle from stats_phase_begin or stats_idle_begin, -1 is ignored
+ */
+void stats_phase_end(int phase) {
+    if (phase < 0) {
+        return;
+    }
+    pthread_mutex_lock(&run_stats.lock);
+    struct stats_phase* p = &run_stats.phases[phase];
+    p->end = stats_now();
+    if (p->idle) {
+        run_stats.idle_sec += p->end - p->start;
+    }
+    pthread_mutex_unlock(&run_stats.lock);
+}
+
+/**
+ * stats_idle_add - count a deliberate wait without giving it a phase of its own, for waits
+ * too frequent to list
+ * @param sec
+ */
+void stats_idle_add(double sec) {
+    pthread_mutex_lock(&run_stats.lock);
+    run_stats.idle_sec += sec;
+    pthread_mutex_unlock(&run_stats.lock);
+}
+
+/**
+ * stats_phases_reset - start a new phase table, for long running programs that list the phases
+ * of their latest unit of work only. No phase may be open.
+ */
+void stats_phases_reset(void) {
+    pthread_mutex_lock(&run_stats.lock);
+    run_stats.phase_count = 0;
+    run_stats.phases_dropped = 0;
+    pthread_mutex_unlock(&run_stats.lock);
+}
+
+/**
+ * stats_ms - seconds to milliseconds, rounded to the microsecond
+ * @param sec
+ * @return
+ */
+double stats_ms(double sec) {
+    return (double) (long long) (sec * 1e6 + 0.5) / 1e3;
+}
+
+/**
+ * stats_json - snapshot of the stats, times in milliseconds since stats_init
+ * @return JSON object, the caller frees it with cJSON_Delete
+ */
+cJSON* stats_json(void) {
+    double now = stats_now();
+    cJSON* root = cJSON_CreateObject();
+    pthread_mutex_lock(&run_stats.lock);
+    cJSON_AddStringToObject(root, "program", run_stats.program != NULL ? run_stats.program : "");
+    cJSON_AddNumberToObject(root, "elapsed_ms", stats_ms(now - run_stats.started));
+    cJSON_AddNumberToObject(root, "idle_ms", stats_ms(run_stats.idle_sec));
+    cJSON* phases = cJSON_AddArrayToObject(root, "phases");
+    for (int i = 0; i < run_stats.phase_count; i++) {
+        struct stats_phase* p = &run_stats.phases[i];
+        double end = p->end > 0 ? p->end : now;
+        cJSON* phase = cJSON_CreateObject();
+        cJSON_AddStringToObject(phase, "name", p->name);
+        cJSON_AddNumberToObject(phase, "start_ms", stats_ms(p->start - run_stats.started));
+        cJSON_AddNumberToObject(phase, "duration_ms", stats_ms(end - p->start));
+        if (p->idle) {
+            cJSON_AddTrueToObject(phase, "idle");
+        }
+        if (p->end == 0) {
+            cJSON_AddTrueToObject(phase, "running");
+        }
+        cJSON_AddItemToArray(phases, phase);
+    }
+    cJSON_AddNumberToObject(root, "phases_dropped", (double) run_stats.phases_dropped);
+    uint32_t drops = run_stats.drops_closed;
+    for (int i = 0; i < run_stats.drop_sockets; i++) {
+        drops += __atomic_load_n(&run_stats.drops[i], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&run_stats.lock);
+
+    cJSON* sock = cJSON_AddObjectToObject(root, "sockets");
+    cJSON_AddNumberToObject(sock, "send_calls", (double) __atomic_load_n(&run_stats.send_calls, __ATOMIC_RELAXED));
+    cJSON_AddNumberToObject(sock, "recv_calls", (double) __atomic_load_n(&run_stats.recv_calls, __ATOMIC_RELAXED));
+    cJSON_AddNumberToObject(sock, "bytes_sent", (double) __atomic_load_n(&run_stats.bytes_sent, __ATOMIC_RELAXED));
+    cJSON_AddNumberToObject(sock, "bytes_received",
+                            (double) __atomic_load_n(&run_stats.bytes_received, __ATOMIC_RELAXED));
+    cJSON_AddNumberToObject(sock, "eagain", (double) __atomic_load_n(&run_stats.eagain, __ATOMIC_RELAXED));
+    cJSON_AddNumberToObject(sock, "enobufs", (double) __atomic_load_n(&run_stats.enobufs, __ATOMIC_RELAXED));
+    cJSON_AddNumberToObject(sock, "errors", (double) __atomic_load_n(&run_stats.errors, __ATOMIC_RELAXED));
+    cJSON_AddNumberToObject(sock, "rx_queue_drops", (double) drops);
+    return root;
+}
+
+/**
+ * stats_report - print the stats as one line of JSON, registered with atexit so failed
+ * runs report too
+ */
+void stats_report(void) {
+    cJSON* root = stats_json();
+    char* text = cJSON_PrintUnformatted(root);
+    if (text != NULL) {
+        printf("stats %s\n", text);
+        free(text);
+    }
+    cJSON_Delete(root);
+    fflush(stdout);
+    if (run_stats.socket_path[0] != '\0') {
+        unlink(run_stats.socket_path);
+    }
+}
+
+/**
+ * stats_server - answer every connection to the stats socket with a snapshot
+ * @param args listening socket
+ * @return
+ */
+void* stats_server(void* args) {
+    int sockfd = (int) (intptr_t) args;
+    while (1) {
+        int conn = accept(sockfd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        cJSON* root = stats_json();
+        char* text = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+        if (text != NULL) {
+            size_t len = strlen(text);
+            text[len] = '\n';
+            if (write(conn, text, len + 1) < 0) {
+                perror("Warning: failed to write stats");
+            }
+            free(text);
+        }
+        close(conn);
+    }
+    return NULL;
+}
+
+/**
+ * stats_serve - serve snapshots on a Unix stream socket, one per connection
+ * @param path socket path, replaced if it exists
+ * @return 0 on success, -1 on failure
+ */
+int stats_serve(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(sockfd, 4) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_server, (void*) (intptr_t) sockfd) != 0) {
+        close(sockfd);
+        unlink(path);
+        return -1;
+    }
+    pthread_detach(thread);
+    snprintf(run_stats.socket_path, sizeof(run_stats.socket_path), "%s", path);
+    return 0;
+}
+
+/**
+ * stats_init - start the run clock and report at exit
+ * @param program name in the report
+ * @param socket_path stats socket, NULL or empty for none
+ */
+void stats_init(const char* program, const char* socket_path) {
+    run_stats.program = program;
+    run_stats.started = stats_now();
+    atexit(stats_report);
+    if (socket_path != NULL && socket_path[0] != '\0' && stats_serve(socket_path) < 0) {
+        perror("Warning: failed to open the stats socket");
+    }
+}
+
+#endif //RUN_STATS_H
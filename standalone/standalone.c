@@ -6,35 +6,45 @@
 #include <time.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <linux/filter.h>
 #include "config.h"
 #include "cJSON.h"
+#include "checksum.h"
+#include "route.h"
+#include "tx_ring.h"
+#include "kernel_ts.h"
+#include "probe_table.h"
+#include "marker.h"
+#include "campaign.h"
+#include "run_stats.h"
+#include "mono_clock.h"
+#include "results_log.h"
+#include "capture.h"
 
 
-#define TIMEOUT 20
 #define DATAGRAM_LEN 4096
-#define OPT_SIZE 20
 #define BUF_SIZE 1024
+#define REPLY_POLL_MS 100
+#define REPLY_WAIT_MS 1000
+#define TARGET_UNREACHABLE 1        /* target.skipped values */
+#define TARGET_NO_MARKER 2
 
 struct detection_info {
-    double result[2];
-};
-
-struct pseudo_header
-{
-    u_int32_t source_address;
-    u_int32_t dest_address;
-    u_int8_t placeholder;
-    u_int8_t protocol;
-    u_int16_t tcp_length;
+    struct probe_table table;
+    pthread_mutex_t lock;
+    int done;
+    int sockfd[2];      /* TCP and ICMP replies */
 };
 
 /**
- * Set up a raw socket, also sets the timeout for the socket
+ * Set up the raw socket the markers are sent on, replies come in on the marker sockets
  * @return
  */
 int sock_setup() {
@@ -49,45 +59,12 @@ int sock_setup() {
         perror("Error setting socket options");
         exit(EXIT_FAILURE);
     }
-
-    struct timeval timeout;
-    timeout.tv_sec = TIMEOUT;
-    timeout.tv_usec = 0;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
-        perror("Error setting socket timeout");
-        exit(EXIT_FAILURE);
-    }
     return sockfd;
 }
 
 /**
- * Checksum function
- * @param buf
- * @param size
- * @return
- */
-unsigned short checksum(const char *buf, unsigned size) {
-    // CITE: https://github.com/MaxXor/raw-sockets-example/blob/master/rawsockets.c
-    unsigned sum = 0, i;
-    /* Accumulate checksum */
-    for (i = 0; i < size - 1; i += 2) {
-        unsigned short word16 = *(unsigned short *) &buf[i];
-        sum += word16;
-    }
-    /* Handle odd-sized case */
-    if (size & 1) {
-        unsigned short word16 = (unsigned char) buf[i];
-        sum += word16;
-    }
-    /* Fold to get the ones-complement result */
-    while (sum >> 16) sum = (sum & 0xFFFF)+(sum >> 16);
-    /* Invert to get the negative in ones-complement arithmetic */
-    return ~sum;
-}
-
-
-/**
- * Create UPD packets, return the sockfd for UDP
+ * Create UPD packets, return the sockfd for UDP. It is bound to the wildcard address,
+ * udp_sender picks the source and interface of each target's route per packet.
  * @param cf
  * @return return the sockfd for UDP
  */
@@ -133,158 +110,361 @@ int udp_packet_create(struct config *cf) {
 }
 
 /**
- * Wait for the RST packet, calculates the time taken, will be called by a thread
- * @param args
+ * Number of markers on each side of a train, each sent from its own source port and, for
+ * RST markers, to its own closed port: dst_port_tcp_head and up, dst_port_tcp_tail and up
+ * @param cf
  * @return
  */
-void* rst_packet_recv(void* args) {
-    double* result = (double*) args;
-    int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+int marker_ports(struct config *cf) {
+    int ports = (int) strtol(cf->num_marker_ports, NULL, 10);
+    if (ports < 1) {
+        return 1;
+    }
+    return ports > MAX_MARKER_PORTS ? MAX_MARKER_PORTS : ports;
+}
+
+/**
+ * Most probes a run registers: every train of every target and marker strategy, each sent
+ * up to retries + 1 times with ports markers on each side
+ * @param targets
+ * @param retries
+ * @param ports
+ * @return the capacity, -1 if it does not fit in an int
+ */
+int probe_capacity(int targets, int retries, int ports) {
+    int capacity;
+    if (__builtin_mul_overflow(targets, MARKER_STRATEGIES * 2 * 2, &capacity) ||
+        __builtin_mul_overflow(capacity, retries + 1, &capacity) ||
+        __builtin_mul_overflow(capacity, ports, &capacity)) {
+        return -1;
+    }
+    return capacity;
+}
+
+/**
+ * Attach a classic BPF filter so a raw socket only sees replies to markers from the server:
+ * TCP RST or SYN segments to a marker source port, or ICMP echo replies and port
+ * unreachable errors. Packets queued before the filter was attached are not filtered,
+ * marker_reply_parse checks the same fields for them.
+ * @param sockfd raw IPPROTO_TCP or IPPROTO_ICMP socket, packets start at the IP header
+ * @param proto
+ * @param server_addr the only accepted source, network order, INADDR_ANY for a whole campaign
+ */
+void marker_filter_attach(int sockfd, int proto, in_addr_t server_addr) {
+    uint32_t server = ntohl(server_addr);
+    struct sock_filter tcp_code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),                 /* ip saddr */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, server, 0, 9),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),                  /* fragment offset */
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 7, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                 /* x = ip header length */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),                  /* tcp dest */
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, MARKER_SRC_PORT, 0, 4),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, MARKER_SRC_PORT + 2 * MAX_MARKER_PORTS, 3, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13),                 /* tcp flags */
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x06, 0, 1),       /* RST or SYN */
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_filter icmp_code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),                 /* ip saddr */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, server, 0, 9),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),                  /* fragment offset */
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 7, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                 /* x = ip header length */
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),                  /* icmp type */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_DEST_UNREACH, 0, 3),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 1),                  /* icmp code */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_PORT_UNREACH, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog;
+    if (proto == IPPROTO_TCP) {
+        prog.len = sizeof(tcp_code) / sizeof(tcp_code[0]);
+        prog.filter = tcp_code;
+    } else {
+        prog.len = sizeof(icmp_code) / sizeof(icmp_code[0]);
+        prog.filter = icmp_code;
+    }
+    if (server_addr == INADDR_ANY) {
+        prog.filter[1] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JA, 0, 0, 0);
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        perror("Error attaching marker filter");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Set up a raw socket marker replies are received on. It is created and filtered
+ * before the first marker goes out so the head reply cannot slip past the listener.
+ * @param proto IPPROTO_TCP or IPPROTO_ICMP
+ * @param server_addr see marker_filter_attach
+ * @return
+ */
+int marker_sock_setup(int proto, in_addr_t server_addr) {
+    int sockfd = socket(AF_INET, SOCK_RAW, proto);
     if (sockfd < 0) {
-        perror("Error creating socket, in rst_packet_recv\n");
+        perror("Error creating socket, in marker_sock_setup\n");
         exit(EXIT_FAILURE);
     }
 
-    char buffer[BUF_SIZE];
     struct sockaddr_in src_addr;
-    socklen_t src_addr_len = sizeof(src_addr);
+    memset(&src_addr, 0, sizeof(src_addr));
+    src_addr.sin_family = AF_INET;
     src_addr.sin_addr.s_addr = INADDR_ANY;
 
     int optVal = 1;
     if (setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &optVal, sizeof(optVal)) < 0) {
-        perror("Error setsockopt in rst_packet_recv\n");
+        perror("Error setsockopt in marker_sock_setup\n");
         exit(EXIT_FAILURE);
     }
 
     if(bind(sockfd, (struct sockaddr *)&src_addr, sizeof(src_addr)) < 0) {
-        perror("Error binding socket, in rst_packet_recv\n");
+        perror("Error binding socket, in marker_sock_setup\n");
         exit(EXIT_FAILURE);
     }
+    marker_filter_attach(sockfd, proto, server_addr);
+    if (rx_timestamps_enable(sockfd) < 0) {
+        perror("Warning: no kernel receive timestamps, falling back to user space time");
+    }
+    if (stats_rx_drops_enable(sockfd) < 0) {
+        perror("Warning: no receive queue drop counts");
+    }
+    return sockfd;
+}
 
-    struct timeval first_rst_time, second_rst_time;
-    double time_interval_high, time_interval_low;
-    int iter = 0;
-    while (1) {
-        struct iphdr *ip_header;
-        struct tcphdr *tcp_header;
+/**
+ * Wait for marker replies on the TCP and ICMP sockets and match each to its probe by the
+ * key it echoes, recording its kernel arrival time. Will be called by a thread, runs until
+ * the sender sets done.
+ * @param args detection_info, its probe table is filled in
+ * @return
+ */
+void* marker_packet_recv(void* args) {
+    struct detection_info* info = (struct detection_info*) args;
 
-        bzero(buffer, BUF_SIZE);
+    char buffer[BUF_SIZE];
+    struct timespec arrival;
+    struct pollfd fds[2];
+    for (int i = 0; i < 2; i++) {
+        fds[i].fd = info->sockfd[i];
+        fds[i].events = POLLIN;
+    }
+    while (1) {
+        pthread_mutex_lock(&info->lock);
+        int done = info->done;
+        pthread_mutex_unlock(&info->lock);
+        if (done) {
+            break;
+        }
 
-        int n = (int) recvfrom(sockfd, buffer, BUF_SIZE, 0, (struct sockaddr *)&src_addr, &src_addr_len);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                printf("Timeout\n");
-                break;
-            } else {
-                perror("Error running recvfrom()");
+        /* short, so the listener notices when the sender is done */
+        if (poll(fds, 2, REPLY_POLL_MS) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            if ((fds[i].revents & POLLIN) == 0) {
+                continue;
+            }
+            uint32_t drops = 0;    /* only reported once the socket has dropped */
+            int n = (int) stats_count_recv(recv_timestamped(fds[i].fd, buffer, BUF_SIZE, &arrival, &drops));
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    continue;
+                }
+                perror("Error running recvmsg()");
                 exit(EXIT_FAILURE);
             }
-        }
 
-        ip_header = (struct iphdr *)buffer;
-        tcp_header = (struct tcphdr *)(buffer + (ip_header->ihl * 4));
-
-        if (tcp_header->rst == 1) {
-            if (iter == 0 || iter == 2) {
-                gettimeofday(&first_rst_time, NULL);
-            } else if (iter == 1) {
-                gettimeofday(&second_rst_time, NULL);
-                time_interval_high = (double) (second_rst_time.tv_usec - first_rst_time.tv_usec) / 1000000 +
-                        (double) (second_rst_time.tv_sec - first_rst_time.tv_sec);
-            } else if (iter == 3) {
-                gettimeofday(&second_rst_time, NULL);
-                time_interval_low = (double) (second_rst_time.tv_usec - first_rst_time.tv_usec) / 1000000 +
-                        (double) (second_rst_time.tv_sec - first_rst_time.tv_sec);
-				break;
+            stats_rx_drops_set(fds[i].fd, drops);
+            capture_packet(&arrival, buffer, n);
+            /* on the raw clock at once, NTP slewing the wall clock then cannot stretch an interval */
+            mono_to_timespec(mono_from_realtime(&arrival), &arrival);
+
+            in_addr_t addr;
+            uint32_t key;
+            int proto = marker_reply_parse(buffer, n, &addr, &key);
+            if (proto == 0) {
+                continue;
             }
+            pthread_mutex_lock(&info->lock);
+            probe_match(&info->table, addr, proto, key, &arrival);
+            pthread_mutex_unlock(&info->lock);
         }
-        iter++;
     }
-    result[0] = time_interval_high;
-    result[1] = time_interval_low;
-    close(sockfd);
     return NULL;
 }
 
 
 /**
- * Set up SYN packets and send them
+ * Send a prebuilt marker packet
  * @param sock_raw
+ * @param tpl
+ */
+void marker_sender(int sock_raw, struct marker_template *tpl) {
+    int n = (int) stats_count_send(sendto(sock_raw, tpl->packet, tpl->len, 0,
+                                          (struct sockaddr *)&tpl->dest_addr, sizeof(tpl->dest_addr)));
+    if (n < 0) {
+        perror("Error sending marker packet");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Read the kernel transmit timestamps of the head and tail markers of a train off the error
+ * queue of the socket they were sent on
+ * @param sockfd socket with transmit timestamps enabled
+ * @param head_key send counter value of the first head marker
+ * @param tail_key send counter value of the first tail marker
+ * @param ports markers on each side, sent back to back
+ * @return median on-wire interval in seconds, -1 if all head or tail timestamps are missing
+ */
+double marker_tx_interval(int sockfd, uint32_t head_key, uint32_t tail_key, int ports) {
+    uint32_t keys[2 * MAX_MARKER_PORTS] = {0};
+    struct timespec sent[2 * MAX_MARKER_PORTS], heads[MAX_MARKER_PORTS], tails[MAX_MARKER_PORTS];
+    for (int i = 0; i < ports; i++) {
+        keys[i] = head_key + i;
+        keys[ports + i] = tail_key + i;
+    }
+    tx_timestamps_collect(sockfd, keys, sent, 2 * ports, 100);
+    int head_count = 0, tail_count = 0;
+    for (int i = 0; i < 2 * ports; i++) {
+        if (sent[i].tv_sec == 0 && sent[i].tv_nsec == 0) {
+            continue;
+        }
+        if (i < ports) {
+            heads[head_count++] = sent[i];
+        } else {
+            tails[tail_count++] = sent[i];
+        }
+    }
+    return interval_median(heads, head_count, tails, tail_count);
+}
+
+/**
+ * Build a complete IPv4/UDP probe packet, checksums included
+ * @param frame output, room for the headers and payload_size bytes
  * @param cf
- * @param dest_port
+ * @param saddr source, network order
+ * @param daddr destination, network order
+ * @param dport destination port, network order
+ * @param payload
+ * @param payload_size
+ * @param ip_id
+ * @return length of the packet
  */
-void syn_sender(int sock_raw, struct config *cf, int dest_port) {
-    // CITE: https://github.com/MaxXor/raw-sockets-example/blob/master/rawsockets.c
-    struct sockaddr_in dest_addr;
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_addr.s_addr = inet_addr(cf->server_ip);
-   // char packet[BUF_SIZE];
-    char* packet = calloc(BUF_SIZE, sizeof(char));
-
-    struct iphdr* ip_h = (struct iphdr*) packet;
-    struct tcphdr* tcp_h = (struct tcphdr*) (packet + sizeof(struct iphdr));
-    struct pseudo_header ps_h;
+int udp_frame_build(char *frame, struct config *cf, in_addr_t saddr, in_addr_t daddr, uint16_t dport,
+                    const char *payload, int payload_size, uint16_t ip_id) {
+    struct iphdr* ip_h = (struct iphdr*) frame;
+    struct udphdr* udp_h = (struct udphdr*) (frame + sizeof(struct iphdr));
+    int len = (int) (sizeof(struct iphdr) + sizeof(struct udphdr)) + payload_size;
 
+    memset(frame, 0, sizeof(struct iphdr) + sizeof(struct udphdr));
     ip_h->ihl = 5;
     ip_h->version = 4;
-    ip_h->tos = 0;
-    ip_h->tot_len = sizeof (struct iphdr) + sizeof (struct tcphdr) + OPT_SIZE;
-    ip_h->id = htonl (rand () % 65535);
-    ip_h->frag_off = 0;
-    ip_h->ttl = 255;
-    ip_h->protocol = IPPROTO_TCP;
-    ip_h->check = 0;
-    ip_h->saddr = inet_addr("192.168.128.2");
-    ip_h->daddr = inet_addr(cf->server_ip);
-
-    tcp_h->source = htons(12345);
-    tcp_h->dest = htons(dest_port);
-    tcp_h->seq = 0;
-    tcp_h->ack_seq = 0;
-    tcp_h->doff = 10;
-    tcp_h->fin = 0;
-    tcp_h->syn = 1;
-    tcp_h->rst = 0;
-    tcp_h->psh = 0;
-    tcp_h->ack = 0;
-    tcp_h->urg = 0;
-    tcp_h->check = 0;
-    tcp_h->window = htons (5840);
-    tcp_h->urg_ptr = 0;
+    ip_h->tot_len = htons(len);
+    ip_h->id = htons(ip_id);
+    ip_h->frag_off = htons(IP_DF);
+    ip_h->ttl = (uint8_t) strtol(cf->udp_ttl, NULL, 10);
+    ip_h->protocol = IPPROTO_UDP;
+    ip_h->saddr = saddr;
+    ip_h->daddr = daddr;
+    ip_h->check = checksum(frame, sizeof(struct iphdr));
+
+    udp_h->source = htons((int) strtol(cf->src_port_udp, NULL, 10));
+    udp_h->dest = dport;
+    udp_h->len = htons(sizeof(struct udphdr) + payload_size);
+    memcpy(frame + sizeof(struct iphdr) + sizeof(struct udphdr), payload, payload_size);
 
+    struct pseudo_header ps_h;
     memset(&ps_h, 0, sizeof(ps_h));
-    ps_h.source_address = inet_addr("192.168.128.2");
-    ps_h.dest_address = inet_addr(cf->server_ip);
-    ps_h.placeholder = 0;
-    ps_h.protocol = IPPROTO_TCP;
-    ps_h.tcp_length = htons(sizeof(struct tcphdr) + OPT_SIZE);
-
-    int pseudo_size = sizeof(struct pseudo_header) + sizeof(struct tcphdr) + OPT_SIZE;
-    char *pseudo_packet = malloc(pseudo_size);
-    memcpy(pseudo_packet, (char *) &ps_h, sizeof(struct pseudo_header));
-    memcpy(pseudo_packet + sizeof(struct pseudo_header), tcp_h, sizeof(struct tcphdr) + OPT_SIZE);
-
-    tcp_h->check = checksum(pseudo_packet, pseudo_size);
-    ip_h->check = checksum(packet, ip_h->tot_len);
-    int packet_size = ip_h->tot_len;
-
-    int n = (int) sendto(sock_raw, packet, ip_h->tot_len, 0,
-                         (struct sockaddr *)&dest_addr, sizeof(struct sockaddr));
-    if (n < 0) {
-        perror("Error sending syn packet");
-        free(cf);
-        exit(EXIT_FAILURE);
+    ps_h.source_address = ip_h->saddr;
+    ps_h.dest_address = ip_h->daddr;
+    ps_h.protocol = IPPROTO_UDP;
+    ps_h.tcp_length = udp_h->len;
+    uint64_t sum = checksum_add(&ps_h, sizeof(ps_h), 0);
+    sum = checksum_add(udp_h, sizeof(struct udphdr) + payload_size, sum);
+    udp_h->check = checksum_fold(sum);
+    if (udp_h->check == 0) {
+        udp_h->check = 0xFFFF;
     }
+    return len;
 }
 
 /**
- * send UDP packets
+ * Prebuild the head markers, UDP train and tail markers in the TX ring, then put the whole
+ * sequence on the wire with a single send so ordering and spacing are exactly as built
+ * @param ring
+ * @param cf
+ * @param dst destination of the train, the markers' address with the train's port
+ * @param head registered head markers, one per marker port
+ * @param tail registered tail markers, one per marker port
+ * @param ports
+ * @param ifHighEntropy
+ * @param ip_id next IP identification, advanced
+ * @return 0 on success, -1 if no frame came free or the frames never left, errno set
+ */
+int tx_ring_train_sender(struct tx_ring *ring, struct config *cf, const struct sockaddr_in *dst,
+                         struct marker_template *head, struct marker_template *tail, int ports,
+                         int ifHighEntropy, uint16_t *ip_id) {
+    in_addr_t saddr = ((struct iphdr *) head[0].packet)->saddr;
+    int payload_size = (int) strtol(cf->udp_payload_size, NULL, 10);
+    int packet_num = (int) strtol(cf->num_udp_packets, NULL, 10);
+    char payload[payload_size];
+    if (ifHighEntropy == 1) {
+        get_random_byte(payload_size, payload);
+    } else {
+        memset(payload, 0, payload_size);
+    }
+
+    char *frame;
+    ssize_t bytes = 0;
+    for (int i = 0; i < ports; i++) {
+        if ((frame = tx_ring_next_wait(ring)) == NULL) {
+            return -1;
+        }
+        memcpy(frame, head[i].packet, head[i].len);
+        tx_ring_commit(ring, head[i].len);
+        bytes += head[i].len;
+    }
+
+    for (int i = 0; i < packet_num; i++) {
+        payload[0] = (char) ((i >> 8) & 0xFF);
+        payload[1] = (char) (i & 0xFF);
+        if ((frame = tx_ring_next_wait(ring)) == NULL) {
+            return -1;
+        }
+        int len = udp_frame_build(frame, cf, saddr, dst->sin_addr.s_addr, dst->sin_port, payload, payload_size,
+                                  (*ip_id)++);
+        tx_ring_commit(ring, len);
+        bytes += len;
+    }
+
+    for (int i = 0; i < ports; i++) {
+        if ((frame = tx_ring_next_wait(ring)) == NULL) {
+            return -1;
+        }
+        memcpy(frame, tail[i].packet, tail[i].len);
+        tx_ring_commit(ring, tail[i].len);
+        bytes += tail[i].len;
+    }
+
+    return stats_count_send(tx_ring_flush(ring) < 0 ? -1 : bytes) < 0 ? -1 : 0;
+}
+
+/**
+ * send UDP packets, from the source address and out of the interface of the target's route
+ * like its markers, with IP_PKTINFO since one socket serves every target
  * @param dest_udp_addr
  * @param sock_udp
+ * @param route
  * @param ifHighEntropy
  * @param cf
  */
-void udp_sender(struct sockaddr_in dest_udp_addr, int sock_udp, int ifHighEntropy,
+void udp_sender(struct sockaddr_in dest_udp_addr, int sock_udp, const struct route_info *route, int ifHighEntropy,
             struct config *cf) {
     int payload_size = (int) strtol(cf->udp_payload_size, NULL, 10);
     int packet_num = (int) strtol(cf->num_udp_packets, NULL, 10);
@@ -294,17 +474,31 @@ void udp_sender(struct sockaddr_in dest_udp_addr, int sock_udp, int ifHighEntrop
     char buffer[payload_size]; /* low entropy */
     memset(buffer, 0, payload_size);
 
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {ifHighEntropy == 1 ? random : buffer, (size_t) payload_size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &dest_udp_addr;
+    msg.msg_namelen = sizeof(dest_udp_addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    struct in_pktinfo pktinfo;
+    memset(&pktinfo, 0, sizeof(pktinfo));
+    pktinfo.ipi_ifindex = route->ifindex;
+    pktinfo.ipi_spec_dst.s_addr = route->src;
+    memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
+
     for (int i = 0; i < packet_num; i++) {
         buffer[0] = (char) ((i >> 8) & 0xFF);
         buffer[1] = (char) (i & 0xFF);
-        int len;
-        if (ifHighEntropy == 1) {
-            len = (int) sendto(sock_udp, random, payload_size, 0, (struct sockaddr *)&dest_udp_addr,
-                        sizeof(struct sockaddr));
-        } else {
-            len = (int) sendto(sock_udp, buffer, payload_size, 0, (struct sockaddr *) &dest_udp_addr,
-                               sizeof(struct sockaddr));
-        }
+        int len = (int) stats_count_send(sendmsg(sock_udp, &msg, 0));
         if (len < 0) {
             perror("Error sending udp packet\n");
             close(sock_udp);
@@ -313,6 +507,318 @@ void udp_sender(struct sockaddr_in dest_udp_addr, int sock_udp, int ifHighEntrop
     }
 }
 
+/**
+ * Everything needed to put a measurement train on the wire, shared by all targets
+ */
+struct train_sender {
+    struct config *cf;
+    struct detection_info *info;
+    int ports;
+    uint16_t ip_id;
+    int sock_raw;
+    int sock_udp;
+    int use_ring;
+    struct tx_ring ring;
+    int ring_ifindex;   /* the ring is bound to this interface, other targets use sendto */
+    uint32_t tx_key;    /* transmit timestamp key of the next marker socket packet */
+    uint32_t ring_tx_key;
+};
+
+/**
+ * One destination of a campaign. Its trains are measured low entropy first; between two
+ * trains to the same target the other targets get their turn.
+ */
+struct target {
+    in_addr_t addr;
+    char name[INET_ADDRSTRLEN];
+    struct route_info route;        /* source address and egress interface */
+    int strategy;                   /* MARKER_RST etc */
+    int auto_fallback;              /* move on to the next strategy when one gets no replies */
+    struct marker_template head[MAX_MARKER_PORTS];
+    struct marker_template tail[MAX_MARKER_PORTS];
+    struct sockaddr_in dst_udp_addr;
+    struct sockaddr_ll link_addr;   /* TX ring only */
+    int entropy;                    /* level to measure next, 2 once finished */
+    int attempt;
+    int pending;                    /* train waiting for its replies, -1 if none */
+    double pending_marker_interval;
+    int measured[2];
+    double marker_interval[2];
+    int64_t evaluate_at;            /* mono_now_ns */
+    int64_t send_at;
+    int skipped;                    /* never measured, TARGET_UNREACHABLE or TARGET_NO_MARKER */
+};
+
+/**
+ * Build a target's head and tail markers for its current strategy. Head marker i leaves
+ * from MARKER_SRC_PORT + i and tail marker i from MARKER_SRC_PORT + MAX_MARKER_PORTS + i;
+ * RST markers go to the configured closed head and tail ports, SYN/ACK markers all to the
+ * open port, UDP markers to consecutive closed ports from marker_udp_port. The train goes to
+ * dst_port_udp, or with UDP markers to unreach_train_port when it is set: a train to a closed
+ * port draws a port unreachable per packet, which uses up the target's ICMP rate limit and
+ * suppresses the tail markers' errors.
+ * @param t
+ * @param cf
+ * @param ports
+ */
+void target_markers_build(struct target *t, struct config *cf, int ports) {
+    int dest_port_tcp_head = (int) strtol(cf->dst_port_tcp_head, NULL, 10);
+    int dest_port_tcp_tail = (int) strtol(cf->dst_port_tcp_tail, NULL, 10);
+    int open_port = (int) strtol(cf->marker_open_port, NULL, 10);
+    int udp_port = (int) strtol(cf->marker_udp_port, NULL, 10);
+    in_addr_t saddr = t->route.src;
+    const char *train_port = cf->dst_port_udp;
+    if (t->strategy == MARKER_UNREACH && cf->unreach_train_port[0] != '\0') {
+        train_port = cf->unreach_train_port;
+    } else if (t->strategy == MARKER_UNREACH) {
+        fprintf(stderr, "Warning: %s: unless udp port %s is open or filtered, the train's port unreachables "
+                        "use up the ICMP rate limit the markers need, see unreach_train_port\n", t->name, train_port);
+    }
+    t->dst_udp_addr.sin_port = htons((int) strtol(train_port, NULL, 10));
+    for (int i = 0; i < ports; i++) {
+        int head_src = MARKER_SRC_PORT + i;
+        int tail_src = MARKER_SRC_PORT + MAX_MARKER_PORTS + i;
+        switch (t->strategy) {
+            case MARKER_RST:
+                syn_template_init(&t->head[i], saddr, t->addr, head_src, dest_port_tcp_head + i);
+                syn_template_init(&t->tail[i], saddr, t->addr, tail_src, dest_port_tcp_tail + i);
+                break;
+            case MARKER_SYNACK:
+                syn_template_init(&t->head[i], saddr, t->addr, head_src, open_port);
+                syn_template_init(&t->tail[i], saddr, t->addr, tail_src, open_port);
+                break;
+            case MARKER_ECHO:
+                echo_template_init(&t->head[i], saddr, t->addr);
+                echo_template_init(&t->tail[i], saddr, t->addr);
+                break;
+            default:
+                udp_marker_template_init(&t->head[i], saddr, t->addr, head_src, udp_port + i);
+                udp_marker_template_init(&t->tail[i], saddr, t->addr, tail_src, udp_port + ports + i);
+                break;
+        }
+    }
+}
+
+/**
+ * Set up a target's markers and addresses, with the source address the kernel would
+ * pick for it
+ * @param t
+ * @param cf
+ * @param addr network order
+ * @param strategy marker strategy, MARKER_AUTO to start with RST and fall back in order
+ * @param ports
+ * @param use_ring
+ * @return 0 on success, -1 if there is no route or the TX ring cannot reach the target
+ */
+int target_init(struct target *t, struct config *cf, in_addr_t addr, int strategy, int ports, int use_ring) {
+    memset(t, 0, sizeof(*t));
+    t->addr = addr;
+    inet_ntop(AF_INET, &addr, t->name, sizeof(t->name));
+    t->pending = -1;
+    t->measured[0] = t->measured[1] = -1;
+    t->marker_interval[0] = t->marker_interval[1] = -1;
+    if (route_get(addr, &t->route) < 0) {
+        return -1;
+    }
+    t->auto_fallback = strategy == MARKER_AUTO;
+    t->strategy = t->auto_fallback ? MARKER_RST : strategy;
+    t->dst_udp_addr.sin_family = AF_INET;
+    t->dst_udp_addr.sin_addr.s_addr = addr;
+    target_markers_build(t, cf, ports);
+    if (use_ring && tx_ring_resolve(addr, &t->link_addr) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Register one marker per marker port in the probe table and stamp its key
+ * @param s
+ * @param t
+ * @param tpl
+ * @param train
+ * @param role
+ */
+void markers_register(struct train_sender *s, struct target *t, struct marker_template *tpl, int train, int role) {
+    pthread_mutex_lock(&s->info->lock);
+    for (int i = 0; i < s->ports; i++) {
+        int proto = ((struct iphdr *) tpl[i].packet)->protocol;
+        marker_template_set_id(&tpl[i], s->ip_id++);
+        marker_template_set_key(&tpl[i], probe_register(&s->info->table, t->addr, proto, train, role));
+    }
+    pthread_mutex_unlock(&s->info->lock);
+}
+
+/**
+ * Whether a target's trains go through the TX ring, which only reaches the targets routed
+ * out of the interface it is bound to
+ * @param s
+ * @param t
+ * @return
+ */
+int target_uses_ring(struct train_sender *s, struct target *t) {
+    return s->use_ring && t->link_addr.sll_ifindex == s->ring_ifindex;
+}
+
+/**
+ * IP bytes of one train to a target: its head and tail markers as built and the UDP packets
+ * @param t
+ * @param packet_num
+ * @param payload_size
+ * @param ports
+ * @return
+ */
+double target_train_bytes(struct target *t, int packet_num, int payload_size, int ports) {
+    double bytes = (double) packet_num * (payload_size + (int) (sizeof(struct iphdr) + sizeof(struct udphdr)));
+    for (int i = 0; i < ports; i++) {
+        bytes += t->head[i].len + t->tail[i].len;
+    }
+    return bytes;
+}
+
+/**
+ * Send head markers, a UDP train of the given entropy and tail markers to a target
+ * @param s
+ * @param t
+ * @param train probe table train index
+ * @param ifHighEntropy
+ * @return on-wire marker interval from transmit timestamps, -1 if unavailable
+ */
+double train_send(struct train_sender *s, struct target *t, int train, int ifHighEntropy) {
+    int packet_num = (int) strtol(s->cf->num_udp_packets, NULL, 10);
+    markers_register(s, t, t->head, train, PROBE_HEAD);
+    markers_register(s, t, t->tail, train, PROBE_TAIL);
+
+    uint32_t head_key, tail_key;
+    if (target_uses_ring(s, t)) {
+        s->ring.addr = t->link_addr;
+        if (tx_ring_train_sender(&s->ring, s->cf, &t->dst_udp_addr, t->head, t->tail, s->ports, ifHighEntropy,
+                                 &s->ip_id) == 0) {
+            head_key = s->ring_tx_key;
+            tail_key = head_key + s->ports + packet_num;
+            s->ring_tx_key = tail_key + s->ports;
+            return marker_tx_interval(s->ring.fd, head_key, tail_key, s->ports);
+        }
+        /* frames the kernel still holds keep the ring out of use for good */
+        perror("Warning: the TX ring failed, sending with sendto from now on");
+        s->use_ring = 0;
+    }
+    head_key = s->tx_key;
+    for (int i = 0; i < s->ports; i++) {
+        marker_sender(s->sock_raw, &t->head[i]);
+    }
+    udp_sender(t->dst_udp_addr, s->sock_udp, &t->route, ifHighEntropy, s->cf);
+    for (int i = 0; i < s->ports; i++) {
+        marker_sender(s->sock_raw, &t->tail[i]);
+    }
+    tail_key = head_key + s->ports;
+    s->tx_key = tail_key + s->ports;
+    return marker_tx_interval(s->sock_raw, head_key, tail_key, s->ports);
+}
+
+/**
+ * Decide on a target's pending train once its replies had REPLY_WAIT_MS to arrive: keep it,
+ * resend it up to retries times, then fall back to the next marker strategy if the target
+ * has automatic fallback, or give the target up
+ * @param t
+ * @param info
+ * @param cf
+ * @param ports
+ * @param retries
+ */
+void target_evaluate(struct target *t, struct detection_info *info, struct config *cf, int ports, int retries) {
+    const char *train_name[2] = {"low", "high"};
+    pthread_mutex_lock(&info->lock);
+    int heads = probe_answered(&info->table, t->pending, PROBE_HEAD);
+    int tails = probe_answered(&info->table, t->pending, PROBE_TAIL);
+    pthread_mutex_unlock(&info->lock);
+    printf("%s: received %d/%d head and %d/%d tail %s replies\n", t->name, heads, ports, tails, ports,
+           marker_names[t->strategy]);
+
+    if (heads > 0 && tails > 0) {
+        t->measured[t->entropy] = t->pending;
+        t->marker_interval[t->entropy] = t->pending_marker_interval;
+        t->entropy++;
+        t->attempt = 0;
+    } else if (++t->attempt <= retries) {
+        printf("%s: replies missing, resending the %s entropy train\n", t->name, train_name[t->entropy]);
+    } else if (t->auto_fallback && t->strategy + 1 < MARKER_STRATEGIES) {
+        /* both trains of a verdict must use the same markers, so start over */
+        t->strategy++;
+        printf("%s: falling back to %s markers\n", t->name, marker_names[t->strategy]);
+        target_markers_build(t, cf, ports);
+        t->entropy = 0;
+        t->attempt = 0;
+        t->measured[0] = t->measured[1] = -1;
+        t->marker_interval[0] = t->marker_interval[1] = -1;
+    } else {
+        t->entropy = 2;
+    }
+    t->pending = -1;
+}
+
+/**
+ * Print the intervals and the verdict of a target
+ * @param t
+ * @param info
+ * @param cf
+ * @param log results log to append the verdict to, NULL for none
+ */
+void target_report(struct target *t, struct detection_info *info, struct config *cf, struct results_log *log) {
+    /* entropy 0 is the low entropy train, 1 the high entropy one */
+    const char *train_name[2] = {"low", "high"};
+    double reply_interval[2];
+    if (t->skipped == TARGET_NO_MARKER) {
+        printf("Target %s: no usable marker\n", t->name);
+        return;
+    }
+    printf("Target %s, %s markers\n", t->name, marker_names[t->strategy]);
+    for (int i = 0; i < 2; i++) {
+        reply_interval[i] = t->measured[i] < 0 ? -1 : probe_interval(&info->table, t->measured[i]);
+        if (reply_interval[i] < 0) {
+            printf("Time interval %s entropy: replies missing\n", train_name[i]);
+        } else {
+            printf("Time interval %s entropy: %f\n", train_name[i], reply_interval[i]);
+        }
+        if (t->marker_interval[i] < 0) {
+            printf("Marker send interval %s entropy: unavailable\n", train_name[i]);
+        } else {
+            printf("Marker send interval %s entropy: %f\n", train_name[i], t->marker_interval[i]);
+        }
+    }
+    struct result_summary result;
+    memset(&result, 0, sizeof(result));
+    if (reply_interval[0] <= 0 || reply_interval[1] < 0) {
+        printf("Failed to detect due to insufficient information\n");
+        result.verdict = RESULT_FAILED;
+    } else {
+        /* the median over marker pairs gives no usable variance, so only the relative slowdown is used */
+        double slowdown = reply_interval[1] / reply_interval[0] - 1;
+        printf("Slowdown of high entropy train: %.2f%% (threshold %s)\n", slowdown * 100, cf->slowdown_threshold);
+        if (slowdown > strtod(cf->slowdown_threshold, NULL)) {
+            printf("Compression detected\n");
+            result.verdict = RESULT_COMPRESSION;
+        } else {
+            printf("No compression detected\n");
+            result.verdict = RESULT_NONE;
+        }
+        result.slowdown = slowdown;
+    }
+    if (log == NULL) {
+        return;
+    }
+    result.target = t->addr;
+    result.source = RESULT_SOURCE_STANDALONE;
+    result.payload_size = (uint16_t) strtol(cf->udp_payload_size, NULL, 10);
+    result.packets = (uint32_t) strtol(cf->num_udp_packets, NULL, 10);
+    result.interval[0] = reply_interval[0];
+    result.interval[1] = reply_interval[1];
+    snprintf(result.detail, sizeof(result.detail), "%s", marker_names[t->strategy]);
+    if (results_log_append(log, &result, NULL, 0) < 0) {
+        perror("Error appending to the results log");
+    }
+}
+
 /**
  * main
  * @param argc
@@ -326,78 +832,227 @@ int main(int argc, char *argv[]) {
     FILE *file = fopen("myconfig.json", "r");
     cJSON* root = read_file_config(file);
     get_configuration(cf, root);
+    long retries;
+    if (config_long(cf->train_retries, 0, INT_MAX - 1, &retries) < 0) {
+        fprintf(stderr, "train_retries must be a whole number of at least 0, not %s\n", cf->train_retries);
+        exit(EXIT_FAILURE);
+    }
+    long ports_set;
+    if (config_long(cf->num_marker_ports, 1, INT_MAX, &ports_set) < 0) {
+        fprintf(stderr, "num_marker_ports must be a whole number of at least 1, not %s\n", cf->num_marker_ports);
+        exit(EXIT_FAILURE);
+    }
+    stats_init("standalone", cf->stats_socket);
+    int phase = stats_phase_begin("setup");
+
+    int target_count = 1;
+    struct target_entry *entries;
+    if (cf->targets_file[0] != '\0') {
+        entries = targets_load(cf->targets_file, &target_count);
+    } else {
+        entries = (struct target_entry *) calloc(1, sizeof(struct target_entry));
+        entries[0].addr = inet_addr(cf->server_ip);
+    }
+    int default_strategy = marker_strategy_parse(cf->marker_strategy);
+    if (default_strategy == MARKER_INVALID) {
+        fprintf(stderr, "Unknown marker strategy %s\n", cf->marker_strategy);
+        exit(EXIT_FAILURE);
+    }
+    struct results_log results, *log = NULL;
+    if (cf->results_log[0] != '\0') {
+        if (results_log_open(&results, cf->results_log) < 0) {
+            perror("Error opening the results log");
+            exit(EXIT_FAILURE);
+        }
+        log = &results;
+    }
+    if (cf->capture_file[0] != '\0' &&
+        capture_open(cf->capture_file, "standalone", strtol(cf->capture_headers_only, NULL, 10) != 0) < 0) {
+        perror("Error opening the capture file");
+        exit(EXIT_FAILURE);
+    }
 
     printf("Setting up raw socket...\n");
 
     int sock_raw = sock_setup();
-    int dest_port_tcp_head = (int) strtol(cf->dst_port_tcp_head, NULL, 10);
-    struct sockaddr_in head_dst_addr;
-    head_dst_addr.sin_family = AF_INET;
-    head_dst_addr.sin_port = htons(dest_port_tcp_head);
-    head_dst_addr.sin_addr.s_addr = inet_addr(cf->server_ip);
-
-    struct sockaddr_in tail_dst_addr;
-    int dest_port_tcp_tail = (int) strtol(cf->dst_port_tcp_tail, NULL, 10);
-    tail_dst_addr.sin_family = AF_INET;
-    tail_dst_addr.sin_port = htons(dest_port_tcp_tail);
-    tail_dst_addr.sin_addr.s_addr = inet_addr(cf->server_ip);
-
-    struct sockaddr_in src_addr;
-    src_addr.sin_family = AF_INET;
-    src_addr.sin_addr.s_addr = inet_addr("192.168.128.2");
-
-
     int sock_udp = udp_packet_create(cf);
 
-    struct sockaddr_in dst_udp_addr;
-    int dest_port_udp = (int) strtol(cf->dst_port_udp, NULL, 10);
-    dst_udp_addr.sin_family = AF_INET;
-    dst_udp_addr.sin_port = htons(dest_port_udp);
-    dst_udp_addr.sin_addr.s_addr = inet_addr(cf->server_ip);
-
-    double time_diff[2];
     pthread_t thread;
-    double result[2];
+    struct detection_info info;
+    int ports = marker_ports(cf);
+    int capacity = probe_capacity(target_count, (int) retries, ports);
+    if (capacity < 0) {
+        fprintf(stderr, "%d targets with %ld train retries need too many probes\n", target_count, retries);
+        exit(EXIT_FAILURE);
+    }
+    probe_table_init(&info.table, (uint32_t) rand(), capacity);
+    pthread_mutex_init(&info.lock, NULL);
+    info.done = 0;
+    in_addr_t only = target_count == 1 ? entries[0].addr : INADDR_ANY;
+    info.sockfd[0] = marker_sock_setup(IPPROTO_TCP, only);
+    info.sockfd[1] = marker_sock_setup(IPPROTO_ICMP, only);
 
-    int n = pthread_create(&thread, NULL, rst_packet_recv, (void*)&result);
+    int n = pthread_create(&thread, NULL, marker_packet_recv, (void*)&info);
     if (n < 0) {
-        perror("Error creating thread, rst_packet_recv\n");
+        perror("Error creating thread, marker_packet_recv\n");
         free(cf);
         close(sock_raw);
         close(sock_udp);
         exit(EXIT_FAILURE);
     }
 
-    printf("sending head syn...\n");
-    syn_sender(sock_raw, cf, dest_port_tcp_head);
-    printf("finished sending head syn\nSending low entropy udp packets...\n");
-    udp_sender(dst_udp_addr, sock_udp, 0, cf);
-    printf("finished sending low entropy udp packets\nSending tail syn...\n");
-    syn_sender(sock_raw, cf, dest_port_tcp_tail);
+    struct train_sender sender;
+    sender.cf = cf;
+    sender.info = &info;
+    sender.ports = ports;
+    sender.ip_id = (uint16_t) rand();
+    sender.sock_raw = sock_raw;
+    sender.sock_udp = sock_udp;
+    sender.tx_key = 0;
+    sender.ring_tx_key = 0;
+
+    sender.use_ring = (int) strtol(cf->tx_ring, NULL, 10) != 0;
+    int packet_num = (int) strtol(cf->num_udp_packets, NULL, 10);
+    int payload_size = (int) strtol(cf->udp_payload_size, NULL, 10);
+    if (sender.use_ring) {
+        if (tx_ring_setup(&sender.ring, entries[0].addr, packet_num + 2 * ports,
+                          sizeof(struct iphdr) + sizeof(struct udphdr) + payload_size) < 0) {
+            perror("Error setting up the TX ring");
+            exit(EXIT_FAILURE);
+        }
+        /* every frame of the train is stamped, make room so the tail's timestamps are kept */
+        int rcvbuf = (packet_num + 2 * ports) * 1024;
+        setsockopt(sender.ring.fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf));
+        sender.ring_ifindex = sender.ring.addr.sll_ifindex;
+    }
+    /* the kernel numbers stamped packets per socket from 0, in send order */
+    if (tx_timestamps_enable(sock_raw) < 0 || (sender.use_ring && tx_timestamps_enable(sender.ring.fd) < 0)) {
+        perror("Warning: no kernel transmit timestamps");
+    }
+
+    struct target *targets = (struct target *) calloc(target_count, sizeof(struct target));
+    if (targets == NULL) {
+        perror("Error allocating targets");
+        exit(EXIT_FAILURE);
+    }
+    int remaining = 0;
+    for (int i = 0; i < target_count; i++) {
+        int strategy = default_strategy;
+        if (entries[i].marker[0] != '\0') {
+            strategy = marker_strategy_parse(entries[i].marker);
+        }
+        if (strategy == MARKER_INVALID) {
+            struct target *t = &targets[i];
+            t->addr = entries[i].addr;
+            inet_ntop(AF_INET, &t->addr, t->name, sizeof(t->name));
+            t->pending = -1;
+            t->measured[0] = t->measured[1] = -1;
+            t->marker_interval[0] = t->marker_interval[1] = -1;
+            fprintf(stderr, "Skipping target %s with unknown marker strategy %s\n", t->name, entries[i].marker);
+            t->entropy = 2;
+            t->skipped = TARGET_NO_MARKER;
+        } else if (target_init(&targets[i], cf, entries[i].addr, strategy, ports, sender.use_ring) < 0) {
+            fprintf(stderr, "Skipping unreachable target %s\n", targets[i].name);
+            targets[i].entropy = 2;
+            targets[i].skipped = TARGET_UNREACHABLE;
+        } else {
+            char src[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &targets[i].route.src, src, sizeof(src));
+            printf("%s: source %s on %s%s\n", targets[i].name, src, targets[i].route.ifname,
+                   sender.use_ring && !target_uses_ring(&sender, &targets[i]) ? ", not the TX ring's interface" : "");
+            remaining++;
+        }
+    }
+    free(entries);
 
+    /*
+     * One train is on the wire at a time. A target waits inter_measure_time between its own
+     * trains, other targets' trains fill the gap, and the budget caps the average egress rate.
+     */
+    const char *train_name[2] = {"low", "high"};
     int inter_time = (int) strtol(cf->inter_measure_time, NULL, 10);
-    sleep(inter_time);
-
-    printf("Sending head syn...\n");
-    syn_sender(sock_raw, cf, dest_port_tcp_head);
-    printf("Sending high entropy udp packets...\n");
-    udp_sender(dst_udp_addr, sock_udp, 1, cf);
-    printf("finished sending high entropy udp packets\nSending tail syn...\n");
-    syn_sender(sock_raw, cf, dest_port_tcp_tail);
-    
+    /* the bucket holds a train with the largest markers, each train takes what it sends */
+    double max_train_bytes = (double) (packet_num * (payload_size + (int) (sizeof(struct iphdr) + sizeof(struct udphdr))) +
+                                       2 * ports * (int) MARKER_MAX_LEN);
+    struct egress_budget budget;
+    egress_budget_init(&budget, strtod(cf->egress_budget_mbps, NULL), max_train_bytes);
+    int64_t start = mono_now_ns();
+    for (int i = 0; i < target_count; i++) {
+        targets[i].send_at = start;
+    }
+    int trains = 0;
+    stats_phase_end(phase);
+    while (remaining > 0) {
+        struct target *next = NULL;
+        int64_t when = 0;
+        for (int i = 0; i < target_count; i++) {
+            struct target *t = &targets[i];
+            if (t->entropy == 2) {
+                continue;
+            }
+            int64_t at = t->pending >= 0 ? t->evaluate_at : t->send_at;
+            if (next == NULL || at < when) {
+                next = t;
+                when = at;
+            }
+        }
+        int64_t now = mono_now_ns();
+        if (when > now) {
+            sleep_until(when);
+            stats_idle_add((double) (when - now) / 1e9);
+        }
+
+        if (next->pending >= 0) {
+            target_evaluate(next, &info, cf, ports, (int) retries);
+            if (next->entropy == 2) {
+                remaining--;
+            }
+            continue;
+        }
+        egress_budget_take(&budget, target_train_bytes(next, packet_num, payload_size, ports));
+        printf("%s: sending %d head %s markers, %s entropy udp packets and %d tail markers%s...\n", next->name,
+               ports, marker_names[next->strategy], train_name[next->entropy], ports,
+               target_uses_ring(&sender, next) ? " through the TX ring" : "");
+        next->pending = trains++;
+        char phase_name[STATS_NAME_LEN];
+        snprintf(phase_name, sizeof(phase_name), "%s %s train", next->name, train_name[next->entropy]);
+        phase = stats_phase_begin(phase_name);
+        next->pending_marker_interval = train_send(&sender, next, next->pending, next->entropy);
+        stats_phase_end(phase);
+        now = mono_now_ns();
+        next->evaluate_at = now + (int64_t) REPLY_WAIT_MS * 1000000;
+        next->send_at = now + (int64_t) inter_time * 1000000000;
+    }
+
+    phase = stats_phase_begin("report");
+    stats_rx_drops_refresh(info.sockfd[0]);
+    stats_rx_drops_refresh(info.sockfd[1]);
+    pthread_mutex_lock(&info.lock);
+    info.done = 1;
+    pthread_mutex_unlock(&info.lock);
     pthread_join(thread, NULL);
-    
-    printf("Time interval high entropy: %f\n", result[0]);
-    printf("Time interval low entropy: %f\n", result[1]);
-    if (result[0] - result[1] > 100) {
-        printf("Compression detected\n");
-    } else {
-        printf("No compression detected\n");
+    if (sender.use_ring) {
+        tx_ring_close(&sender.ring);
     }
-    
+
+    for (int i = 0; i < target_count; i++) {
+        if (targets[i].skipped == TARGET_UNREACHABLE) {
+            continue;
+        }
+        target_report(&targets[i], &info, cf, log);
+    }
+    if (log != NULL) {
+        results_log_close(log);
+    }
+    stats_phase_end(phase);
+
+    free(targets);
+    probe_table_free(&info.table);
     free(cf);
     close(sock_raw);
     close(sock_udp);
+    close(info.sockfd[0]);
+    close(info.sockfd[1]);
     return 0;
 
 }
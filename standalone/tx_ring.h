@@ -0,0 +1,295 @@
+//
+// AF_PACKET TX ring (PACKET_MMAP) for sending prebuilt IPv4 frames back to back.
+//
+
+#ifndef TX_RING_H
+#define TX_RING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include "route.h"
+
+#define TX_RING_FRAMES_PER_BLOCK 32
+#define TX_RING_FLUSH_TIMEOUT_MS 10000  /* a frame stuck longer, link down or qdisc stalled, fails the flush */
+
+struct tx_ring {
+    int fd;
+    char* map;
+    size_t map_len;
+    unsigned int block_size;
+    unsigned int frames_per_block;
+    unsigned int frame_size;
+    unsigned int frame_nr;
+    unsigned int next;      /* the kernel walks the ring circularly, so this never rewinds */
+    unsigned int pending;
+    struct sockaddr_ll addr;
+};
+
+/**
+ * neighbour_lookup - read the link-layer address of an on-link neighbour from /proc/net/arp
+ * @param addr network order
+ * @param ifname
+ * @param mac output, 6 bytes
+ * @return 0 on success, -1 if the neighbour is not resolved
+ */
+int neighbour_lookup(in_addr_t addr, const char* ifname, unsigned char* mac) {
+    FILE* file = fopen("/proc/net/arp", "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[256], ip[32], hw[32], dev[IF_NAMESIZE];
+    unsigned int flags;
+    int found = -1;
+    if (fgets(line, sizeof(line), file) == NULL) {
+        fclose(file);
+        return -1;
+    }
+    while (found < 0 && fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%31s %*s %x %31s %*s %15s", ip, &flags, hw, dev) != 4) {
+            continue;
+        }
+        if (inet_addr(ip) != addr || strcmp(dev, ifname) != 0 || (flags & 0x2) == 0) { /* ATF_COM */
+            continue;
+        }
+        if (sscanf(hw, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2],
+                   &mac[3], &mac[4], &mac[5]) == 6) {
+            found = 0;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+/**
+ * neighbour_resolve - look the neighbour up, poking the kernel with a datagram to the
+ * destination and retrying for up to a second if it is not in the cache yet
+ * @param dst final destination, network order
+ * @param next_hop network order
+ * @param ifname
+ * @param mac output
+ * @return 0 on success, -1 on failure
+ */
+int neighbour_resolve(in_addr_t dst, in_addr_t next_hop, const char* ifname, unsigned char* mac) {
+    for (int attempt = 0; attempt < 20; attempt++) {
+        if (neighbour_lookup(next_hop, ifname, mac) == 0) {
+            return 0;
+        }
+        if (attempt == 0) {
+            int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (sockfd >= 0) {
+                struct sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = dst;
+                addr.sin_port = htons(9); /* discard */
+                sendto(sockfd, "", 0, 0, (struct sockaddr*) &addr, sizeof(addr));
+                close(sockfd);
+            }
+        }
+        usleep(50000);
+    }
+    return -1;
+}
+
+/**
+ * tx_ring_resolve - link-layer destination for an IPv4 destination: egress interface and
+ * MAC address of the next hop
+ * @param dst network order
+ * @param addr output
+ * @return 0 on success, -1 on failure
+ */
+int tx_ring_resolve(in_addr_t dst, struct sockaddr_ll* addr) {
+    struct route_info route;
+    memset(addr, 0, sizeof(*addr));
+    if (route_get(dst, &route) < 0) {
+        fprintf(stderr, "no route to destination for the TX ring\n");
+        return -1;
+    }
+    addr->sll_family = AF_PACKET;
+    addr->sll_protocol = htons(ETH_P_IP);
+    addr->sll_ifindex = route.ifindex;
+    addr->sll_halen = ETH_ALEN;
+    if (neighbour_resolve(dst, route.gateway != 0 ? route.gateway : dst, route.ifname, addr->sll_addr) < 0) {
+        fprintf(stderr, "could not resolve the next hop on %s\n", route.ifname);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * tx_ring_setup - open a cooked AF_PACKET socket towards the next hop of dst with a TX ring
+ * of at least frame_nr frames, each able to hold max_len bytes of IP packet. Frames go to
+ * ring->addr, which may be pointed at another destination from tx_ring_resolve between flushes.
+ * @param ring
+ * @param dst network order
+ * @param frame_nr
+ * @param max_len
+ * @return 0 on success, -1 on failure with errno set by the failing call
+ */
+int tx_ring_setup(struct tx_ring* ring, in_addr_t dst, unsigned int frame_nr, unsigned int max_len) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    if (tx_ring_resolve(dst, &ring->addr) < 0) {
+        return -1;
+    }
+
+    ring->fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+    if (ring->fd < 0) {
+        return -1;
+    }
+    int version = TPACKET_V2, one = 1;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        close(ring->fd);
+        return -1;
+    }
+    /* best effort, hand frames straight to the driver instead of the qdisc */
+    setsockopt(ring->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+    unsigned int page = (unsigned int) getpagesize();
+    ring->frame_size = TPACKET_ALIGN(TPACKET2_HDRLEN + max_len);
+    ring->block_size = (ring->frame_size * TX_RING_FRAMES_PER_BLOCK + page - 1) / page * page;
+    ring->frames_per_block = ring->block_size / ring->frame_size;
+    struct tpacket_req req;
+    req.tp_block_size = ring->block_size;
+    req.tp_block_nr = (frame_nr + ring->frames_per_block - 1) / ring->frames_per_block;
+    req.tp_frame_size = ring->frame_size;
+    req.tp_frame_nr = req.tp_block_nr * ring->frames_per_block;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->frame_nr = req.tp_frame_nr;
+    ring->map_len = (size_t) req.tp_block_size * req.tp_block_nr;
+    ring->map = (char*) mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (bind(ring->fd, (struct sockaddr*) &ring->addr, sizeof(ring->addr)) < 0) {
+        munmap(ring->map, ring->map_len);
+        close(ring->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * tx_ring_header - header of frame i; frames never straddle a block, and every block
+ * holds the same number of frames
+ * @param ring
+ * @param i
+ * @return
+ */
+struct tpacket2_hdr* tx_ring_header(struct tx_ring* ring, unsigned int i) {
+    return (struct tpacket2_hdr*) (ring->map + (size_t) (i / ring->frames_per_block) * ring->block_size +
+                                   (size_t) (i % ring->frames_per_block) * ring->frame_size);
+}
+
+/**
+ * tx_ring_next - claim the next frame for filling
+ * @param ring
+ * @return pointer to the packet data area, NULL when the ring is full
+ */
+char* tx_ring_next(struct tx_ring* ring) {
+    if (ring->pending >= ring->frame_nr) {
+        return NULL;
+    }
+    struct tpacket2_hdr* hdr = tx_ring_header(ring, ring->next);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+        return NULL;
+    }
+    return (char*) hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+}
+
+/**
+ * tx_ring_commit - hand the frame claimed by tx_ring_next to the kernel
+ * @param ring
+ * @param len bytes of IP packet written
+ */
+void tx_ring_commit(struct tx_ring* ring, unsigned int len) {
+    struct tpacket2_hdr* hdr = tx_ring_header(ring, ring->next);
+    hdr->tp_len = len;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    ring->next = (ring->next + 1) % ring->frame_nr;
+    ring->pending++;
+}
+
+/**
+ * tx_ring_flush - transmit every committed frame in ring order with a single send and
+ * wait until the kernel has released them, for at most TX_RING_FLUSH_TIMEOUT_MS
+ * @param ring
+ * @return 0 on success, -1 on failure with errno ETIMEDOUT if frames stayed with the kernel;
+ * the ring is unusable after a failure
+ */
+int tx_ring_flush(struct tx_ring* ring) {
+    if (sendto(ring->fd, NULL, 0, 0, (struct sockaddr*) &ring->addr, sizeof(ring->addr)) < 0) {
+        return -1;
+    }
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned int first = (ring->next + ring->frame_nr - ring->pending) % ring->frame_nr;
+    for (unsigned int i = 0; i < ring->pending; i++) {
+        struct tpacket2_hdr* hdr = tx_ring_header(ring, (first + i) % ring->frame_nr);
+        unsigned int status;
+        while ((status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE)) != TP_STATUS_AVAILABLE) {
+            if (status == TP_STATUS_WRONG_FORMAT) {
+                errno = EINVAL;
+                return -1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >=
+                TX_RING_FLUSH_TIMEOUT_MS) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            struct pollfd pfd = { .fd = ring->fd, .events = POLLOUT };
+            poll(&pfd, 1, 10);
+        }
+    }
+    ring->pending = 0;
+    return 0;
+}
+
+/**
+ * tx_ring_next_wait - claim the next frame like tx_ring_next, but when the ring is full send
+ * the frames committed so far and wait for the kernel to release one
+ * @param ring
+ * @return pointer to the packet data area, NULL if sending failed or no frame came free
+ */
+char* tx_ring_next_wait(struct tx_ring* ring) {
+    char* frame = tx_ring_next(ring);
+    for (int attempt = 0; frame == NULL && attempt < 100; attempt++) {
+        if (ring->pending > 0) {
+            if (tx_ring_flush(ring) < 0) {
+                return NULL;
+            }
+        } else {
+            struct pollfd pfd = { .fd = ring->fd, .events = POLLOUT };
+            poll(&pfd, 1, 10);
+        }
+        frame = tx_ring_next(ring);
+    }
+    return frame;
+}
+
+void tx_ring_close(struct tx_ring* ring) {
+    if (ring->map != NULL && ring->map != MAP_FAILED) {
+        munmap(ring->map, ring->map_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+}
+
+#endif //TX_RING_H